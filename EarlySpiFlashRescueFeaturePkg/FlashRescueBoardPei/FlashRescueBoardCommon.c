@@ -7,171 +7,1520 @@
 
 #include <Uefi.h>
 #include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
+#include <Library/FlashRescueDigestLib.h>
+#include <Library/FlashRescueLogLib.h>
+#include <Library/MemoryAllocationLib.h>
 #include <Library/PcdLib.h>
-#include <Library/SerialPortLib.h>
 #include <Library/SpiLib.h>
 #include <Library/TimerLib.h>
 #include <Protocol/Spi2.h>
 #include "FlashRescueBoard.h"
 
-// TODO: Appropriate size
-static UINT16 XferBlockSize = FixedPcdGet16 (PcdDataXferPacketSize);
+// Located once, as a session begins. Commands use the arena's buffers rather than the stack,
+// which is small in CAR
+typedef struct {
+  PCH_SPI2_PROTOCOL               *Spi2Ppi;
+  BOOLEAN                         PermanentMemory;
+  FLASH_RESCUE_DIGEST_PROCESSORS  *Processors;  // Digest blocks on every processor
+  UINT8                           *Arena;
+  UINTN                           ArenaBlocks;
+  UINT8                           *Scratch;     // One block, for reads of SPI flash
+  UINT8                           *Window;      // The remainder, for data exchanged with userspace
+  UINTN                           WindowBlocks;
+} FLASH_RESCUE_BOARD_SESSION;
+
+STATIC FLASH_RESCUE_BOARD_SESSION  mSession;
+
+// Userspace that calibrates the link may choose another size, with SET_XFER
+STATIC UINT16 mXferBlockSize = FixedPcdGet16 (PcdDataXferPacketSize);
+
+// Negotiated with userspace, otherwise CRC32
+STATIC UINT8                         mDigestType = FLASH_RESCUE_DIGEST_CRC32;
+STATIC FLASH_RESCUE_DIGEST_FUNCTION  mDigestFunction = NULL;
+
+// Digest of each BIOS region block, computed once and invalidated as blocks are programmed
+STATIC UINT64   *mDigestCache = NULL;
+STATIC BOOLEAN  *mDigestCacheValid = NULL;
+STATIC UINTN    mDigestCacheBlocks = 0;
+
+// Manifest of the last verified session, which is voided before anything else is programmed
+STATIC UINTN    mManifestBlock = FixedPcdGet16 (PcdFlashRescueManifestBlock);
+STATIC UINTN    mManifestBlockCount = FixedPcdGet16 (PcdFlashRescueManifestBlockCount);
+STATIC BOOLEAN  mManifestInvalidated = FALSE;
+
+// Userspace that understands log frames, so DEBUG() output may precede responses
+STATIC BOOLEAN  mLogFramesEnabled = FALSE;
+
+// Baud rate in use, where zero is the transport's default. A new one is reverted unless confirmed
+STATIC UINT64   mBaudRate = 0;
+STATIC UINT64   mPreviousBaudRate = 0;
+STATIC BOOLEAN  mBaudRatePending = FALSE;
+STATIC UINT64   mBaudConfirmDeadlineNs;
+
+/**
+ * Send HELLO command to an awaiting userspace.
+ *
+ * @param[in] WaitTimeout  Milliseconds to await an acknowledgement.
+ *
+ * @return EFI_SUCCESS  Command acknowledged.
+ * @return EFI_TIMEOUT  Command timed-out.
+**/
+EFI_STATUS
+EFIAPI
+SendHelloPacket (
+  IN UINT32  WaitTimeout
+  )
+{
+  EARLY_FLASH_RESCUE_COMMAND   CommandPacket;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+  UINT64                       WaitTimeoutNs;
+  UINT64                       ResendIntervalNs;
+  UINT64                       StartTimeNs;
+  UINT64                       SentTimeNs;
+  UINT64                       TimeNs;
+
+  // Short waits are a burst of HELLOs, so that one lost packet is survivable
+  WaitTimeoutNs = MultU64x32 (WaitTimeout, NS_IN_MS);
+  ResendIntervalNs = MultU64x32 (
+                       MAX (MIN (WaitTimeout / HELLO_BURST_LENGTH, HELLO_RESEND_INTERVAL_MS), 1),
+                       NS_IN_MS
+                       );
+
+  // TODO: Consider sending a total `BlockNumber`?
+  CommandPacket.Command = EARLY_FLASH_RESCUE_COMMAND_HELLO;
+  CommandPacket.BlockNumber = 0;
+
+  StartTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
+  TimeNs = StartTimeNs;
+  while ((TimeNs - StartTimeNs) < WaitTimeoutNs) {
+    // Maybe packet was not in FIFO
+    RescueTransportWrite ((UINT8 *)&CommandPacket, sizeof (CommandPacket));
+
+    // Poll, as reads may block forever without a userspace
+    SentTimeNs = TimeNs;
+    while (((TimeNs - SentTimeNs) < ResendIntervalNs) &&
+           ((TimeNs - StartTimeNs) < WaitTimeoutNs))
+    {
+      if (RescueTransportPoll ()) {
+        RescueTransportRead ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+        if (ResponsePacket.Acknowledge == 1) {
+          return EFI_SUCCESS;
+        }
+      }
+
+      TimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
+    }
+  }
+
+  return EFI_TIMEOUT;
+}
+
+/**
+ * Probe for an awaiting userspace, on the boot path.
+ * Boards without a userspace attached continue within PcdUserspaceHostProbeTimeout.
+ *
+ * @return EFI_SUCCESS  Userspace acknowledged HELLO.
+ * @return EFI_TIMEOUT  No userspace is attached.
+**/
+EFI_STATUS
+EFIAPI
+ProbeForUserspace (
+  VOID
+  )
+{
+  UINT32  ProbeTimeout;
+
+  // Zero preserves the full wait, for a userspace attached after power-on
+  ProbeTimeout = FixedPcdGet32 (PcdUserspaceHostProbeTimeout);
+  if (ProbeTimeout == 0) {
+    ProbeTimeout = FixedPcdGet32 (PcdUserspaceHostWaitTimeout);
+  }
+
+  return SendHelloPacket (ProbeTimeout);
+}
+
+/**
+ * Begin a session: locate the SPI PPI, then allocate the buffer arena.
+ * - The arena takes a share of free memory, halving until it can be allocated
+ *
+ * @return EFI_SUCCESS           Session is ready.
+ * @return EFI_OUT_OF_RESOURCES  Not even ARENA_MIN_BLOCKS could be allocated.
+**/
+EFI_STATUS
+EFIAPI
+CreateSession (
+  VOID
+  )
+{
+  UINTN  Blocks;
+
+  mSession.Spi2Ppi = GetSpiPpi ();
+  mSession.PermanentMemory = InPermanentMemory ();
+  mSession.Processors = GetDigestProcessors ();
+
+  Blocks = GetFreeMemorySize () / ARENA_MEMORY_SHARE / SIZE_BLOCK;
+  Blocks = MAX (MIN (Blocks, ARENA_MAX_BLOCKS), ARENA_MIN_BLOCKS);
+  while (TRUE) {
+    mSession.Arena = AllocatePages (EFI_SIZE_TO_PAGES (Blocks * SIZE_BLOCK));
+    if ((mSession.Arena != NULL) || (Blocks == ARENA_MIN_BLOCKS)) {
+      break;
+    }
+
+    Blocks = MAX (Blocks / 2, ARENA_MIN_BLOCKS);
+  }
+
+  if (mSession.Arena == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  mSession.ArenaBlocks  = Blocks;
+  mSession.Scratch      = mSession.Arena;
+  mSession.Window       = mSession.Arena + SIZE_BLOCK;
+  mSession.WindowBlocks = Blocks - 1;
+  return EFI_SUCCESS;
+}
+
+/**
+ * Free the buffer arena, once userspace is done.
+**/
+VOID
+EFIAPI
+DestroySession (
+  VOID
+  )
+{
+  if (mSession.Arena != NULL) {
+    FreePages (mSession.Arena, EFI_SIZE_TO_PAGES (mSession.ArenaBlocks * SIZE_BLOCK));
+  }
+
+  ZeroMem (&mSession, sizeof (mSession));
+}
+
+/**
+ * Allocate the digest cache, covering the BIOS region, from NEM or DRAM.
+ * - Without the region size or memory, every request reads SPI flash
+**/
+VOID
+EFIAPI
+CreateDigestCache (
+  VOID
+  )
+{
+  PCH_SPI2_PROTOCOL  *Spi2Ppi;
+  EFI_STATUS         Status;
+  UINT32             BaseAddress;
+  UINT32             RegionSize;
+  UINTN              Blocks;
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    return;
+  }
+
+  Status = Spi2Ppi->GetRegionAddress (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             &BaseAddress,
+             &RegionSize
+             );
+  if (EFI_ERROR (Status) || (RegionSize < SIZE_BLOCK)) {
+    return;
+  }
+
+  // `BlockNumber` cannot address beyond this
+  Blocks = MIN (RegionSize / SIZE_BLOCK, MAX_UINT16 + 1);
+
+  mDigestCache = AllocatePages (EFI_SIZE_TO_PAGES (Blocks * (sizeof (UINT64) + sizeof (BOOLEAN))));
+  if (mDigestCache == NULL) {
+    return;
+  }
+
+  mDigestCacheValid = (BOOLEAN *)(mDigestCache + Blocks);
+  ZeroMem (mDigestCacheValid, Blocks * sizeof (BOOLEAN));
+  mDigestCacheBlocks = Blocks;
+}
+
+/**
+ * Free the digest cache, once userspace is done.
+**/
+VOID
+EFIAPI
+DestroyDigestCache (
+  VOID
+  )
+{
+  if (mDigestCache == NULL) {
+    return;
+  }
+
+  FreePages (mDigestCache, EFI_SIZE_TO_PAGES (mDigestCacheBlocks * (sizeof (UINT64) + sizeof (BOOLEAN))));
+  mDigestCache = NULL;
+  mDigestCacheValid = NULL;
+  mDigestCacheBlocks = 0;
+}
+
+/**
+ * Whether a block is reserved for the manifest.
+**/
+BOOLEAN
+EFIAPI
+IsManifestBlock (
+  IN UINTN  BlockNumber
+  )
+{
+  return (BOOLEAN)((BlockNumber >= mManifestBlock) && (BlockNumber < mManifestBlock + mManifestBlockCount));
+}
+
+/**
+ * Erase the manifest header, once, before the BIOS region is first programmed.
+ * - Its digests are stale from then on, until userspace stores a new manifest
+**/
+VOID
+EFIAPI
+InvalidateManifest (
+  VOID
+  )
+{
+  PCH_SPI2_PROTOCOL  *Spi2Ppi;
+  EFI_STATUS         Status;
+
+  if ((mManifestBlockCount == 0) || mManifestInvalidated) {
+    return;
+  }
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    return;
+  }
+
+  Status = Spi2Ppi->FlashErase (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             mManifestBlock * SIZE_BLOCK,
+             SIZE_BLOCK
+             );
+  if (!EFI_ERROR (Status)) {
+    mManifestInvalidated = TRUE;
+  }
+
+  if (mManifestBlock < mDigestCacheBlocks) {
+    mDigestCacheValid[mManifestBlock] = FALSE;
+  }
+}
+
+/**
+ * Forget the cached digest of a block that is about to be programmed.
+ * - It is recomputed from SPI flash, so verification still reads back what was programmed
+ * - The on-flash manifest is voided too
+**/
+VOID
+EFIAPI
+InvalidateBlockDigest (
+  IN UINTN  BlockNumber
+  )
+{
+  InvalidateManifest ();
+
+  if (BlockNumber < mDigestCacheBlocks) {
+    mDigestCacheValid[BlockNumber] = FALSE;
+  }
+}
+
+/**
+ * Obtain the digest of a block, from the cache or else from SPI flash.
+ *
+ * @param[in]  BlockNumber  4K block in BIOS region.
+ * @param[out] Digest       Digest of the block.
+ *
+ * @return EFI_SUCCESS  Digest was obtained.
+ * @return Others       SPI flash could not be read.
+**/
+EFI_STATUS
+EFIAPI
+GetBlockDigest (
+  IN  UINTN   BlockNumber,
+  OUT UINT64  *Digest
+  )
+{
+  PCH_SPI2_PROTOCOL  *Spi2Ppi;
+  EFI_STATUS         Status;
+
+  if ((BlockNumber < mDigestCacheBlocks) && mDigestCacheValid[BlockNumber]) {
+    *Digest = mDigestCache[BlockNumber];
+    return EFI_SUCCESS;
+  }
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    return EFI_NOT_READY;
+  }
+
+  // `BlockNumber` starting in BIOS region
+  Status = Spi2Ppi->FlashRead (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             BlockNumber * SIZE_BLOCK,
+             SIZE_BLOCK,
+             mSession.Scratch
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (mDigestFunction == NULL) {
+    mDigestFunction = FlashRescueGetDigestFunction (mDigestType);
+  }
+
+  *Digest = mDigestFunction (mSession.Scratch, SIZE_BLOCK);
+
+  if (BlockNumber < mDigestCacheBlocks) {
+    mDigestCache[BlockNumber] = *Digest;
+    mDigestCacheValid[BlockNumber] = TRUE;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+ * Cache the digests of a range of blocks, reading each run of uncached blocks with one read
+ * of SPI flash into the arena's window, rather than block by block.
+ * - Each run is digested on every processor, given MP services
+ * - Blocks that cannot be read are left to GetBlockDigest()
+ *
+ * @param[in] FirstBlock  4K block in BIOS region.
+ * @param[in] Count       Number of blocks.
+**/
+VOID
+EFIAPI
+CacheBlockDigests (
+  IN UINTN  FirstBlock,
+  IN UINTN  Count
+  )
+{
+  PCH_SPI2_PROTOCOL  *Spi2Ppi;
+  EFI_STATUS         Status;
+  UINTN              EndBlock;
+  UINTN              Block;
+  UINTN              RunLength;
+  UINTN              Index;
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if ((Spi2Ppi == NULL) || (FirstBlock >= mDigestCacheBlocks)) {
+    return;
+  }
+
+  if (mDigestFunction == NULL) {
+    mDigestFunction = FlashRescueGetDigestFunction (mDigestType);
+  }
+
+  EndBlock = MIN (FirstBlock + Count, mDigestCacheBlocks);
+  for (Block = FirstBlock; Block < EndBlock; Block += RunLength) {
+    RunLength = 1;
+    if (mDigestCacheValid[Block]) {
+      continue;
+    }
+
+    while ((Block + RunLength < EndBlock) && (RunLength < mSession.WindowBlocks) &&
+           !mDigestCacheValid[Block + RunLength])
+    {
+      RunLength++;
+    }
+
+    // `Block` starting in BIOS region
+    Status = Spi2Ppi->FlashRead (
+               Spi2Ppi,
+               &gFlashRegionBiosGuid,
+               Block * SIZE_BLOCK,
+               RunLength * SIZE_BLOCK,
+               mSession.Window
+               );
+    if (EFI_ERROR (Status)) {
+      continue;
+    }
+
+    FlashRescueDigestBlocks (
+      mSession.Processors,
+      mDigestFunction,
+      mSession.Window,
+      RunLength,
+      SIZE_BLOCK,
+      &mDigestCache[Block]
+      );
+    for (Index = 0; Index < RunLength; Index++) {
+      mDigestCacheValid[Block + Index] = TRUE;
+    }
+  }
+}
+
+/**
+ * Select the block digest requested by userspace.
+ * - Unsupported digests are NACK'd, so userspace can fall back
+**/
+VOID
+EFIAPI
+SelectBlockDigest (
+  UINTN  RequestedDigestType
+  )
+{
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  if ((RequestedDigestType <= MAX_UINT8) &&
+      (FlashRescueDigestSize ((UINT8)RequestedDigestType) != 0))
+  {
+    mDigestType = (UINT8)RequestedDigestType;
+    mDigestFunction = FlashRescueGetDigestFunction (mDigestType);
+    ResponsePacket.Acknowledge = 1;
+
+    // Cached digests are of the previous type
+    if (mDigestCacheValid != NULL) {
+      ZeroMem (mDigestCacheValid, mDigestCacheBlocks * sizeof (BOOLEAN));
+    }
+  } else {
+    ResponsePacket.Acknowledge = 0;
+  }
+
+  // Report the digest now in effect
+  ResponsePacket.Size = (UINT16)FlashRescueDigestSize (mDigestType);
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Send the requested block digest to an awaiting userspace.
+ * - Board echoes `BlockNumber` in `Size`, so userspace can match responses to requests
+ *   it sent ahead
+ * - Blocks that cannot be read are NACK'd, as userspace awaits an answer to each request
+**/
+VOID
+EFIAPI
+SendBlockChecksum (
+  UINTN  BlockNumber
+  )
+{
+  EFI_STATUS                   Status;
+  UINT64                       Digest;
+  UINTN                        DigestSize;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  // With DRAM, a miss digests the rest of the region at once, so later requests are served
+  // from the cache
+  if (mSession.PermanentMemory && (BlockNumber < mDigestCacheBlocks) &&
+      !mDigestCacheValid[BlockNumber])
+  {
+    CacheBlockDigests (0, mDigestCacheBlocks);
+  }
+
+  ResponsePacket.Size = (UINT16)BlockNumber;
+  Status = GetBlockDigest (BlockNumber, &Digest);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Cannot digest block 0x%x: %r\n", (UINT32)BlockNumber, Status));
+    ResponsePacket.Acknowledge = 0;
+    RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+    return;
+  }
+
+  DigestSize = FlashRescueDigestSize (mDigestType);
+
+  // Now, acknowledge userspace request and send block digest
+  ResponsePacket.Acknowledge = 1;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  RescueTransportWrite ((UINT8 *)&Digest, DigestSize);
+}
+
+/**
+ * Send the digests of up to DIGEST_TABLE_BLOCKS blocks, from `FirstBlock`, in bulk.
+ * - Board ACKs with the number of digests in `Size`, then sends them once computed,
+ *   then ACKs unless a block could not be read
+ * - Beyond the cache, or without it, board NACKs so userspace requests blocks singly.
+ *   Without a cache, the NACK marks the command unsupported
+**/
+VOID
+EFIAPI
+SendDigestTable (
+  UINTN  FirstBlock
+  )
+{
+  UINT8                        *DigestTable;
+  UINT64                       Digest;
+  UINTN                        DigestSize;
+  UINTN                        Count;
+  UINTN                        Index;
+  EFI_STATUS                   Status;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  Count = 0;
+  if (FirstBlock < mDigestCacheBlocks) {
+    Count = MIN (mDigestCacheBlocks - FirstBlock, DIGEST_TABLE_BLOCKS);
+  }
+
+  ResponsePacket.Acknowledge = (Count != 0) ? 1 : 0;
+  ResponsePacket.Size = (mDigestCacheBlocks != 0) ? (UINT16)Count : EARLY_FLASH_RESCUE_NACK_UNSUPPORTED;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  if (Count == 0) {
+    return;
+  }
+
+  // With DRAM, the window is large enough that the rest of the region is digested at once.
+  // Later requests are answered from the cache
+  CacheBlockDigests (FirstBlock, mSession.PermanentMemory ? mDigestCacheBlocks : Count);
+
+  // Little-endian digests, truncated to the negotiated size
+  DigestTable = mSession.Window;
+  DigestSize  = FlashRescueDigestSize (mDigestType);
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+  for (Index = 0; Index < Count; Index++) {
+    Digest = 0;
+    Status = GetBlockDigest (FirstBlock + Index, &Digest);
+    if (EFI_ERROR (Status)) {
+      ResponsePacket.Acknowledge = 0;
+    }
+
+    CopyMem (&DigestTable[Index * DigestSize], &Digest, DigestSize);
+  }
+
+  RescueTransportWrite (DigestTable, Count * DigestSize);
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Load the manifest's digests into the cache, once a sample of them matches SPI flash.
+ * - Spot-checks are spread over the region, from a varying offset
+ *
+ * @param[out] Manifest  Header of the manifest.
+ *
+ * @return EFI_SUCCESS           Manifest is valid, and its digests are cached.
+ * @return EFI_UNSUPPORTED       No manifest blocks, or no cache.
+ * @return EFI_VOLUME_CORRUPTED  Manifest is absent, stale or torn.
+ * @return Others                SPI flash could not be read.
+**/
+EFI_STATUS
+EFIAPI
+LoadManifest (
+  OUT FLASH_RESCUE_MANIFEST  *Manifest
+  )
+{
+  PCH_SPI2_PROTOCOL  *Spi2Ppi;
+  EFI_STATUS         Status;
+  UINT64             Expected;
+  UINT64             Digest;
+  UINTN              Stride;
+  UINTN              Index;
+
+  if ((mManifestBlockCount == 0) || (mDigestCache == NULL)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    return EFI_NOT_READY;
+  }
+
+  Status = Spi2Ppi->FlashRead (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             mManifestBlock * SIZE_BLOCK,
+             sizeof (*Manifest),
+             (UINT8 *)Manifest
+             );
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if ((Manifest->Signature != FLASH_RESCUE_MANIFEST_SIGNATURE) ||
+      (Manifest->Version != FLASH_RESCUE_MANIFEST_VERSION) ||
+      (Manifest->DigestType != mDigestType) ||
+      (Manifest->BlockCount != mDigestCacheBlocks) ||
+      (Manifest->ManifestBlock != mManifestBlock) ||
+      (Manifest->ManifestBlockCount != mManifestBlockCount))
+  {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  // Table is read over the cache, which is forgotten unless the manifest validates
+  Status = Spi2Ppi->FlashRead (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             mManifestBlock * SIZE_BLOCK + sizeof (*Manifest),
+             mDigestCacheBlocks * sizeof (UINT64),
+             (UINT8 *)mDigestCache
+             );
+  if (!EFI_ERROR (Status) &&
+      (CalculateCrc32 (mDigestCache, mDigestCacheBlocks * sizeof (UINT64)) != Manifest->TableCrc))
+  {
+    Status = EFI_VOLUME_CORRUPTED;
+  }
+
+  Stride = MAX (mDigestCacheBlocks / MANIFEST_SPOT_CHECKS, 1);
+  Index  = (UINTN)(GetPerformanceCounter () % Stride);
+  for ( ; !EFI_ERROR (Status) && (Index < mDigestCacheBlocks); Index += Stride) {
+    if (IsManifestBlock (Index)) {
+      continue;
+    }
+
+    Expected = mDigestCache[Index];
+    mDigestCacheValid[Index] = FALSE;
+    Status = GetBlockDigest (Index, &Digest);
+    if (!EFI_ERROR (Status) && (Digest != Expected)) {
+      Status = EFI_VOLUME_CORRUPTED;
+    }
+  }
+
+  for (Index = 0; Index < mDigestCacheBlocks; Index++) {
+    mDigestCacheValid[Index] = !EFI_ERROR (Status) && !IsManifestBlock (Index);
+  }
+
+  return Status;
+}
+
+/**
+ * Send the manifest header to an awaiting userspace, once its digests are cached.
+ * - Board ACKs with the header's size in `Size`, or with zero when no manifest validates
+ * - Without manifest blocks or a cache, board NACKs, marking the command unsupported
+**/
+VOID
+EFIAPI
+SendManifest (
+  VOID
+  )
+{
+  FLASH_RESCUE_MANIFEST        Manifest;
+  EFI_STATUS                   Status;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  Status = LoadManifest (&Manifest);
+
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = EFI_ERROR (Status) ? 0 : sizeof (Manifest);
+  if (Status == EFI_UNSUPPORTED) {
+    ResponsePacket.Acknowledge = 0;
+    ResponsePacket.Size = EARLY_FLASH_RESCUE_NACK_UNSUPPORTED;
+  }
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  if (!EFI_ERROR (Status)) {
+    RescueTransportWrite ((UINT8 *)&Manifest, sizeof (Manifest));
+  }
+}
+
+/**
+ * Store a manifest of the BIOS region, once userspace has verified its flash.
+ * - Userspace sends the UINT32 CRC32 of its image once this command is acknowledged,
+ *   board ACKs again once the manifest is programmed
+ * - Header is written last, so a torn manifest never validates
+**/
+VOID
+EFIAPI
+StoreManifest (
+  VOID
+  )
+{
+  PCH_SPI2_PROTOCOL            *Spi2Ppi;
+  FLASH_RESCUE_MANIFEST        Manifest;
+  UINT8                        *BlockData;
+  UINT32                       ImageCrc;
+  UINT64                       Digest;
+  UINTN                        TableSize;
+  UINTN                        Blocks;
+  UINTN                        Offset;
+  UINTN                        Start;
+  UINTN                        End;
+  UINTN                        Index;
+  EFI_STATUS                   Status;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  // Acknowledge userspace command and retrieve image CRC
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+
+  Status = EFI_DEVICE_ERROR;
+  if (RescueTransportRead ((UINT8 *)&ImageCrc, sizeof (ImageCrc)) != sizeof (ImageCrc)) {
+    goto Exit;
+  }
+
+  Spi2Ppi   = mSession.Spi2Ppi;
+  BlockData = mSession.Window;
+  TableSize = mDigestCacheBlocks * sizeof (UINT64);
+  Status    = EFI_UNSUPPORTED;
+  if ((Spi2Ppi == NULL) || (mManifestBlockCount == 0) || (mDigestCache == NULL) ||
+      (mManifestBlock + mManifestBlockCount > mDigestCacheBlocks) ||
+      (sizeof (Manifest) + TableSize > mManifestBlockCount * SIZE_BLOCK))
+  {
+    goto Exit;
+  }
+
+  // Manifest blocks change as it is stored, so they are left out
+  CacheBlockDigests (0, mDigestCacheBlocks);
+  for (Index = 0; Index < mDigestCacheBlocks; Index++) {
+    if (IsManifestBlock (Index)) {
+      mDigestCache[Index] = 0;
+      mDigestCacheValid[Index] = FALSE;
+      continue;
+    }
+
+    Status = GetBlockDigest (Index, &Digest);
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+  }
+
+  ZeroMem (&Manifest, sizeof (Manifest));
+  Manifest.Signature = FLASH_RESCUE_MANIFEST_SIGNATURE;
+  Manifest.Version = FLASH_RESCUE_MANIFEST_VERSION;
+  Manifest.DigestType = mDigestType;
+  Manifest.ManifestBlock = (UINT16)mManifestBlock;
+  Manifest.ManifestBlockCount = (UINT16)mManifestBlockCount;
+  Manifest.BlockCount = (UINT32)mDigestCacheBlocks;
+  Manifest.ImageCrc = ImageCrc;
+  Manifest.TableCrc = CalculateCrc32 (mDigestCache, TableSize);
+
+  Blocks = (sizeof (Manifest) + TableSize + SIZE_BLOCK - 1) / SIZE_BLOCK;
+  Status = Spi2Ppi->FlashErase (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             mManifestBlock * SIZE_BLOCK,
+             Blocks * SIZE_BLOCK
+             );
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  mManifestInvalidated = TRUE;
+
+  // Header is followed by the table, spanning the manifest blocks. Last block first
+  for (Index = Blocks; Index-- > 0;) {
+    Offset = Index * SIZE_BLOCK;
+    SetMem (BlockData, SIZE_BLOCK, 0xFF);
+    if (Index == 0) {
+      CopyMem (BlockData, &Manifest, sizeof (Manifest));
+    }
+
+    Start = MAX (Offset, sizeof (Manifest));
+    End   = MIN (Offset + SIZE_BLOCK, sizeof (Manifest) + TableSize);
+    if (Start < End) {
+      CopyMem (&BlockData[Start - Offset], (UINT8 *)mDigestCache + Start - sizeof (Manifest), End - Start);
+    }
+
+    Status = Spi2Ppi->FlashWrite (
+               Spi2Ppi,
+               &gFlashRegionBiosGuid,
+               mManifestBlock * SIZE_BLOCK + Offset,
+               SIZE_BLOCK,
+               BlockData
+               );
+    if (EFI_ERROR (Status)) {
+      goto Exit;
+    }
+  }
+
+  // Programming anything from now on voids it again
+  mManifestInvalidated = FALSE;
+
+Exit:
+  ResponsePacket.Acknowledge = EFI_ERROR (Status) ? 0 : 1;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Read from userspace, until `NumberOfBytes` arrive or nothing has arrived for `TimeoutMs`.
+ * - Unlike RescueTransportRead(), this cannot wait forever for bytes that were lost
+ *
+ * @param[out] Buffer         Buffer to read into.
+ * @param[in]  NumberOfBytes  Bytes to read.
+ * @param[in]  TimeoutMs      Milliseconds to wait for the next byte.
+ *
+ * @return Number of bytes read.
+**/
+UINTN
+EFIAPI
+ReadWithTimeout (
+  OUT UINT8   *Buffer,
+  IN  UINTN   NumberOfBytes,
+  IN  UINT32  TimeoutMs
+  )
+{
+  UINTN   Received;
+  UINT64  LastReceivedTimeNs;
+
+  Received = 0;
+  LastReceivedTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
+  while (Received < NumberOfBytes) {
+    if (RescueTransportPoll ()) {
+      Received += RescueTransportRead (Buffer + Received, 1);
+      LastReceivedTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
+    } else if ((GetTimeInNanoSecond (GetPerformanceCounter ()) - LastReceivedTimeNs) >=
+               MultU64x32 (TimeoutMs, NS_IN_MS)) {
+      break;
+    }
+  }
+
+  return Received;
+}
+
+/**
+ * Write the requested SPI flash block.
+ * - A block that loses a packet is NACKed, and the flash is left untouched
+**/
+VOID
+EFIAPI
+WriteBlock (
+  UINTN  BlockNumber
+  )
+{
+  PCH_SPI2_PROTOCOL            *Spi2Ppi;
+  UINTN                        Address;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+  VOID                         *XferBlock;
+  UINTN                        Index;
+  EFI_STATUS                   Status;
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    return;
+  }
+
+  // `BlockNumber` starting in BIOS region
+  Address = BlockNumber * SIZE_BLOCK;
+
+  // Acknowledge userspace command and retrieve block
+  ResponsePacket.Acknowledge = 1;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+
+  // Start streaming block
+  XferBlock = mSession.Window;
+  for (Index = 0; Index < SIZE_BLOCK; Index += mXferBlockSize) {
+    // FIXME: This will incur some penalty, but we must wait
+    // - Still debugging timing parameters, especially at higher baudrate
+    // - Possible optimisation: Shorter stall if RescueTransportPoll()
+    if (!RescueTransportAwaitsFrames ()) {
+      MicroSecondDelay (33 * MS_IN_SECOND);
+    }
+
+    if (RescueTransportRead (XferBlock, mXferBlockSize) != mXferBlockSize) {
+      // Whatever remains in flight must not be taken for commands
+      while (ReadWithTimeout (mSession.Window, SIZE_BLOCK, ECHO_QUIET_MS) != 0) {
+      }
+
+      DEBUG ((DEBUG_WARN, "Block 0x%x lost a packet at 0x%x\n", (UINT32)BlockNumber, (UINT32)Index));
+      ResponsePacket.Acknowledge = 0;
+      RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+      return;
+    }
+
+    XferBlock += mXferBlockSize;
+
+    // FIXME: This will incur some penalty, but userspace must wait
+    ResponsePacket.Acknowledge = 1;
+    RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  }
+
+  InvalidateBlockDigest (BlockNumber);
+
+  // SPI flash is is fairly durable, but determine when erase is necessary.
+  Status = Spi2Ppi->FlashErase (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             Address,
+             SIZE_BLOCK
+             );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Erasing block 0x%x failed: %r\n", (UINT32)BlockNumber, Status));
+    return;
+  }
+
+  Status = Spi2Ppi->FlashWrite (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             Address,
+             SIZE_BLOCK,
+             mSession.Window
+             );
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Writing block 0x%x failed: %r\n", (UINT32)BlockNumber, Status));
+  }
+}
+
+/**
+ * Erase the requested SPI flash block, leaving it all 0xFF.
+**/
+VOID
+EFIAPI
+EraseBlock (
+  UINTN  BlockNumber
+  )
+{
+  PCH_SPI2_PROTOCOL            *Spi2Ppi;
+  EFI_STATUS                   Status;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  Status = EFI_DEVICE_ERROR;
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi != NULL) {
+    InvalidateBlockDigest (BlockNumber);
+
+    // `BlockNumber` starting in BIOS region
+    Status = Spi2Ppi->FlashErase (
+               Spi2Ppi,
+               &gFlashRegionBiosGuid,
+               BlockNumber * SIZE_BLOCK,
+               SIZE_BLOCK
+               );
+  }
+
+  // Acknowledge once erased, userspace falls back to WRITE otherwise
+  ResponsePacket.Acknowledge = EFI_ERROR (Status) ? 0 : 1;
+  ResponsePacket.Size = 0;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Fill the requested SPI flash block with a repeated byte.
+ * - Userspace sends the pattern byte once this command is acknowledged
+**/
+VOID
+EFIAPI
+FillBlock (
+  UINTN  BlockNumber
+  )
+{
+  PCH_SPI2_PROTOCOL            *Spi2Ppi;
+  UINTN                        Address;
+  UINT8                        Pattern;
+  EFI_STATUS                   Status;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  // Acknowledge userspace command and retrieve pattern
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+
+  Status = EFI_DEVICE_ERROR;
+  if (RescueTransportRead (&Pattern, sizeof (Pattern)) != sizeof (Pattern)) {
+    goto Exit;
+  }
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    goto Exit;
+  }
+
+  // `BlockNumber` starting in BIOS region
+  Address = BlockNumber * SIZE_BLOCK;
+  InvalidateBlockDigest (BlockNumber);
+
+  Status = Spi2Ppi->FlashErase (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             Address,
+             SIZE_BLOCK
+             );
+  if (EFI_ERROR (Status) || (Pattern == 0xFF)) {
+    goto Exit;
+  }
+
+  SetMem (mSession.Window, SIZE_BLOCK, Pattern);
+  Status = Spi2Ppi->FlashWrite (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             Address,
+             SIZE_BLOCK,
+             mSession.Window
+             );
+
+Exit:
+  ResponsePacket.Acknowledge = EFI_ERROR (Status) ? 0 : 1;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Copy a block's worth of data from elsewhere in flash into the requested SPI flash block.
+ * - Userspace sends the UINT32 source address, starting in BIOS region,
+ *   once this command is acknowledged. It need not be block-aligned
+ * - A source that runs past the blocks `BlockNumber` addresses is NACKed
+**/
+VOID
+EFIAPI
+CopyBlock (
+  UINTN  BlockNumber
+  )
+{
+  PCH_SPI2_PROTOCOL            *Spi2Ppi;
+  UINTN                        Address;
+  UINT32                       SourceAddress;
+  EFI_STATUS                   Status;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  // Acknowledge userspace command and retrieve source
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+
+  Status = EFI_DEVICE_ERROR;
+  if (RescueTransportRead ((UINT8 *)&SourceAddress, sizeof (SourceAddress)) != sizeof (SourceAddress)) {
+    goto Exit;
+  }
+
+  if ((mDigestCacheBlocks == 0) || (SourceAddress > (mDigestCacheBlocks - 1) * SIZE_BLOCK)) {
+    DEBUG ((DEBUG_ERROR, "Cannot copy from 0x%x!\n", SourceAddress));
+    Status = EFI_INVALID_PARAMETER;
+    goto Exit;
+  }
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    goto Exit;
+  }
+
+  // Source is read whole before the destination is erased, so they may overlap
+  Status = Spi2Ppi->FlashRead (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             SourceAddress,
+             SIZE_BLOCK,
+             mSession.Window
+             );
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  // `BlockNumber` starting in BIOS region
+  Address = BlockNumber * SIZE_BLOCK;
+  InvalidateBlockDigest (BlockNumber);
+
+  Status = Spi2Ppi->FlashErase (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             Address,
+             SIZE_BLOCK
+             );
+  if (EFI_ERROR (Status)) {
+    goto Exit;
+  }
+
+  Status = Spi2Ppi->FlashWrite (
+             Spi2Ppi,
+             &gFlashRegionBiosGuid,
+             Address,
+             SIZE_BLOCK,
+             mSession.Window
+             );
+
+Exit:
+  ResponsePacket.Acknowledge = EFI_ERROR (Status) ? 0 : 1;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
 
 /**
- * Send HELLO command to an awaiting userspace.
+ * Receive a stream from userspace, without per-packet handshakes.
  *
- * @return EFI_SUCCESS  Command acknowledged.
- * @return EFI_TIMEOUT  Command timed-out.
+ * @param[out] Buffer  Buffer to receive into.
+ * @param[in]  Length  Bytes expected.
+ *
+ * @return EFI_SUCCESS  Stream received.
+ * @return EFI_TIMEOUT  Userspace stalled mid-stream.
 **/
+STATIC
 EFI_STATUS
-EFIAPI
-SendHelloPacket (
-  VOID
+ReceiveStream (
+  OUT UINT8  *Buffer,
+  IN  UINTN  Length
   )
 {
-  UINT32                       WaitTimeout;
-  EARLY_FLASH_RESCUE_COMMAND   CommandPacket;
-  UINTN                        TimeCounter;
-  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+  UINTN   Received;
+  UINT64  LastReceivedTimeNs;
 
-  WaitTimeout = FixedPcdGet32 (PcdUserspaceHostWaitTimeout);
+  LastReceivedTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
+  while (Length > 0) {
+    if (!RescueTransportPoll ()) {
+      if ((GetTimeInNanoSecond (GetPerformanceCounter ()) - LastReceivedTimeNs) >=
+          MultU64x32 (STAGE_STREAM_TIMEOUT_S, NS_IN_SECOND)) {
+        return EFI_TIMEOUT;
+      }
 
-  // TODO: Consider sending a total `BlockNumber`?
-  CommandPacket.Command = EARLY_FLASH_RESCUE_COMMAND_HELLO;
-  CommandPacket.BlockNumber = 0;
+      continue;
+    }
 
-  for (TimeCounter = 0; TimeCounter < WaitTimeout; TimeCounter += 250) {
-    // Maybe packet was not in FIFO
-    SerialPortWrite ((UINT8 *)&CommandPacket, sizeof (CommandPacket));
+    Received = RescueTransportRead (Buffer, MIN (Length, SIZE_BLOCK));
+    Buffer += Received;
+    Length -= Received;
+
+    LastReceivedTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
+  }
+
+  return EFI_SUCCESS;
+}
+
+/**
+ * Program staged blocks, batching runs of consecutive blocks.
+ *
+ * @param[in] BlockNumbers  Strictly ascending block numbers.
+ * @param[in] Blocks        Block data, in the order of `BlockNumbers`.
+ * @param[in] BlockCount    Number of blocks.
+ *
+ * @return EFI_SUCCESS       Blocks programmed.
+ * @return EFI_DEVICE_ERROR  SPI service is unavailable.
+ * @return Others            Erase or write failed.
+**/
+STATIC
+EFI_STATUS
+ProgramStagedBlocks (
+  IN UINT16  *BlockNumbers,
+  IN UINT8   *Blocks,
+  IN UINTN   BlockCount
+  )
+{
+  PCH_SPI2_PROTOCOL  *Spi2Ppi;
+  UINTN              Index;
+  UINTN              RunLength;
+  UINTN              Address;
+  EFI_STATUS         Status;
+
+  Spi2Ppi = mSession.Spi2Ppi;
+  if (Spi2Ppi == NULL) {
+    return EFI_DEVICE_ERROR;
+  }
+
+  for (Index = 0; Index < BlockCount; Index++) {
+    InvalidateBlockDigest (BlockNumbers[Index]);
+  }
+
+  for (Index = 0; Index < BlockCount; Index += RunLength) {
+    for (RunLength = 1; Index + RunLength < BlockCount; RunLength++) {
+      if (BlockNumbers[Index + RunLength] != BlockNumbers[Index] + RunLength) {
+        break;
+      }
+    }
 
-    SerialPortRead ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
-    if (ResponsePacket.Acknowledge == 1) {
-      return EFI_SUCCESS;
+    // `BlockNumber` starting in BIOS region
+    Address = BlockNumbers[Index] * SIZE_BLOCK;
+
+    // SPI library picks the largest erase the run's alignment permits
+    Status = Spi2Ppi->FlashErase (
+               Spi2Ppi,
+               &gFlashRegionBiosGuid,
+               Address,
+               RunLength * SIZE_BLOCK
+               );
+    if (EFI_ERROR (Status)) {
+      return Status;
     }
 
-    MicroSecondDelay (250 * MS_IN_SECOND);
+    Status = Spi2Ppi->FlashWrite (
+               Spi2Ppi,
+               &gFlashRegionBiosGuid,
+               Address,
+               RunLength * SIZE_BLOCK,
+               Blocks + Index * SIZE_BLOCK
+               );
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
   }
 
-  return EFI_TIMEOUT;
+  return EFI_SUCCESS;
 }
 
 /**
- * Send the requested block CRC to an awaiting userspace.
- * - TODO: NACK blocks as necessary
+ * Stage dirty blocks in the arena's window, then program them.
+ * - Every block is received in one stream before any is programmed. Link time and SPI time
+ *   no longer interleave, and consecutive blocks are erased and written as one batch
+ * - Userspace streams `BlockCount` block numbers, then the data of each block
+ * - Zero blocks probes whether staging is available
+ *
+ * @param[in] BlockCount  Number of blocks to stage.
 **/
+STATIC
 VOID
-EFIAPI
-SendBlockChecksum (
-  UINTN  BlockNumber
+StageBlocks (
+  IN UINTN  BlockCount
   )
 {
-  PCH_SPI2_PROTOCOL            *Spi2Ppi;
-  UINTN                        Address;
-  UINT8                        BlockData[SIZE_BLOCK];
-  EFI_STATUS                   Status;
-  UINT32                       Crc;
   EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+  UINT16                       *BlockNumbers;
+  UINTN                        Index;
+  EFI_STATUS                   Status;
 
-  Spi2Ppi = GetSpiPpi ();
-  if (Spi2Ppi == NULL) {
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+  if (BlockCount > mSession.WindowBlocks) {
+    DEBUG ((DEBUG_ERROR, "Cannot stage %u blocks!\n", (UINT32)BlockCount));
+    // NACK, so userspace writes these blocks singly
+    ResponsePacket.Acknowledge = 0;
+  }
+
+  // Acknowledge userspace command and retrieve the stream
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  if ((BlockCount == 0) || (ResponsePacket.Acknowledge == 0)) {
     return;
   }
 
-  // `BlockNumber` starting in BIOS region
-  Address = BlockNumber * SIZE_BLOCK;
+  // Nothing reads SPI flash while staging, so the scratch block holds the numbers
+  BlockNumbers = (UINT16 *)mSession.Scratch;
+  Status = ReceiveStream ((UINT8 *)BlockNumbers, BlockCount * sizeof (UINT16));
+  if (!EFI_ERROR (Status)) {
+    Status = ReceiveStream (mSession.Window, BlockCount * SIZE_BLOCK);
+  }
 
-  Status = Spi2Ppi->FlashRead (
-             Spi2Ppi,
-             &gFlashRegionBiosGuid,
-             Address,
-             SIZE_BLOCK,
-             BlockData
-             );
+  // Runs are only found in ascending order
+  for (Index = 1; !EFI_ERROR (Status) && Index < BlockCount; Index++) {
+    if (BlockNumbers[Index] <= BlockNumbers[Index - 1]) {
+      Status = EFI_INVALID_PARAMETER;
+    }
+  }
+
+  if (!EFI_ERROR (Status)) {
+    Status = ProgramStagedBlocks (BlockNumbers, mSession.Window, BlockCount);
+  }
+
+  // Report how many blocks were programmed
   if (EFI_ERROR (Status)) {
-    return;
+    DEBUG ((DEBUG_ERROR, "Staging failed: %r\n", Status));
+    ResponsePacket.Acknowledge = 0;
+  } else {
+    ResponsePacket.Size = (UINT16)BlockCount;
   }
 
-  Crc = CalculateCrc32 (BlockData, SIZE_BLOCK);
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Describe the session, so userspace can size its transfers to the board's buffers.
+**/
+VOID
+EFIAPI
+SendBoardInfo (
+  VOID
+  )
+{
+  FLASH_RESCUE_BOARD_INFO      Info;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  ZeroMem (&Info, sizeof (Info));
+  Info.Version       = FLASH_RESCUE_BOARD_INFO_VERSION;
+  Info.XferBlockSize = mXferBlockSize;
+  Info.ArenaSize     = (UINT32)(mSession.ArenaBlocks * SIZE_BLOCK);
+  Info.StageBlocks   = (UINT16)mSession.WindowBlocks;
 
-  // Now, acknowledge userspace request and send block CRC
   ResponsePacket.Acknowledge = 1;
-  SerialPortWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
-  SerialPortWrite ((UINT8 *)&Crc, sizeof (Crc));
+  ResponsePacket.Size = sizeof (Info);
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  RescueTransportWrite ((UINT8 *)&Info, sizeof (Info));
 }
 
 /**
- * Write the requested SPI flash block.
- * - TODO: NACK blocks as necessary
+ * Receive `Size` bytes in packets, as WRITE does, then send them back.
+ * - Userspace measures the link with this, so overruns must end the echo, not the session
+ *
+ * @param[in] Size  Bytes to echo, at most SIZE_BLOCK.
 **/
 VOID
 EFIAPI
-WriteBlock (
-  UINTN  BlockNumber
+EchoData (
+  UINTN  Size
   )
 {
-  PCH_SPI2_PROTOCOL            *Spi2Ppi;
-  UINTN                        Address;
-  UINT8                        BlockData[SIZE_BLOCK];
+  UINT8                        *EchoBuffer;
   EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
-  VOID                         *XferBlock;
   UINTN                        Index;
-  EFI_STATUS                   Status;
+  UINTN                        PacketSize;
 
-  Spi2Ppi = GetSpiPpi ();
-  if (Spi2Ppi == NULL) {
+  ResponsePacket.Acknowledge = (Size <= SIZE_BLOCK) ? 1 : 0;
+  ResponsePacket.Size = 0;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  if (Size > SIZE_BLOCK) {
     return;
   }
 
-  // `BlockNumber` starting in BIOS region
-  Address = BlockNumber * SIZE_BLOCK;
+  EchoBuffer = mSession.Window;
+  for (Index = 0; Index < Size; Index += PacketSize) {
+    PacketSize = MIN (mXferBlockSize, Size - Index);
 
-  // Acknowledge userspace command and retrieve block
-  ResponsePacket.Acknowledge = 1;
-  SerialPortWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+    // Stall as WRITE does, so that calibration sees its overruns
+    if (!RescueTransportAwaitsFrames ()) {
+      MicroSecondDelay (33 * MS_IN_SECOND);
+    }
 
-  // Start streaming block
-  XferBlock = BlockData;
-  for (Index = 0; Index < SIZE_BLOCK; Index += XferBlockSize) {
-    // FIXME: This will incur some penalty, but we must wait
-    // - Still debugging timing parameters, especially at higher baudrate
-    // - Possible optimisation: Shorter stall if SerialPortPoll()
-    MicroSecondDelay (33 * MS_IN_SECOND);
+    if (ReadWithTimeout (EchoBuffer + Index, PacketSize, ECHO_PACKET_TIMEOUT_MS) != PacketSize) {
+      // Whatever remains in flight must not be taken for commands
+      while (ReadWithTimeout (EchoBuffer, SIZE_BLOCK, ECHO_QUIET_MS) != 0) {
+      }
 
-    SerialPortRead (XferBlock, XferBlockSize);
-    XferBlock += XferBlockSize;
+      DEBUG ((DEBUG_WARN, "Echo lost a packet at byte 0x%x\n", (UINT32)Index));
+      ResponsePacket.Acknowledge = 0;
+      RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+      return;
+    }
 
-    // FIXME: This will incur some penalty, but userspace must wait
     ResponsePacket.Acknowledge = 1;
-    SerialPortWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+    RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
   }
 
-  // SPI flash is is fairly durable, but determine when erase is necessary.
-  Status = Spi2Ppi->FlashErase (
-             Spi2Ppi,
-             &gFlashRegionBiosGuid,
-             Address,
-             SIZE_BLOCK
-             );
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = (UINT16)Size;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  RescueTransportWrite (EchoBuffer, Size);
+}
+
+/**
+ * Receive WRITE data in packets of another size, as userspace requests.
+ *
+ * @param[in] PacketSize  Power of two, at most SIZE_BLOCK.
+**/
+VOID
+EFIAPI
+SetXferSize (
+  UINTN  PacketSize
+  )
+{
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  ResponsePacket.Acknowledge = 0;
+  if ((PacketSize != 0) && (PacketSize <= SIZE_BLOCK) && ((PacketSize & (PacketSize - 1)) == 0)) {
+    mXferBlockSize = (UINT16)PacketSize;
+    ResponsePacket.Acknowledge = 1;
+  }
+
+  ResponsePacket.Size = mXferBlockSize;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Change baud rate, as userspace requests. The response is sent at the old rate.
+ * - The new rate is reverted unless userspace repeats this command within
+ *   BAUD_CONFIRM_TIMEOUT_MS, so a rate the link cannot carry does not end the session
+ *
+ * @param[in] Rate  Baud rate in BAUD_RATE_UNIT, or zero for the default.
+**/
+VOID
+EFIAPI
+SetBaudRate (
+  UINTN  Rate
+  )
+{
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+  EFI_STATUS                   Status;
+
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+
+  // Userspace confirms that it can hear us at the new rate
+  if (mBaudRatePending && ((Rate * BAUD_RATE_UNIT) == mBaudRate)) {
+    mBaudRatePending = FALSE;
+    RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+    return;
+  }
+
+  // The response must have left the UART before its rate changes
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  MicroSecondDelay (BAUD_SWITCH_DELAY_MS * MS_IN_SECOND);
+
+  Status = RescueTransportSetBaudRate (Rate * BAUD_RATE_UNIT);
   if (EFI_ERROR (Status)) {
+    // Userspace switches, then finds nothing answering. It reverts as we would
+    DEBUG ((DEBUG_WARN, "Cannot use %Lu baud: %r\n", (UINT64)Rate * BAUD_RATE_UNIT, Status));
     return;
   }
 
-  Status = Spi2Ppi->FlashWrite (
-             Spi2Ppi,
-             &gFlashRegionBiosGuid,
-             Address,
-             SIZE_BLOCK,
-             BlockData
-             );
+  if (!mBaudRatePending) {
+    mPreviousBaudRate = mBaudRate;
+  }
+
+  mBaudRate = Rate * BAUD_RATE_UNIT;
+  mBaudRatePending = TRUE;
+  mBaudConfirmDeadlineNs = GetTimeInNanoSecond (GetPerformanceCounter ()) +
+                          MultU64x32 (BAUD_CONFIRM_TIMEOUT_MS, NS_IN_MS);
+}
+
+/**
+ * Return to the default baud rate, which the rest of boot expects.
+**/
+VOID
+EFIAPI
+RestoreBaudRate (
+  VOID
+  )
+{
+  mBaudRatePending = FALSE;
+  if (mBaudRate != 0) {
+    mBaudRate = 0;
+    RescueTransportSetBaudRate (0);
+  }
+}
+
+/**
+ * Enable or disable log frames, as userspace requests.
+ *
+ * @param[in] Enable  Non-zero when userspace demultiplexes log frames.
+**/
+VOID
+EFIAPI
+SelectLogFrames (
+  UINTN  Enable
+  )
+{
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  mLogFramesEnabled = (Enable != 0);
+
+  ResponsePacket.Acknowledge = 1;
+  ResponsePacket.Size = 0;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+}
+
+/**
+ * Send queued log ahead of a response, at most LOG_FRAME_MAX_SIZE bytes.
+ * - The remainder waits for later responses, rather than stalling this one
+**/
+VOID
+EFIAPI
+SendLogFrame (
+  VOID
+  )
+{
+  CHAR8                        LogData[LOG_FRAME_MAX_SIZE];
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
+
+  if (!mLogFramesEnabled) {
+    return;
+  }
+
+  ResponsePacket.Size = (UINT16)FlashRescueLogRead (LogData, sizeof (LogData));
+  if (ResponsePacket.Size == 0) {
+    return;
+  }
+
+  ResponsePacket.Acknowledge = EARLY_FLASH_RESCUE_LOG_FRAME;
+  RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+  RescueTransportWrite ((UINT8 *)LogData, ResponsePacket.Size);
+}
+
+/**
+ * Stop capturing DEBUG() output. Userspace has gone, so unsent log is written plainly.
+**/
+VOID
+EFIAPI
+EndLogCapture (
+  VOID
+  )
+{
+  CHAR8  LogData[LOG_FRAME_MAX_SIZE];
+  UINTN  Count;
+
+  FlashRescueLogCapture (FALSE);
+  while ((Count = FlashRescueLogRead (LogData, sizeof (LogData))) != 0) {
+    RescueTransportWrite ((UINT8 *)LogData, Count);
+  }
 }
 
 /**
  * Perform flash.
  *
- * @return EFI_SUCCESS       Successful flash.
- * @return EFI_DEVICE_ERROR  Initialise SPI service failed.
- * @return EFI_TIMEOUT       Await command timed-out.
+ * @return EFI_SUCCESS           Successful flash.
+ * @return EFI_DEVICE_ERROR      Initialise SPI service failed.
+ * @return EFI_OUT_OF_RESOURCES  No memory for the buffer arena.
+ * @return EFI_TIMEOUT           Await command timed-out.
 **/
 EFI_STATUS
 EFIAPI
@@ -179,10 +1528,12 @@ PerformFlash (
   VOID
   )
 {
-  EFI_STATUS                  Status;
-  UINT8                       NoUserspaceExit;
-  UINT64                      LastServicedTimeNs;
-  EARLY_FLASH_RESCUE_COMMAND  CommandPacket;
+  EFI_STATUS                   Status;
+  UINT8                        NoUserspaceExit;
+  UINT64                       LastServicedTimeNs;
+  UINT64                       IdleTimeoutS;
+  EARLY_FLASH_RESCUE_COMMAND   CommandPacket;
+  EARLY_FLASH_RESCUE_RESPONSE  ResponsePacket;
 
   //
   // TODO: Library must reinstall its PPI, backed by NEM/DRAM
@@ -192,17 +1543,49 @@ PerformFlash (
     return EFI_DEVICE_ERROR;
   }
 
+  // Commands' buffers come from here, so none is allocated or located per command
+  Status = CreateSession ();
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Cannot allocate a buffer arena!\n"));
+    return Status;
+  }
+
+  CreateDigestCache ();
+
+  // DEBUG() output would corrupt responses, so hold it until userspace asks
+  FlashRescueLogCapture (TRUE);
+  mLogFramesEnabled = FALSE;
+
   // Userspace-side orchestrates procedure, so no looping over blocks
   NoUserspaceExit = 1;
+  IdleTimeoutS    = COMMAND_IDLE_TIMEOUT_S;
 
   LastServicedTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
   while (NoUserspaceExit) {
     // Check if there is command waiting for us
-    if (SerialPortPoll ()) {
+    if (RescueTransportPoll ()) {
       // Stall a tiny bit, in-case the remainder of the packet is flushing
-      MicroSecondDelay (10 * MS_IN_SECOND);
+      if (!RescueTransportAwaitsFrames ()) {
+        MicroSecondDelay (10 * MS_IN_SECOND);
+      }
+
+      RescueTransportRead ((UINT8 *)&CommandPacket, sizeof (CommandPacket));
+
+      // Log precedes a response, never splitting one. RESET and EXIT have none
+      if ((CommandPacket.Command != EARLY_FLASH_RESCUE_COMMAND_RESET) &&
+          (CommandPacket.Command != EARLY_FLASH_RESCUE_COMMAND_EXIT))
+      {
+        SendLogFrame ();
+      }
+
+      // At an unconfirmed baud rate, commands may be garbled. Refuse all but calibration
+      if (mBaudRatePending &&
+          (CommandPacket.Command != EARLY_FLASH_RESCUE_COMMAND_ECHO) &&
+          (CommandPacket.Command != EARLY_FLASH_RESCUE_COMMAND_SET_BAUD))
+      {
+        CommandPacket.Command = 0;
+      }
 
-      SerialPortRead ((UINT8 *)&CommandPacket, sizeof (CommandPacket));
       switch (CommandPacket.Command) {
         case EARLY_FLASH_RESCUE_COMMAND_CHECKSUM:
           SendBlockChecksum (CommandPacket.BlockNumber);
@@ -218,20 +1601,92 @@ PerformFlash (
         case EARLY_FLASH_RESCUE_COMMAND_EXIT:
           NoUserspaceExit = 0;
           break;
+        case EARLY_FLASH_RESCUE_COMMAND_DIGEST:
+          SelectBlockDigest (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_ERASE:
+          EraseBlock (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_FILL:
+          FillBlock (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_COPY:
+          CopyBlock (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_DIGEST_TABLE:
+          SendDigestTable (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_MANIFEST_READ:
+          SendManifest ();
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_MANIFEST_STORE:
+          StoreManifest ();
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_LOG:
+          SelectLogFrames (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_ECHO:
+          EchoData (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_SET_XFER:
+          SetXferSize (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_SET_BAUD:
+          SetBaudRate (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_STAGE:
+          StageBlocks (CommandPacket.BlockNumber);
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_INFO:
+          SendBoardInfo ();
+          break;
+        case EARLY_FLASH_RESCUE_COMMAND_KEEPALIVE:
+          // Userspace holds the session open between flashes, for `BlockNumber` seconds
+          IdleTimeoutS = (CommandPacket.BlockNumber != 0) ? CommandPacket.BlockNumber : COMMAND_IDLE_TIMEOUT_S;
+
+          ResponsePacket.Acknowledge = 1;
+          ResponsePacket.Size = 0;
+          RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
+          break;
         default:
+          if (HandlePhaseCommand (&CommandPacket)) {
+            break;
+          }
+
+          DEBUG ((DEBUG_ERROR, "Cannot understand command 0x%x!\n", CommandPacket.Command));
+          // NACK as unsupported, so userspace can probe for optional commands
+          ResponsePacket.Acknowledge = 0;
+          ResponsePacket.Size = EARLY_FLASH_RESCUE_NACK_UNSUPPORTED;
+          RescueTransportWrite ((UINT8 *)&ResponsePacket, sizeof (ResponsePacket));
           break;
       }
 
       LastServicedTimeNs = GetTimeInNanoSecond (GetPerformanceCounter ());
     }
 
+    // Userspace could not confirm the new baud rate, so return to one it can hear
+    if (mBaudRatePending && (GetTimeInNanoSecond (GetPerformanceCounter ()) >= mBaudConfirmDeadlineNs)) {
+      mBaudRatePending = FALSE;
+      mBaudRate = mPreviousBaudRate;
+      RescueTransportSetBaudRate (mBaudRate);
+      DEBUG ((DEBUG_WARN, "Baud rate was not confirmed. Reverted\n"));
+    }
+
     if ((GetTimeInNanoSecond (GetPerformanceCounter ()) - LastServicedTimeNs) >=
-        (10ULL * NS_IN_SECOND)) {
+        MultU64x32 (IdleTimeoutS, NS_IN_SECOND)) {
       // This is very bad. SPI flash could be inconsistent
       // - In CAR there's likely too little memory to stash a backup
+      EndLogCapture ();
+      RestoreBaudRate ();
+      DestroyDigestCache ();
+      DestroySession ();
       return EFI_TIMEOUT;
     }
   }
 
+  EndLogCapture ();
+  RestoreBaudRate ();
+  DestroyDigestCache ();
+  DestroySession ();
   return EFI_SUCCESS;
 }
@@ -12,9 +12,11 @@
 #include <Library/PcdLib.h>
 #include <Library/PeiServicesLib.h>
 #include <Library/ResetSystemLib.h>
+#include <Library/SerialPortLib.h>
 #include <Library/SpiLib.h>
 #include <Library/TimerLib.h>
 #include <Ppi/FeatureInMemory.h>
+#include <Ppi/MemoryDiscovered.h>
 #include <Ppi/Spi2.h>
 #include "FlashRescueBoard.h"
 
@@ -67,6 +69,188 @@ PerformSystemReset (
   ResetCold ();
 }
 
+/**
+ * Bytes of memory this phase may allocate, which bound the session's buffer arena.
+ * - Pre-memory, this is what remains of the CAR heap. Post-memory, of the PEI memory
+ *
+ * @return Free bytes of NEM or DRAM.
+**/
+UINTN
+EFIAPI
+GetFreeMemorySize (
+  VOID
+  )
+{
+  EFI_HOB_HANDOFF_INFO_TABLE  *HandoffHob;
+  EFI_STATUS                  Status;
+
+  Status = PeiServicesGetHobList ((VOID **)&HandoffHob);
+  if (EFI_ERROR (Status)) {
+    return 0;
+  }
+
+  return (UINTN)(HandoffHob->EfiFreeMemoryTop - HandoffHob->EfiFreeMemoryBottom);
+}
+
+/**
+ * Whether permanent memory is installed, so the session may take its fast path.
+ *
+ * @return TRUE   Running with DRAM.
+ * @return FALSE  Running in CAR.
+**/
+BOOLEAN
+EFIAPI
+InPermanentMemory (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  VOID        *MemoryDiscovered;
+
+  Status = PeiServicesLocatePpi (
+             &gEfiPeiMemoryDiscoveredPpiGuid,
+             0,
+             NULL,
+             &MemoryDiscovered
+             );
+  return (BOOLEAN)!EFI_ERROR (Status);
+}
+
+/**
+ * Processors on which the session digests blocks, with MP services.
+ * - PEI's MP services PPI is not the DXE protocol, and its APs may still be in CAR
+ *
+ * @return NULL  PEI digests on the BSP alone.
+**/
+FLASH_RESCUE_DIGEST_PROCESSORS *
+EFIAPI
+GetDigestProcessors (
+  VOID
+  )
+{
+  return NULL;
+}
+
+/**
+ * Read from userspace, until `NumberOfBytes` arrive or the transport gives up.
+ *
+ * @param[out] Buffer         Buffer to read into.
+ * @param[in]  NumberOfBytes  Bytes to read.
+ *
+ * @return Number of bytes read.
+**/
+UINTN
+EFIAPI
+RescueTransportRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  NumberOfBytes
+  )
+{
+  return SerialPortRead (Buffer, NumberOfBytes);
+}
+
+/**
+ * Write to userspace.
+ *
+ * @param[in] Buffer         Buffer to write.
+ * @param[in] NumberOfBytes  Bytes to write.
+ *
+ * @return Number of bytes written.
+**/
+UINTN
+EFIAPI
+RescueTransportWrite (
+  IN UINT8  *Buffer,
+  IN UINTN  NumberOfBytes
+  )
+{
+  return SerialPortWrite (Buffer, NumberOfBytes);
+}
+
+/**
+ * Poll for data from userspace.
+ *
+ * @return TRUE   Data is waiting.
+ * @return FALSE  No data is waiting.
+**/
+BOOLEAN
+EFIAPI
+RescueTransportPoll (
+  VOID
+  )
+{
+  return SerialPortPoll ();
+}
+
+/**
+ * Whether reads wait for a whole frame, with a hardware timeout.
+ * - SerialPortLib has no timeout, so PEI stalls instead
+ *
+ * @return FALSE  Reads require a stall.
+**/
+BOOLEAN
+EFIAPI
+RescueTransportAwaitsFrames (
+  VOID
+  )
+{
+  return FALSE;
+}
+
+/**
+ * Change the baud rate of the link to userspace.
+ *
+ * @param[in] BaudRate  New baud rate, or zero for the default.
+ *
+ * @return EFI_SUCCESS  Baud rate changed.
+ * @return Others       SerialPortLib cannot use this baud rate.
+**/
+EFI_STATUS
+EFIAPI
+RescueTransportSetBaudRate (
+  IN UINT64  BaudRate
+  )
+{
+  UINT32              ReceiveFifoDepth;
+  UINT32              Timeout;
+  EFI_PARITY_TYPE     Parity;
+  UINT8               DataBits;
+  EFI_STOP_BITS_TYPE  StopBits;
+
+  // Zeroes keep the line settings userspace expects
+  ReceiveFifoDepth = 0;
+  Timeout  = 0;
+  Parity   = DefaultParity;
+  DataBits = 0;
+  StopBits = DefaultStopBits;
+
+  return (EFI_STATUS)SerialPortSetAttributes (
+                       &BaudRate,
+                       &ReceiveFifoDepth,
+                       &Timeout,
+                       &Parity,
+                       &DataBits,
+                       &StopBits
+                       );
+}
+
+/**
+ * Handle a command that only this phase implements.
+ * - There are none. Staging is bounded by the buffer arena, which CAR keeps small
+ *
+ * @param[in] CommandPacket  Command received from userspace.
+ *
+ * @return FALSE  Command is unknown to this phase.
+**/
+BOOLEAN
+EFIAPI
+HandlePhaseCommand (
+  IN EARLY_FLASH_RESCUE_COMMAND  *CommandPacket
+  )
+{
+  return FALSE;
+}
+
 /**
  * During no-evict mode, cache coherency is by definition not maintained.
  * Consequently, it's quite plausible that L1i and L3 (CAR) become out of sync.
@@ -145,24 +329,39 @@ FlashRescueBoardPeiEntryPoint (
   }
 
   //
-  // First entry: Establish communication with board or don't reload
+  // Post-memory: PEI core shadows this PEIM into DRAM, then enters it again
+  // - Flash from the shadow, whose buffers are sized by DRAM rather than CAR.
+  //   Boot modes that are not shadowed take the CAR path
   //
-  DEBUG ((DEBUG_INFO, "HELLO begins. Re-connect with userspace-side now\n"));
-  MicroSecondDelay (3000 * MS_IN_SECOND);
+  if (InPermanentMemory ()) {
+    Status = PeiServicesRegisterForShadow (FileHandle);
+    if (Status == EFI_SUCCESS) {
+      return EFI_SUCCESS;
+    }
 
-  Status = SendHelloPacket ();
-  if (EFI_ERROR (Status)) {
-    return EFI_SUCCESS;
+    if (Status == EFI_ALREADY_STARTED) {
+      Status = ProbeForUserspace ();
+      if (EFI_ERROR (Status)) {
+        DEBUG ((DEBUG_INFO, "No flash rescue userspace attached, continuing boot\n"));
+        return EFI_SUCCESS;
+      }
+
+      Status = PerformFlash ();
+      ASSERT_EFI_ERROR (Status);
+
+      return EFI_SUCCESS;
+    }
   }
 
   //
-  // If the DEBUG() stack uses the same transport as our SerialPortLib,
-  // it seems like commands are lost when DEBUG() fills the FIFO.
-  // Therefore, disable DEBUG().
-  // - However, this requires testing.
-  // - TODO: Must re-enable DEBUG() for other modules?
+  // First entry: Establish communication with board or don't reload
+  // - Userspace must already await HELLO, so that boots without it are not stalled
   //
-  PatchPcdSet32 (PcdDebugPrintErrorLevel, 0x0);
+  Status = ProbeForUserspace ();
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_INFO, "No flash rescue userspace attached, continuing boot\n"));
+    return EFI_SUCCESS;
+  }
 
   //
   // Find this PEIM, then obtain a PE context with its data handle
@@ -205,7 +404,10 @@ FlashRescueBoardPeiEntryPoint (
   Status = PeCoffLoaderRelocateImage (&ImageContext);
   ASSERT_EFI_ERROR (Status);
 
-  FlushBiosHack ();
+  // DRAM is coherent, so only NEM needs this
+  if (!InPermanentMemory ()) {
+    FlushBiosHack ();
+  }
 
   //
   // Install flag PPI and call entrypoint
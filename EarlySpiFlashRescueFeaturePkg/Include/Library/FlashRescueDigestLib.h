@@ -0,0 +1,169 @@
+/** @file
+  Block digests for the early SPI flash rescue protocol.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef FLASH_RESCUE_DIGEST_LIB_H
+#define FLASH_RESCUE_DIGEST_LIB_H
+
+#include <Pi/PiMultiPhase.h>
+#include <Protocol/MpService.h>
+
+//
+// Digest types, as negotiated with userspace. CRC32 is the default.
+//
+#define FLASH_RESCUE_DIGEST_CRC32     0x00
+#define FLASH_RESCUE_DIGEST_CRC32C    0x01
+#define FLASH_RESCUE_DIGEST_CRC64     0x02
+#define FLASH_RESCUE_DIGEST_MAX_SIZE  8
+
+/**
+ * Digest a buffer. Narrower digests are zero-extended.
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return Digest of the data.
+**/
+typedef
+UINT64
+(EFIAPI *FLASH_RESCUE_DIGEST_FUNCTION)(
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  );
+
+/**
+ * Return the size of a digest type.
+ *
+ * @param[in] DigestType  FLASH_RESCUE_DIGEST_* type.
+ *
+ * @return Size of the digest in bytes, or 0 if the type is unsupported.
+**/
+UINTN
+EFIAPI
+FlashRescueDigestSize (
+  IN UINT8  DigestType
+  );
+
+/**
+ * Resolve the fastest implementation of a digest type on this CPU.
+ * Resolve once, as feature detection is costly under some hypervisors.
+ *
+ * @param[in] DigestType  FLASH_RESCUE_DIGEST_* type.
+ *
+ * @return Digest function, or NULL if the type is unsupported.
+**/
+FLASH_RESCUE_DIGEST_FUNCTION
+EFIAPI
+FlashRescueGetDigestFunction (
+  IN UINT8  DigestType
+  );
+
+/**
+ * Wait for an event, as EFI_BOOT_SERVICES.WaitForEvent() does.
+ *
+ * @param[in] Event  Event to wait for.
+ *
+ * @return EFI_SUCCESS  Event was signalled.
+**/
+typedef
+EFI_STATUS
+(EFIAPI *FLASH_RESCUE_WAIT_FOR_EVENT)(
+  IN EFI_EVENT  Event
+  );
+
+//
+// Processors that share the blocks. This library is BASE, so the caller provides the
+// boot services that await the APs
+//
+typedef struct {
+  EFI_MP_SERVICES_PROTOCOL     *MpServices;
+  EFI_EVENT                    WaitEvent;     // Signalled once the APs finish
+  FLASH_RESCUE_WAIT_FOR_EVENT  WaitForEvent;
+} FLASH_RESCUE_DIGEST_PROCESSORS;
+
+/**
+ * Digest each block of a buffer, sharing the blocks between every processor.
+ * - Without MP services, or should the APs fail to start, the BSP digests them alone
+ * - The APs are started without blocking, so the BSP digests too. It returns once
+ *   the APs have finished, and each block is digested
+ *
+ * @param[in]  Processors      Processors to share with, or NULL to digest on this one.
+ * @param[in]  DigestFunction  Digest function, as from FlashRescueGetDigestFunction().
+ * @param[in]  Blocks          Buffer of `BlockCount` blocks.
+ * @param[in]  BlockCount      Number of blocks.
+ * @param[in]  BlockSize       Size of each block in bytes.
+ * @param[out] Digests         Digest of each block.
+**/
+VOID
+EFIAPI
+FlashRescueDigestBlocks (
+  IN  FLASH_RESCUE_DIGEST_PROCESSORS  *Processors OPTIONAL,
+  IN  FLASH_RESCUE_DIGEST_FUNCTION    DigestFunction,
+  IN  CONST UINT8                     *Blocks,
+  IN  UINTN                           BlockCount,
+  IN  UINTN                           BlockSize,
+  OUT UINT64                          *Digests
+  );
+
+/**
+ * Determine whether the CPU implements the SSE4.2 `crc32` instruction.
+ *
+ * @retval TRUE   FlashRescueCrc32cHardware() may be used.
+ * @retval FALSE  FlashRescueCrc32cHardware() must not be used.
+**/
+BOOLEAN
+EFIAPI
+FlashRescueIsCrc32cHardwareSupported (
+  VOID
+  );
+
+/**
+ * Calculate CRC32C (Castagnoli) with the SSE4.2 `crc32` instruction.
+ * - Caller must check FlashRescueIsCrc32cHardwareSupported()
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return CRC32C of the data.
+**/
+UINT32
+EFIAPI
+FlashRescueCrc32cHardware (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  );
+
+/**
+ * Calculate CRC32C (Castagnoli) with the table-driven fallback.
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return CRC32C of the data.
+**/
+UINT32
+EFIAPI
+FlashRescueCrc32cSoftware (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  );
+
+/**
+ * Calculate CRC-64/XZ (ECMA-182 polynomial, reflected).
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return CRC64 of the data.
+**/
+UINT64
+EFIAPI
+FlashRescueCrc64 (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  );
+
+#endif
@@ -0,0 +1,66 @@
+/** @file
+  Board log for the early SPI flash rescue protocol.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#ifndef FLASH_RESCUE_LOG_LIB_H
+#define FLASH_RESCUE_LOG_LIB_H
+
+/**
+ * Start or stop capturing messages, rather than writing them to the serial port.
+ * - Messages captured earlier remain queued until read
+ *
+ * @param[in] Capture  TRUE while a session holds the serial port.
+**/
+VOID
+EFIAPI
+FlashRescueLogCapture (
+  IN BOOLEAN  Capture
+  );
+
+/**
+ * Determine whether messages are being captured.
+ *
+ * @retval TRUE   Messages must be passed to FlashRescueLogWrite().
+ * @retval FALSE  Messages may be written to the serial port.
+**/
+BOOLEAN
+EFIAPI
+FlashRescueLogIsCapturing (
+  VOID
+  );
+
+/**
+ * Queue a message. A message that does not fit is dropped whole, and counted.
+ *
+ * @param[in] Message  Message to queue.
+ * @param[in] Length   Size of the message in bytes.
+ *
+ * @return Number of bytes queued, either Length or 0.
+**/
+UINTN
+EFIAPI
+FlashRescueLogWrite (
+  IN CONST CHAR8  *Message,
+  IN UINTN        Length
+  );
+
+/**
+ * Dequeue messages, oldest first. Once the queue is empty, a note of any
+ * dropped messages follows.
+ *
+ * @param[out] Buffer  Buffer to dequeue into.
+ * @param[in]  Size    Size of the buffer in bytes.
+ *
+ * @return Number of bytes dequeued.
+**/
+UINTN
+EFIAPI
+FlashRescueLogRead (
+  OUT CHAR8  *Buffer,
+  IN  UINTN  Size
+  );
+
+#endif
@@ -0,0 +1,264 @@
+/** @file
+  DebugLib for the early SPI flash rescue modules.
+
+  Messages are written to the serial port, as BaseDebugLibSerialPort does,
+  except while a session captures them with FlashRescueLogLib. Then DEBUG()
+  need not be disabled during rescue, as it no longer corrupts responses.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/DebugPrintErrorLevelLib.h>
+#include <Library/FlashRescueLogLib.h>
+#include <Library/PcdLib.h>
+#include <Library/PrintLib.h>
+#include <Library/SerialPortLib.h>
+
+#define MAX_DEBUG_MESSAGE_LENGTH  0x100
+
+/**
+ * The constructor initialises the serial port, as DEBUG() may be its first user.
+ *
+ * @return RETURN_SUCCESS  Serial port was initialised.
+**/
+RETURN_STATUS
+EFIAPI
+BaseDebugLibFlashRescueConstructor (
+  VOID
+  )
+{
+  return SerialPortInitialize ();
+}
+
+/**
+ * Print a formatted message, to the log or to the serial port.
+ *
+ * @param[in] ErrorLevel      Error level of the message.
+ * @param[in] Format          Format string for the message.
+ * @param[in] VaListMarker    VA_LIST of arguments, unless BaseListMarker is used.
+ * @param[in] BaseListMarker  BASE_LIST of arguments, or NULL.
+**/
+STATIC
+VOID
+DebugPrintMarker (
+  IN UINTN        ErrorLevel,
+  IN CONST CHAR8  *Format,
+  IN VA_LIST      VaListMarker,
+  IN BASE_LIST    BaseListMarker
+  )
+{
+  CHAR8  Buffer[MAX_DEBUG_MESSAGE_LENGTH];
+  UINTN  Length;
+
+  if ((ErrorLevel & GetDebugPrintErrorLevel ()) == 0) {
+    return;
+  }
+
+  if (BaseListMarker == NULL) {
+    Length = AsciiVSPrint (Buffer, sizeof (Buffer), Format, VaListMarker);
+  } else {
+    Length = AsciiBSPrint (Buffer, sizeof (Buffer), Format, BaseListMarker);
+  }
+
+  if (FlashRescueLogIsCapturing ()) {
+    FlashRescueLogWrite (Buffer, Length);
+  } else {
+    SerialPortWrite ((UINT8 *)Buffer, Length);
+  }
+}
+
+/**
+ * Print a formatted message.
+ *
+ * @param[in] ErrorLevel  Error level of the message.
+ * @param[in] Format      Format string for the message.
+ * @param[in] ...         Arguments for the format string.
+**/
+VOID
+EFIAPI
+DebugPrint (
+  IN UINTN        ErrorLevel,
+  IN CONST CHAR8  *Format,
+  ...
+  )
+{
+  VA_LIST  Marker;
+
+  VA_START (Marker, Format);
+  DebugPrintMarker (ErrorLevel, Format, Marker, NULL);
+  VA_END (Marker);
+}
+
+/**
+ * Print a formatted message, with a VA_LIST of arguments.
+ *
+ * @param[in] ErrorLevel    Error level of the message.
+ * @param[in] Format        Format string for the message.
+ * @param[in] VaListMarker  VA_LIST of arguments.
+**/
+VOID
+EFIAPI
+DebugVPrint (
+  IN UINTN        ErrorLevel,
+  IN CONST CHAR8  *Format,
+  IN VA_LIST      VaListMarker
+  )
+{
+  DebugPrintMarker (ErrorLevel, Format, VaListMarker, NULL);
+}
+
+/**
+ * Print a formatted message, with a BASE_LIST of arguments.
+ *
+ * @param[in] ErrorLevel      Error level of the message.
+ * @param[in] Format          Format string for the message.
+ * @param[in] BaseListMarker  BASE_LIST of arguments.
+**/
+VOID
+EFIAPI
+DebugBPrint (
+  IN UINTN        ErrorLevel,
+  IN CONST CHAR8  *Format,
+  IN BASE_LIST    BaseListMarker
+  )
+{
+  DebugPrintMarker (ErrorLevel, Format, NULL, BaseListMarker);
+}
+
+/**
+ * Print an assert message, then break or hang as PcdDebugPropertyMask selects.
+ * - The session cannot continue, so the message goes to the serial port,
+ *   where a console may still see it
+ *
+ * @param[in] FileName     File containing the assertion.
+ * @param[in] LineNumber   Line number of the assertion.
+ * @param[in] Description  Assertion that failed.
+**/
+VOID
+EFIAPI
+DebugAssert (
+  IN CONST CHAR8  *FileName,
+  IN UINTN        LineNumber,
+  IN CONST CHAR8  *Description
+  )
+{
+  CHAR8  Buffer[MAX_DEBUG_MESSAGE_LENGTH];
+  UINTN  Length;
+
+  Length = AsciiSPrint (
+             Buffer,
+             sizeof (Buffer),
+             "ASSERT [%a] %a(%d): %a\n",
+             gEfiCallerBaseName,
+             FileName,
+             LineNumber,
+             Description
+             );
+  SerialPortWrite ((UINT8 *)Buffer, Length);
+
+  if ((PcdGet8 (PcdDebugPropertyMask) & DEBUG_PROPERTY_ASSERT_BREAKPOINT_ENABLED) != 0) {
+    CpuBreakpoint ();
+  } else if ((PcdGet8 (PcdDebugPropertyMask) & DEBUG_PROPERTY_ASSERT_DEADLOOP_ENABLED) != 0) {
+    CpuDeadLoop ();
+  }
+}
+
+/**
+ * Fill a buffer with PcdDebugClearMemoryValue.
+ *
+ * @param[out] Buffer  Buffer to fill.
+ * @param[in]  Length  Size of the buffer in bytes.
+ *
+ * @return Buffer.
+**/
+VOID *
+EFIAPI
+DebugClearMemory (
+  OUT VOID  *Buffer,
+  IN UINTN  Length
+  )
+{
+  return SetMem (Buffer, Length, PcdGet8 (PcdDebugClearMemoryValue));
+}
+
+/**
+ * Determine whether ASSERT() macros are enabled.
+ *
+ * @retval TRUE   DEBUG_PROPERTY_DEBUG_ASSERT_ENABLED is set.
+ * @retval FALSE  DEBUG_PROPERTY_DEBUG_ASSERT_ENABLED is clear.
+**/
+BOOLEAN
+EFIAPI
+DebugAssertEnabled (
+  VOID
+  )
+{
+  return (BOOLEAN)((PcdGet8 (PcdDebugPropertyMask) & DEBUG_PROPERTY_DEBUG_ASSERT_ENABLED) != 0);
+}
+
+/**
+ * Determine whether DEBUG() macros are enabled.
+ *
+ * @retval TRUE   DEBUG_PROPERTY_DEBUG_PRINT_ENABLED is set.
+ * @retval FALSE  DEBUG_PROPERTY_DEBUG_PRINT_ENABLED is clear.
+**/
+BOOLEAN
+EFIAPI
+DebugPrintEnabled (
+  VOID
+  )
+{
+  return (BOOLEAN)((PcdGet8 (PcdDebugPropertyMask) & DEBUG_PROPERTY_DEBUG_PRINT_ENABLED) != 0);
+}
+
+/**
+ * Determine whether DEBUG_CODE() macros are enabled.
+ *
+ * @retval TRUE   DEBUG_PROPERTY_DEBUG_CODE_ENABLED is set.
+ * @retval FALSE  DEBUG_PROPERTY_DEBUG_CODE_ENABLED is clear.
+**/
+BOOLEAN
+EFIAPI
+DebugCodeEnabled (
+  VOID
+  )
+{
+  return (BOOLEAN)((PcdGet8 (PcdDebugPropertyMask) & DEBUG_PROPERTY_DEBUG_CODE_ENABLED) != 0);
+}
+
+/**
+ * Determine whether DEBUG_CLEAR_MEMORY() macros are enabled.
+ *
+ * @retval TRUE   DEBUG_PROPERTY_CLEAR_MEMORY_ENABLED is set.
+ * @retval FALSE  DEBUG_PROPERTY_CLEAR_MEMORY_ENABLED is clear.
+**/
+BOOLEAN
+EFIAPI
+DebugClearMemoryEnabled (
+  VOID
+  )
+{
+  return (BOOLEAN)((PcdGet8 (PcdDebugPropertyMask) & DEBUG_PROPERTY_CLEAR_MEMORY_ENABLED) != 0);
+}
+
+/**
+ * Determine whether an error level is built into DEBUG() macros.
+ *
+ * @param[in] ErrorLevel  Error level to check.
+ *
+ * @retval TRUE   ErrorLevel is in PcdFixedDebugPrintErrorLevel.
+ * @retval FALSE  ErrorLevel is not in PcdFixedDebugPrintErrorLevel.
+**/
+BOOLEAN
+EFIAPI
+DebugPrintLevelEnabled (
+  IN CONST UINTN  ErrorLevel
+  )
+{
+  return (BOOLEAN)((ErrorLevel & PcdGet32 (PcdFixedDebugPrintErrorLevel)) != 0);
+}
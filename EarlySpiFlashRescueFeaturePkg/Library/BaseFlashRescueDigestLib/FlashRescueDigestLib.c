@@ -0,0 +1,578 @@
+/** @file
+  Block digests for the early SPI flash rescue protocol.
+
+  Hashing a region is on the critical path of every scan, so CRC32C uses the
+  SSE4.2 `crc32` instruction when available. There is no writable state, so
+  these routines are usable from XIP code as well as after relocation. Given
+  MP services, a buffer of blocks is digested by every processor at once.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/FlashRescueDigestLib.h>
+#include <Library/SynchronizationLib.h>
+
+#define CPUID_VERSION_INFO_ECX_SSE4_2  BIT20
+
+STATIC CONST UINT32  mCrc32cTable[256] = {
+  0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4,
+  0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+  0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+  0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+  0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B,
+  0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+  0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54,
+  0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+  0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+  0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+  0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5,
+  0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+  0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45,
+  0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+  0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+  0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+  0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48,
+  0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+  0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687,
+  0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+  0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+  0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+  0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8,
+  0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+  0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096,
+  0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+  0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+  0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+  0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9,
+  0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+  0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36,
+  0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+  0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+  0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+  0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043,
+  0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+  0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3,
+  0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+  0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+  0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+  0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652,
+  0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+  0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D,
+  0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+  0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+  0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+  0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2,
+  0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+  0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530,
+  0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+  0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+  0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+  0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F,
+  0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+  0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90,
+  0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+  0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+  0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+  0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321,
+  0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+  0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81,
+  0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+  0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+  0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351
+};
+
+STATIC CONST UINT64  mCrc64Table[256] = {
+  0x0000000000000000ULL, 0xB32E4CBE03A75F6FULL,
+  0xF4843657A840A05BULL, 0x47AA7AE9ABE7FF34ULL,
+  0x7BD0C384FF8F5E33ULL, 0xC8FE8F3AFC28015CULL,
+  0x8F54F5D357CFFE68ULL, 0x3C7AB96D5468A107ULL,
+  0xF7A18709FF1EBC66ULL, 0x448FCBB7FCB9E309ULL,
+  0x0325B15E575E1C3DULL, 0xB00BFDE054F94352ULL,
+  0x8C71448D0091E255ULL, 0x3F5F08330336BD3AULL,
+  0x78F572DAA8D1420EULL, 0xCBDB3E64AB761D61ULL,
+  0x7D9BA13851336649ULL, 0xCEB5ED8652943926ULL,
+  0x891F976FF973C612ULL, 0x3A31DBD1FAD4997DULL,
+  0x064B62BCAEBC387AULL, 0xB5652E02AD1B6715ULL,
+  0xF2CF54EB06FC9821ULL, 0x41E11855055BC74EULL,
+  0x8A3A2631AE2DDA2FULL, 0x39146A8FAD8A8540ULL,
+  0x7EBE1066066D7A74ULL, 0xCD905CD805CA251BULL,
+  0xF1EAE5B551A2841CULL, 0x42C4A90B5205DB73ULL,
+  0x056ED3E2F9E22447ULL, 0xB6409F5CFA457B28ULL,
+  0xFB374270A266CC92ULL, 0x48190ECEA1C193FDULL,
+  0x0FB374270A266CC9ULL, 0xBC9D3899098133A6ULL,
+  0x80E781F45DE992A1ULL, 0x33C9CD4A5E4ECDCEULL,
+  0x7463B7A3F5A932FAULL, 0xC74DFB1DF60E6D95ULL,
+  0x0C96C5795D7870F4ULL, 0xBFB889C75EDF2F9BULL,
+  0xF812F32EF538D0AFULL, 0x4B3CBF90F69F8FC0ULL,
+  0x774606FDA2F72EC7ULL, 0xC4684A43A15071A8ULL,
+  0x83C230AA0AB78E9CULL, 0x30EC7C140910D1F3ULL,
+  0x86ACE348F355AADBULL, 0x3582AFF6F0F2F5B4ULL,
+  0x7228D51F5B150A80ULL, 0xC10699A158B255EFULL,
+  0xFD7C20CC0CDAF4E8ULL, 0x4E526C720F7DAB87ULL,
+  0x09F8169BA49A54B3ULL, 0xBAD65A25A73D0BDCULL,
+  0x710D64410C4B16BDULL, 0xC22328FF0FEC49D2ULL,
+  0x85895216A40BB6E6ULL, 0x36A71EA8A7ACE989ULL,
+  0x0ADDA7C5F3C4488EULL, 0xB9F3EB7BF06317E1ULL,
+  0xFE5991925B84E8D5ULL, 0x4D77DD2C5823B7BAULL,
+  0x64B62BCAEBC387A1ULL, 0xD7986774E864D8CEULL,
+  0x90321D9D438327FAULL, 0x231C512340247895ULL,
+  0x1F66E84E144CD992ULL, 0xAC48A4F017EB86FDULL,
+  0xEBE2DE19BC0C79C9ULL, 0x58CC92A7BFAB26A6ULL,
+  0x9317ACC314DD3BC7ULL, 0x2039E07D177A64A8ULL,
+  0x67939A94BC9D9B9CULL, 0xD4BDD62ABF3AC4F3ULL,
+  0xE8C76F47EB5265F4ULL, 0x5BE923F9E8F53A9BULL,
+  0x1C4359104312C5AFULL, 0xAF6D15AE40B59AC0ULL,
+  0x192D8AF2BAF0E1E8ULL, 0xAA03C64CB957BE87ULL,
+  0xEDA9BCA512B041B3ULL, 0x5E87F01B11171EDCULL,
+  0x62FD4976457FBFDBULL, 0xD1D305C846D8E0B4ULL,
+  0x96797F21ED3F1F80ULL, 0x2557339FEE9840EFULL,
+  0xEE8C0DFB45EE5D8EULL, 0x5DA24145464902E1ULL,
+  0x1A083BACEDAEFDD5ULL, 0xA9267712EE09A2BAULL,
+  0x955CCE7FBA6103BDULL, 0x267282C1B9C65CD2ULL,
+  0x61D8F8281221A3E6ULL, 0xD2F6B4961186FC89ULL,
+  0x9F8169BA49A54B33ULL, 0x2CAF25044A02145CULL,
+  0x6B055FEDE1E5EB68ULL, 0xD82B1353E242B407ULL,
+  0xE451AA3EB62A1500ULL, 0x577FE680B58D4A6FULL,
+  0x10D59C691E6AB55BULL, 0xA3FBD0D71DCDEA34ULL,
+  0x6820EEB3B6BBF755ULL, 0xDB0EA20DB51CA83AULL,
+  0x9CA4D8E41EFB570EULL, 0x2F8A945A1D5C0861ULL,
+  0x13F02D374934A966ULL, 0xA0DE61894A93F609ULL,
+  0xE7741B60E174093DULL, 0x545A57DEE2D35652ULL,
+  0xE21AC88218962D7AULL, 0x5134843C1B317215ULL,
+  0x169EFED5B0D68D21ULL, 0xA5B0B26BB371D24EULL,
+  0x99CA0B06E7197349ULL, 0x2AE447B8E4BE2C26ULL,
+  0x6D4E3D514F59D312ULL, 0xDE6071EF4CFE8C7DULL,
+  0x15BB4F8BE788911CULL, 0xA6950335E42FCE73ULL,
+  0xE13F79DC4FC83147ULL, 0x521135624C6F6E28ULL,
+  0x6E6B8C0F1807CF2FULL, 0xDD45C0B11BA09040ULL,
+  0x9AEFBA58B0476F74ULL, 0x29C1F6E6B3E0301BULL,
+  0xC96C5795D7870F42ULL, 0x7A421B2BD420502DULL,
+  0x3DE861C27FC7AF19ULL, 0x8EC62D7C7C60F076ULL,
+  0xB2BC941128085171ULL, 0x0192D8AF2BAF0E1EULL,
+  0x4638A2468048F12AULL, 0xF516EEF883EFAE45ULL,
+  0x3ECDD09C2899B324ULL, 0x8DE39C222B3EEC4BULL,
+  0xCA49E6CB80D9137FULL, 0x7967AA75837E4C10ULL,
+  0x451D1318D716ED17ULL, 0xF6335FA6D4B1B278ULL,
+  0xB199254F7F564D4CULL, 0x02B769F17CF11223ULL,
+  0xB4F7F6AD86B4690BULL, 0x07D9BA1385133664ULL,
+  0x4073C0FA2EF4C950ULL, 0xF35D8C442D53963FULL,
+  0xCF273529793B3738ULL, 0x7C0979977A9C6857ULL,
+  0x3BA3037ED17B9763ULL, 0x888D4FC0D2DCC80CULL,
+  0x435671A479AAD56DULL, 0xF0783D1A7A0D8A02ULL,
+  0xB7D247F3D1EA7536ULL, 0x04FC0B4DD24D2A59ULL,
+  0x3886B22086258B5EULL, 0x8BA8FE9E8582D431ULL,
+  0xCC0284772E652B05ULL, 0x7F2CC8C92DC2746AULL,
+  0x325B15E575E1C3D0ULL, 0x8175595B76469CBFULL,
+  0xC6DF23B2DDA1638BULL, 0x75F16F0CDE063CE4ULL,
+  0x498BD6618A6E9DE3ULL, 0xFAA59ADF89C9C28CULL,
+  0xBD0FE036222E3DB8ULL, 0x0E21AC88218962D7ULL,
+  0xC5FA92EC8AFF7FB6ULL, 0x76D4DE52895820D9ULL,
+  0x317EA4BB22BFDFEDULL, 0x8250E80521188082ULL,
+  0xBE2A516875702185ULL, 0x0D041DD676D77EEAULL,
+  0x4AAE673FDD3081DEULL, 0xF9802B81DE97DEB1ULL,
+  0x4FC0B4DD24D2A599ULL, 0xFCEEF8632775FAF6ULL,
+  0xBB44828A8C9205C2ULL, 0x086ACE348F355AADULL,
+  0x34107759DB5DFBAAULL, 0x873E3BE7D8FAA4C5ULL,
+  0xC094410E731D5BF1ULL, 0x73BA0DB070BA049EULL,
+  0xB86133D4DBCC19FFULL, 0x0B4F7F6AD86B4690ULL,
+  0x4CE50583738CB9A4ULL, 0xFFCB493D702BE6CBULL,
+  0xC3B1F050244347CCULL, 0x709FBCEE27E418A3ULL,
+  0x3735C6078C03E797ULL, 0x841B8AB98FA4B8F8ULL,
+  0xADDA7C5F3C4488E3ULL, 0x1EF430E13FE3D78CULL,
+  0x595E4A08940428B8ULL, 0xEA7006B697A377D7ULL,
+  0xD60ABFDBC3CBD6D0ULL, 0x6524F365C06C89BFULL,
+  0x228E898C6B8B768BULL, 0x91A0C532682C29E4ULL,
+  0x5A7BFB56C35A3485ULL, 0xE955B7E8C0FD6BEAULL,
+  0xAEFFCD016B1A94DEULL, 0x1DD181BF68BDCBB1ULL,
+  0x21AB38D23CD56AB6ULL, 0x9285746C3F7235D9ULL,
+  0xD52F0E859495CAEDULL, 0x6601423B97329582ULL,
+  0xD041DD676D77EEAAULL, 0x636F91D96ED0B1C5ULL,
+  0x24C5EB30C5374EF1ULL, 0x97EBA78EC690119EULL,
+  0xAB911EE392F8B099ULL, 0x18BF525D915FEFF6ULL,
+  0x5F1528B43AB810C2ULL, 0xEC3B640A391F4FADULL,
+  0x27E05A6E926952CCULL, 0x94CE16D091CE0DA3ULL,
+  0xD3646C393A29F297ULL, 0x604A2087398EADF8ULL,
+  0x5C3099EA6DE60CFFULL, 0xEF1ED5546E415390ULL,
+  0xA8B4AFBDC5A6ACA4ULL, 0x1B9AE303C601F3CBULL,
+  0x56ED3E2F9E224471ULL, 0xE5C372919D851B1EULL,
+  0xA26908783662E42AULL, 0x114744C635C5BB45ULL,
+  0x2D3DFDAB61AD1A42ULL, 0x9E13B115620A452DULL,
+  0xD9B9CBFCC9EDBA19ULL, 0x6A978742CA4AE576ULL,
+  0xA14CB926613CF817ULL, 0x1262F598629BA778ULL,
+  0x55C88F71C97C584CULL, 0xE6E6C3CFCADB0723ULL,
+  0xDA9C7AA29EB3A624ULL, 0x69B2361C9D14F94BULL,
+  0x2E184CF536F3067FULL, 0x9D36004B35545910ULL,
+  0x2B769F17CF112238ULL, 0x9858D3A9CCB67D57ULL,
+  0xDFF2A94067518263ULL, 0x6CDCE5FE64F6DD0CULL,
+  0x50A65C93309E7C0BULL, 0xE388102D33392364ULL,
+  0xA4226AC498DEDC50ULL, 0x170C267A9B79833FULL,
+  0xDCD7181E300F9E5EULL, 0x6FF954A033A8C131ULL,
+  0x28532E49984F3E05ULL, 0x9B7D62F79BE8616AULL,
+  0xA707DB9ACF80C06DULL, 0x14299724CC279F02ULL,
+  0x5383EDCD67C06036ULL, 0xE0ADA17364673F59ULL
+};
+
+#if defined (_MSC_VER)
+unsigned int
+_mm_crc32_u32 (
+  unsigned int  Crc,
+  unsigned int  Data
+  );
+
+  #pragma intrinsic (_mm_crc32_u32)
+  #if defined (MDE_CPU_X64)
+unsigned __int64
+_mm_crc32_u64 (
+  unsigned __int64  Crc,
+  unsigned __int64  Data
+  );
+
+    #pragma intrinsic (_mm_crc32_u64)
+  #endif
+#endif
+
+/**
+ * Determine whether the CPU implements the SSE4.2 `crc32` instruction.
+ *
+ * @retval TRUE   FlashRescueCrc32cHardware() may be used.
+ * @retval FALSE  FlashRescueCrc32cHardware() must not be used.
+**/
+BOOLEAN
+EFIAPI
+FlashRescueIsCrc32cHardwareSupported (
+  VOID
+  )
+{
+  UINT32  Ecx;
+
+  AsmCpuid (0x1, NULL, NULL, &Ecx, NULL);
+  return (Ecx & CPUID_VERSION_INFO_ECX_SSE4_2) != 0;
+}
+
+/**
+ * Calculate CRC32C (Castagnoli) with the SSE4.2 `crc32` instruction.
+ * - Caller must check FlashRescueIsCrc32cHardwareSupported()
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return CRC32C of the data.
+**/
+UINT32
+EFIAPI
+FlashRescueCrc32cHardware (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  )
+{
+  CONST UINT8  *Ptr;
+  UINT32       Crc;
+  UINT32       Data32;
+
+ #if defined (MDE_CPU_X64)
+  UINT64  Crc64;
+  UINT64  Data64;
+ #endif
+
+  Ptr = Buffer;
+  Crc = 0xFFFFFFFF;
+
+ #if defined (MDE_CPU_X64)
+  Crc64 = Crc;
+  while (Length >= sizeof (UINT64)) {
+    Data64 = ReadUnaligned64 ((CONST UINT64 *)Ptr);
+  #if defined (_MSC_VER)
+    Crc64 = _mm_crc32_u64 (Crc64, Data64);
+  #else
+    __asm__ ("crc32q %1, %0" : "+r" (Crc64) : "rm" (Data64));
+  #endif
+    Ptr    += sizeof (UINT64);
+    Length -= sizeof (UINT64);
+  }
+
+  Crc = (UINT32)Crc64;
+ #endif
+
+  while (Length >= sizeof (UINT32)) {
+    Data32 = ReadUnaligned32 ((CONST UINT32 *)Ptr);
+ #if defined (_MSC_VER)
+    Crc = _mm_crc32_u32 (Crc, Data32);
+ #else
+    __asm__ ("crc32l %1, %0" : "+r" (Crc) : "rm" (Data32));
+ #endif
+    Ptr    += sizeof (UINT32);
+    Length -= sizeof (UINT32);
+  }
+
+  while (Length > 0) {
+    Crc = (Crc >> 8) ^ mCrc32cTable[(Crc ^ *Ptr) & 0xFF];
+    Ptr++;
+    Length--;
+  }
+
+  return Crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * Calculate CRC32C (Castagnoli) with the table-driven fallback.
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return CRC32C of the data.
+**/
+UINT32
+EFIAPI
+FlashRescueCrc32cSoftware (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  )
+{
+  CONST UINT8  *Ptr;
+  UINT32       Crc;
+
+  Ptr = Buffer;
+  Crc = 0xFFFFFFFF;
+  while (Length > 0) {
+    Crc = (Crc >> 8) ^ mCrc32cTable[(Crc ^ *Ptr) & 0xFF];
+    Ptr++;
+    Length--;
+  }
+
+  return Crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * Calculate CRC-64/XZ (ECMA-182 polynomial, reflected).
+ *
+ * @param[in] Buffer  Data to digest.
+ * @param[in] Length  Size of the data in bytes.
+ *
+ * @return CRC64 of the data.
+**/
+UINT64
+EFIAPI
+FlashRescueCrc64 (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  )
+{
+  CONST UINT8  *Ptr;
+  UINT64       Crc;
+
+  Ptr = Buffer;
+  Crc = MAX_UINT64;
+  while (Length > 0) {
+    Crc = RShiftU64 (Crc, 8) ^ mCrc64Table[((UINT8)Crc ^ *Ptr)];
+    Ptr++;
+    Length--;
+  }
+
+  return Crc ^ MAX_UINT64;
+}
+
+//
+// Adapt each kernel to FLASH_RESCUE_DIGEST_FUNCTION
+//
+STATIC
+UINT64
+EFIAPI
+DigestCrc32 (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  )
+{
+  return CalculateCrc32 ((VOID *)Buffer, Length);
+}
+
+STATIC
+UINT64
+EFIAPI
+DigestCrc32cHardware (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  )
+{
+  return FlashRescueCrc32cHardware (Buffer, Length);
+}
+
+STATIC
+UINT64
+EFIAPI
+DigestCrc32cSoftware (
+  IN CONST VOID  *Buffer,
+  IN UINTN       Length
+  )
+{
+  return FlashRescueCrc32cSoftware (Buffer, Length);
+}
+
+/**
+ * Return the size of a digest type.
+ *
+ * @param[in] DigestType  FLASH_RESCUE_DIGEST_* type.
+ *
+ * @return Size of the digest in bytes, or 0 if the type is unsupported.
+**/
+UINTN
+EFIAPI
+FlashRescueDigestSize (
+  IN UINT8  DigestType
+  )
+{
+  switch (DigestType) {
+    case FLASH_RESCUE_DIGEST_CRC32:
+    case FLASH_RESCUE_DIGEST_CRC32C:
+      return sizeof (UINT32);
+    case FLASH_RESCUE_DIGEST_CRC64:
+      return sizeof (UINT64);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Resolve the fastest implementation of a digest type on this CPU.
+ * Resolve once, as feature detection is costly under some hypervisors.
+ *
+ * @param[in] DigestType  FLASH_RESCUE_DIGEST_* type.
+ *
+ * @return Digest function, or NULL if the type is unsupported.
+**/
+FLASH_RESCUE_DIGEST_FUNCTION
+EFIAPI
+FlashRescueGetDigestFunction (
+  IN UINT8  DigestType
+  )
+{
+  switch (DigestType) {
+    case FLASH_RESCUE_DIGEST_CRC32:
+      return DigestCrc32;
+    case FLASH_RESCUE_DIGEST_CRC32C:
+      if (FlashRescueIsCrc32cHardwareSupported ()) {
+        return DigestCrc32cHardware;
+      }
+
+      return DigestCrc32cSoftware;
+    case FLASH_RESCUE_DIGEST_CRC64:
+      return FlashRescueCrc64;
+    default:
+      return NULL;
+  }
+}
+
+//
+// Blocks each processor claims at a time. Large enough that claiming is cheap,
+// small enough that processors finish together.
+//
+#define DIGEST_CHUNK_BLOCKS  16
+
+//
+// Work shared by the processors digesting a buffer
+//
+typedef struct {
+  FLASH_RESCUE_DIGEST_FUNCTION  DigestFunction;
+  CONST UINT8                   *Blocks;
+  UINTN                         BlockSize;
+  UINT64                        *Digests;
+  UINT32                        ChunkCount;
+  UINT32                        BlockCount;
+  volatile UINT32               NextChunk;
+} DIGEST_BLOCKS_JOB;
+
+/**
+ * Digest chunks of blocks until none remain unclaimed.
+ * - Runs on every processor, so only the job is shared
+ *
+ * @param[in] Buffer  DIGEST_BLOCKS_JOB.
+**/
+STATIC
+VOID
+EFIAPI
+DigestChunks (
+  IN OUT VOID  *Buffer
+  )
+{
+  DIGEST_BLOCKS_JOB  *Job;
+  UINT32             Chunk;
+  UINT32             Block;
+  UINT32             EndBlock;
+
+  Job = Buffer;
+  while (TRUE) {
+    Chunk = InterlockedIncrement (&Job->NextChunk) - 1;
+    if (Chunk >= Job->ChunkCount) {
+      return;
+    }
+
+    Block    = Chunk * DIGEST_CHUNK_BLOCKS;
+    EndBlock = MIN (Block + DIGEST_CHUNK_BLOCKS, Job->BlockCount);
+    for ( ; Block < EndBlock; Block++) {
+      Job->Digests[Block] = Job->DigestFunction (Job->Blocks + Block * Job->BlockSize, Job->BlockSize);
+    }
+  }
+}
+
+/**
+ * Digest each block of a buffer, sharing the blocks between every processor.
+ * - Without MP services, or should the APs fail to start, the BSP digests them alone
+ * - The APs are started without blocking, so the BSP digests too. It returns once
+ *   the APs have finished, and each block is digested
+ *
+ * @param[in]  Processors      Processors to share with, or NULL to digest on this one.
+ * @param[in]  DigestFunction  Digest function, as from FlashRescueGetDigestFunction().
+ * @param[in]  Blocks          Buffer of `BlockCount` blocks.
+ * @param[in]  BlockCount      Number of blocks.
+ * @param[in]  BlockSize       Size of each block in bytes.
+ * @param[out] Digests         Digest of each block.
+**/
+VOID
+EFIAPI
+FlashRescueDigestBlocks (
+  IN  FLASH_RESCUE_DIGEST_PROCESSORS  *Processors OPTIONAL,
+  IN  FLASH_RESCUE_DIGEST_FUNCTION    DigestFunction,
+  IN  CONST UINT8                     *Blocks,
+  IN  UINTN                           BlockCount,
+  IN  UINTN                           BlockSize,
+  OUT UINT64                          *Digests
+  )
+{
+  DIGEST_BLOCKS_JOB  Job;
+  EFI_STATUS         Status;
+
+  ASSERT (BlockCount <= MAX_UINT32 - DIGEST_CHUNK_BLOCKS);
+
+  Job.DigestFunction = DigestFunction;
+  Job.Blocks         = Blocks;
+  Job.BlockSize      = BlockSize;
+  Job.Digests        = Digests;
+  Job.BlockCount     = (UINT32)BlockCount;
+  Job.ChunkCount     = (UINT32)((BlockCount + DIGEST_CHUNK_BLOCKS - 1) / DIGEST_CHUNK_BLOCKS);
+  Job.NextChunk      = 0;
+
+  // Too little to be worth waking the APs
+  Status = EFI_NOT_STARTED;
+  if ((Processors != NULL) && (Job.ChunkCount > 1)) {
+    Status = Processors->MpServices->StartupAllAPs (
+                                       Processors->MpServices,
+                                       DigestChunks,
+                                       FALSE,
+                                       Processors->WaitEvent,
+                                       0,
+                                       &Job,
+                                       NULL
+                                       );
+  }
+
+  // The BSP's share, or every chunk when there are no APs
+  DigestChunks (&Job);
+
+  // The job is on this stack, so the APs must be done with it
+  if (!EFI_ERROR (Status)) {
+    Processors->WaitForEvent (Processors->WaitEvent);
+  }
+}
@@ -0,0 +1,128 @@
+/** @file
+  Board log for the early SPI flash rescue protocol.
+
+  While a session holds the serial port, DEBUG() output is queued here rather
+  than interleaved with responses, and the board sends it to userspace in log
+  frames. Nothing is written until capturing starts, so XIP code may still log.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/FlashRescueLogLib.h>
+#include <Library/PrintLib.h>
+
+// Must be a power of two. Messages beyond this backlog are dropped
+#define LOG_RING_SIZE         1024
+#define LOG_DROPPED_NOTE_MAX  48
+
+STATIC CHAR8    mLogRing[LOG_RING_SIZE];
+STATIC UINTN    mLogHead      = 0; // Bytes ever queued
+STATIC UINTN    mLogTail      = 0; // Bytes ever dequeued
+STATIC UINTN    mLogDropped   = 0;
+STATIC BOOLEAN  mLogCapturing = FALSE;
+
+/**
+ * Start or stop capturing messages, rather than writing them to the serial port.
+ * - Messages captured earlier remain queued until read
+ *
+ * @param[in] Capture  TRUE while a session holds the serial port.
+**/
+VOID
+EFIAPI
+FlashRescueLogCapture (
+  IN BOOLEAN  Capture
+  )
+{
+  mLogCapturing = Capture;
+}
+
+/**
+ * Determine whether messages are being captured.
+ *
+ * @retval TRUE   Messages must be passed to FlashRescueLogWrite().
+ * @retval FALSE  Messages may be written to the serial port.
+**/
+BOOLEAN
+EFIAPI
+FlashRescueLogIsCapturing (
+  VOID
+  )
+{
+  return mLogCapturing;
+}
+
+/**
+ * Queue a message. A message that does not fit is dropped whole, and counted.
+ *
+ * @param[in] Message  Message to queue.
+ * @param[in] Length   Size of the message in bytes.
+ *
+ * @return Number of bytes queued, either Length or 0.
+**/
+UINTN
+EFIAPI
+FlashRescueLogWrite (
+  IN CONST CHAR8  *Message,
+  IN UINTN        Length
+  )
+{
+  UINTN  Index;
+
+  // Keep the earliest messages, which usually explain the later ones
+  if (Length > LOG_RING_SIZE - (mLogHead - mLogTail)) {
+    mLogDropped += Length;
+    return 0;
+  }
+
+  for (Index = 0; Index < Length; Index++) {
+    mLogRing[(mLogHead + Index) & (LOG_RING_SIZE - 1)] = Message[Index];
+  }
+
+  mLogHead += Length;
+  return Length;
+}
+
+/**
+ * Dequeue messages, oldest first. Once the queue is empty, a note of any
+ * dropped messages follows.
+ *
+ * @param[out] Buffer  Buffer to dequeue into.
+ * @param[in]  Size    Size of the buffer in bytes.
+ *
+ * @return Number of bytes dequeued.
+**/
+UINTN
+EFIAPI
+FlashRescueLogRead (
+  OUT CHAR8  *Buffer,
+  IN  UINTN  Size
+  )
+{
+  CHAR8  Note[LOG_DROPPED_NOTE_MAX];
+  UINTN  NoteLength;
+  UINTN  Count;
+  UINTN  Index;
+
+  Count = MIN (Size, mLogHead - mLogTail);
+  for (Index = 0; Index < Count; Index++) {
+    Buffer[Index] = mLogRing[(mLogTail + Index) & (LOG_RING_SIZE - 1)];
+  }
+
+  mLogTail += Count;
+  if ((mLogHead != mLogTail) || (mLogDropped == 0)) {
+    return Count;
+  }
+
+  NoteLength = AsciiSPrint (Note, sizeof (Note), "[%Lu bytes of log dropped]\n", (UINT64)mLogDropped);
+  if (NoteLength <= Size - Count) {
+    CopyMem (Buffer + Count, Note, NoteLength);
+    Count      += NoteLength;
+    mLogDropped = 0;
+  }
+
+  return Count;
+}
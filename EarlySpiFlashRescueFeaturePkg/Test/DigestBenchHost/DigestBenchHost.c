@@ -0,0 +1,249 @@
+/** @file
+  Host-based microbenchmark of the block digests against BaseLib's CRC32.
+
+  Checks each digest kernel against its CRC's standard check value, and the
+  SSE4.2 CRC32C kernel against the table on odd lengths and alignments. Then
+  hashes a region 4K block at a time, as SendBlockChecksum() does, and
+  reports the throughput of each digest kernel.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/FlashRescueDigestLib.h>
+
+#define SIZE_BLOCK       4096
+#define DEFAULT_REGION   (32 * 1024 * 1024)
+#define BENCH_PASSES     4
+
+// Kernels are compared on every odd length up to this, and every 8-byte alignment
+#define COMPARE_MAX_LENGTH  (SIZE_BLOCK + 1)
+#define COMPARE_ALIGNMENTS  8
+
+typedef UINT64 (*DIGEST_KERNEL)(
+  CONST VOID  *Buffer,
+  UINTN       Length
+  );
+
+STATIC
+UINT64
+BaseLibCrc32 (
+  CONST VOID  *Buffer,
+  UINTN       Length
+  )
+{
+  return CalculateCrc32 ((VOID *)Buffer, Length);
+}
+
+STATIC
+UINT64
+Crc32cHardware (
+  CONST VOID  *Buffer,
+  UINTN       Length
+  )
+{
+  return FlashRescueCrc32cHardware (Buffer, Length);
+}
+
+STATIC
+UINT64
+Crc32cSoftware (
+  CONST VOID  *Buffer,
+  UINTN       Length
+  )
+{
+  return FlashRescueCrc32cSoftware (Buffer, Length);
+}
+
+STATIC
+UINT64
+Crc64 (
+  CONST VOID  *Buffer,
+  UINTN       Length
+  )
+{
+  return FlashRescueCrc64 (Buffer, Length);
+}
+
+//
+// Check values are each CRC's digest of "123456789"
+//
+STATIC CONST struct {
+  CONST CHAR8    *Name;
+  DIGEST_KERNEL  Kernel;
+  UINT64         CheckValue;
+} mKernels[] = {
+  { "BaseLib CalculateCrc32 (table)", BaseLibCrc32,   0xCBF43926         },
+  { "CRC32C (SSE4.2)",                Crc32cHardware, 0xE3069283         },
+  { "CRC32C (table)",                 Crc32cSoftware, 0xE3069283         },
+  { "CRC64 (table)",                  Crc64,          0x995DC9BBDF1939FA }
+};
+
+STATIC
+UINT64
+NowNs (
+  VOID
+  )
+{
+  struct timespec  Time;
+
+  clock_gettime (CLOCK_MONOTONIC, &Time);
+  return (UINT64)Time.tv_sec * 1000000000ULL + (UINT64)Time.tv_nsec;
+}
+
+/**
+  Check each kernel's digest of "123456789", then compare the SSE4.2 CRC32C
+  kernel with the table on random data of odd lengths and alignments.
+
+  @param[in] Sse42  Whether the crc32 instruction is present.
+
+  @retval TRUE   Every digest is correct.
+  @retval FALSE  A digest is wrong, as reported.
+**/
+STATIC
+BOOLEAN
+CheckKernels (
+  IN BOOLEAN  Sse42
+  )
+{
+  STATIC CONST CHAR8  CheckData[] = "123456789";
+  UINT8               Buffer[COMPARE_MAX_LENGTH + COMPARE_ALIGNMENTS];
+  UINTN               Kernel;
+  UINTN               Index;
+  UINTN               Alignment;
+  UINTN               Length;
+  UINT64              Digest;
+  BOOLEAN             Passed;
+
+  Passed = TRUE;
+  for (Kernel = 0; Kernel < ARRAY_SIZE (mKernels); Kernel++) {
+    if ((mKernels[Kernel].Kernel == Crc32cHardware) && !Sse42) {
+      continue;
+    }
+
+    Digest = mKernels[Kernel].Kernel (CheckData, sizeof (CheckData) - 1);
+    if (Digest != mKernels[Kernel].CheckValue) {
+      printf ("%s: check value is 0x%llx, not 0x%llx!\n",
+        mKernels[Kernel].Name,
+        (unsigned long long)Digest,
+        (unsigned long long)mKernels[Kernel].CheckValue);
+      Passed = FALSE;
+    }
+  }
+
+  if (!Sse42) {
+    return Passed;
+  }
+
+  // The instruction consumes 8 bytes at a time, so the tails and misaligned heads differ
+  srand (1);
+  for (Index = 0; Index < sizeof (Buffer); Index++) {
+    Buffer[Index] = (UINT8)rand ();
+  }
+
+  for (Alignment = 0; Alignment < COMPARE_ALIGNMENTS; Alignment++) {
+    for (Length = 1; Length <= COMPARE_MAX_LENGTH; Length += 2) {
+      if (FlashRescueCrc32cHardware (Buffer + Alignment, Length) !=
+          FlashRescueCrc32cSoftware (Buffer + Alignment, Length))
+      {
+        printf ("CRC32C (SSE4.2) differs from the table at alignment %u, length %u!\n",
+          (unsigned)Alignment, (unsigned)Length);
+        return FALSE;
+      }
+    }
+  }
+
+  return Passed;
+}
+
+/**
+  Entry point of the benchmark.
+
+  @param[in] argc  Optional argument: region size in MiB.
+  @param[in] argv  Arguments.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  UINTN   RegionSize;
+  UINT8   *Region;
+  UINTN   Index;
+  UINTN   Kernel;
+  UINTN   Pass;
+  UINTN   Offset;
+  UINT64  Start;
+  UINT64  Best;
+  UINT64  Elapsed;
+  UINT64  Accumulator;
+  UINT32  Ecx;
+
+  Ecx = 0;
+
+  RegionSize = DEFAULT_REGION;
+  if (argc > 1) {
+    RegionSize = (UINTN)strtoul (argv[1], NULL, 0) * 1024 * 1024;
+  }
+
+  Region = malloc (RegionSize);
+  if ((Region == NULL) || (RegionSize < SIZE_BLOCK)) {
+    return 1;
+  }
+
+  // Incompressible, but reproducible contents
+  srand (0);
+  for (Index = 0; Index < RegionSize; Index++) {
+    Region[Index] = (UINT8)rand ();
+  }
+
+  AsmCpuid (0x1, NULL, NULL, &Ecx, NULL);
+  printf ("Hashing %u MiB in %u-byte blocks, best of %u passes\n",
+    (unsigned)(RegionSize / (1024 * 1024)), SIZE_BLOCK, BENCH_PASSES);
+  printf ("SSE4.2 crc32 instruction: %s\n", (Ecx & BIT20) ? "yes" : "no");
+
+  if (!CheckKernels ((Ecx & BIT20) != 0)) {
+    free (Region);
+    return 1;
+  }
+
+  printf ("Check values, and SSE4.2 against the table: passed\n\n");
+
+  Accumulator = 0;
+  for (Kernel = 0; Kernel < ARRAY_SIZE (mKernels); Kernel++) {
+    if ((mKernels[Kernel].Kernel == Crc32cHardware) && !(Ecx & BIT20)) {
+      continue;
+    }
+
+    Best = MAX_UINT64;
+    for (Pass = 0; Pass < BENCH_PASSES; Pass++) {
+      Start = NowNs ();
+      for (Offset = 0; Offset + SIZE_BLOCK <= RegionSize; Offset += SIZE_BLOCK) {
+        Accumulator += mKernels[Kernel].Kernel (Region + Offset, SIZE_BLOCK);
+      }
+
+      Elapsed = NowNs () - Start;
+      if (Elapsed < Best) {
+        Best = Elapsed;
+      }
+    }
+
+    printf ("%-32s %8.1f MiB/s %8.1f ns/block\n",
+      mKernels[Kernel].Name,
+      ((double)RegionSize / (1024 * 1024)) / ((double)Best / 1e9),
+      (double)Best / (RegionSize / SIZE_BLOCK));
+  }
+
+  // Keep the results live
+  printf ("\n(sum of digests: 0x%llx)\n", (unsigned long long)Accumulator);
+
+  free (Region);
+  return 0;
+}
@@ -0,0 +1,229 @@
+/** @file
+  Host-based measurement of the boot time added by the userspace probe.
+
+  Runs the common board code against a serial port without a userspace,
+  and reports how long ProbeForUserspace() delays the boot. The transport,
+  TimerLib and the other phase-specific functions are stubbed here.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <Uefi.h>
+#include <Library/PcdLib.h>
+#include <Library/SpiLib.h>
+#include <Library/TimerLib.h>
+#include "../../FlashRescueBoardPei/FlashRescueBoard.h"
+
+#define BENCH_PASSES  8
+
+// Seconds stalled before HELLO, prior to the probe
+#define LEGACY_HELLO_STALL_MS  3000
+
+STATIC UINTN  mHelloPackets;
+
+/**
+  Transport without a userspace: writes drain, nothing is ever received.
+**/
+UINTN
+EFIAPI
+RescueTransportWrite (
+  IN UINT8  *Buffer,
+  IN UINTN  NumberOfBytes
+  )
+{
+  if (NumberOfBytes == sizeof (EARLY_FLASH_RESCUE_COMMAND)) {
+    mHelloPackets++;
+  }
+
+  return NumberOfBytes;
+}
+
+UINTN
+EFIAPI
+RescueTransportRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  NumberOfBytes
+  )
+{
+  return 0;
+}
+
+BOOLEAN
+EFIAPI
+RescueTransportPoll (
+  VOID
+  )
+{
+  return FALSE;
+}
+
+BOOLEAN
+EFIAPI
+RescueTransportAwaitsFrames (
+  VOID
+  )
+{
+  return FALSE;
+}
+
+EFI_STATUS
+EFIAPI
+RescueTransportSetBaudRate (
+  IN UINT64  BaudRate
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+UINTN
+EFIAPI
+MicroSecondDelay (
+  IN UINTN  MicroSeconds
+  )
+{
+  struct timespec  Delay;
+
+  Delay.tv_sec = MicroSeconds / 1000000;
+  Delay.tv_nsec = (MicroSeconds % 1000000) * 1000;
+  nanosleep (&Delay, NULL);
+  return MicroSeconds;
+}
+
+UINT64
+EFIAPI
+GetPerformanceCounter (
+  VOID
+  )
+{
+  struct timespec  Time;
+
+  clock_gettime (CLOCK_MONOTONIC, &Time);
+  return (UINT64)Time.tv_sec * NS_IN_SECOND + (UINT64)Time.tv_nsec;
+}
+
+UINT64
+EFIAPI
+GetTimeInNanoSecond (
+  IN UINT64  Ticks
+  )
+{
+  return Ticks;
+}
+
+EFI_STATUS
+EFIAPI
+SpiServiceInit (
+  VOID
+  )
+{
+  return EFI_SUCCESS;
+}
+
+PCH_SPI2_PROTOCOL *
+GetSpiPpi (
+  VOID
+  )
+{
+  return NULL;
+}
+
+VOID
+EFIAPI
+PerformSystemReset (
+  VOID
+  )
+{
+}
+
+UINTN
+EFIAPI
+GetFreeMemorySize (
+  VOID
+  )
+{
+  return 0;
+}
+
+BOOLEAN
+EFIAPI
+InPermanentMemory (
+  VOID
+  )
+{
+  return FALSE;
+}
+
+FLASH_RESCUE_DIGEST_PROCESSORS *
+EFIAPI
+GetDigestProcessors (
+  VOID
+  )
+{
+  return NULL;
+}
+
+BOOLEAN
+EFIAPI
+HandlePhaseCommand (
+  IN EARLY_FLASH_RESCUE_COMMAND  *CommandPacket
+  )
+{
+  return FALSE;
+}
+
+/**
+  Entry point of the benchmark.
+
+  @param[in] argc  Unused.
+  @param[in] argv  Unused.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  UINTN       Pass;
+  UINT64      Start;
+  UINT64      Elapsed;
+  UINT64      Best;
+  UINT64      Worst;
+  EFI_STATUS  Status;
+
+  printf ("Probe timeout %u ms, wait timeout %u ms, best/worst of %u boots\n",
+    FixedPcdGet32 (PcdUserspaceHostProbeTimeout),
+    FixedPcdGet32 (PcdUserspaceHostWaitTimeout),
+    BENCH_PASSES);
+
+  Best = MAX_UINT64;
+  Worst = 0;
+  for (Pass = 0; Pass < BENCH_PASSES; Pass++) {
+    mHelloPackets = 0;
+    Start = GetPerformanceCounter ();
+    Status = ProbeForUserspace ();
+    Elapsed = GetPerformanceCounter () - Start;
+    if (Status != EFI_TIMEOUT) {
+      printf ("Probe unexpectedly returned %llx\n", (unsigned long long)Status);
+      return 1;
+    }
+
+    Best = MIN (Best, Elapsed);
+    Worst = MAX (Worst, Elapsed);
+  }
+
+  printf ("%-32s %8.2f ms best %8.2f ms worst, %u HELLOs\n",
+    "ProbeForUserspace (no host)",
+    (double)Best / NS_IN_MS,
+    (double)Worst / NS_IN_MS,
+    (unsigned)mHelloPackets);
+  printf ("%-32s %8u ms\n",
+    "Previous stall and HELLO loop",
+    LEGACY_HELLO_STALL_MS + FixedPcdGet32 (PcdUserspaceHostWaitTimeout));
+
+  return 0;
+}
@@ -0,0 +1,398 @@
+/** @file
+  Host-based benchmark of FlashRescueDigestBlocks() sharing a region between processors.
+
+  The DXE app digests the BIOS region with EFI_MP_SERVICES_PROTOCOL. Here, a stand-in
+  starts each AP as a thread, so the work splitting can be tested and measured without
+  a board. Each digest type is timed with more processors at a time, and checked against
+  the BSP's digests alone. The APs must be started without blocking the BSP, which
+  digests too, and then awaited.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/FlashRescueDigestLib.h>
+
+#define SIZE_BLOCK       4096
+#define DEFAULT_REGION   (32 * 1024 * 1024)
+#define BENCH_PASSES     4
+#define MAX_PROCESSORS   256
+
+//
+// An AP of the stand-in, which runs one procedure then exits
+//
+typedef struct {
+  pthread_t          Thread;
+  EFI_AP_PROCEDURE   Procedure;
+  VOID               *Argument;
+  UINTN              ProcessorNumber;
+} HOST_AP;
+
+//
+// Stand-in for the event that a non-blocking StartupAllAPs() signals, once its APs exit
+//
+typedef struct {
+  HOST_AP  Aps[MAX_PROCESSORS];
+  UINTN    Started;
+  BOOLEAN  Awaited;
+} HOST_WAIT_EVENT;
+
+// APs that StartupAllAPs() starts, which the benchmark varies
+STATIC UINTN  mApCount = 0;
+
+STATIC _Thread_local UINTN  mProcessorNumber = 0;
+
+STATIC HOST_WAIT_EVENT  mWaitEvent;
+
+STATIC CONST struct {
+  CONST CHAR8  *Name;
+  UINT8        DigestType;
+} mDigests[] = {
+  { "CRC32",  FLASH_RESCUE_DIGEST_CRC32  },
+  { "CRC32C", FLASH_RESCUE_DIGEST_CRC32C },
+  { "CRC64",  FLASH_RESCUE_DIGEST_CRC64  }
+};
+
+STATIC
+VOID *
+RunAp (
+  VOID  *Context
+  )
+{
+  HOST_AP  *Ap;
+
+  Ap = Context;
+  mProcessorNumber = Ap->ProcessorNumber;
+  Ap->Procedure (Ap->Argument);
+  return NULL;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostGetNumberOfProcessors (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  OUT UINTN                     *NumberOfProcessors,
+  OUT UINTN                     *NumberOfEnabledProcessors
+  )
+{
+  *NumberOfProcessors        = mApCount + 1;
+  *NumberOfEnabledProcessors = mApCount + 1;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostGetProcessorInfo (
+  IN  EFI_MP_SERVICES_PROTOCOL   *This,
+  IN  UINTN                      ProcessorNumber,
+  OUT EFI_PROCESSOR_INFORMATION  *ProcessorInfoBuffer
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+/**
+  Start each AP as a thread. Without a WaitEvent, await them all, as a blocking
+  StartupAllAPs() does. Otherwise, return at once, as HostWaitForEvent() awaits them.
+  Only concurrent execution is supported.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+HostStartupAllAPs (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  EFI_AP_PROCEDURE          Procedure,
+  IN  BOOLEAN                   SingleThread,
+  IN  EFI_EVENT                 WaitEvent               OPTIONAL,
+  IN  UINTN                     TimeoutInMicroSeconds,
+  IN  VOID                      *ProcedureArgument      OPTIONAL,
+  OUT UINTN                     **FailedCpuList         OPTIONAL
+  )
+{
+  HOST_WAIT_EVENT  Blocking;
+  HOST_WAIT_EVENT  *Event;
+  UINTN            Started;
+  UINTN            Index;
+
+  if (SingleThread) {
+    return EFI_UNSUPPORTED;
+  }
+
+  if (mApCount == 0) {
+    return EFI_NOT_STARTED;
+  }
+
+  Event = (WaitEvent != NULL) ? WaitEvent : &Blocking;
+  for (Started = 0; Started < mApCount; Started++) {
+    Event->Aps[Started].Procedure       = Procedure;
+    Event->Aps[Started].Argument        = ProcedureArgument;
+    Event->Aps[Started].ProcessorNumber = Started + 1;
+    if (pthread_create (&Event->Aps[Started].Thread, NULL, RunAp, &Event->Aps[Started]) != 0) {
+      break;
+    }
+  }
+
+  Event->Started = Started;
+  Event->Awaited = FALSE;
+  if ((WaitEvent != NULL) && (Started == mApCount)) {
+    return EFI_SUCCESS;
+  }
+
+  // Those that started are awaited here, as the caller will not wait for a failure
+  for (Index = 0; Index < Started; Index++) {
+    pthread_join (Event->Aps[Index].Thread, NULL);
+  }
+
+  return (Started == mApCount) ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+}
+
+/**
+  Await the APs of a non-blocking StartupAllAPs(), as the event is signalled once they exit.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+HostWaitForEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  HOST_WAIT_EVENT  *WaitEvent;
+  UINTN            Index;
+
+  WaitEvent = Event;
+
+  // No StartupAllAPs() would signal this event, so a board would wait forever
+  if (WaitEvent->Started == 0) {
+    return EFI_NOT_READY;
+  }
+
+  for (Index = 0; Index < WaitEvent->Started; Index++) {
+    pthread_join (WaitEvent->Aps[Index].Thread, NULL);
+  }
+
+  WaitEvent->Started = 0;
+  WaitEvent->Awaited = TRUE;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostStartupThisAP (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  EFI_AP_PROCEDURE          Procedure,
+  IN  UINTN                     ProcessorNumber,
+  IN  EFI_EVENT                 WaitEvent               OPTIONAL,
+  IN  UINTN                     TimeoutInMicroseconds,
+  IN  VOID                      *ProcedureArgument      OPTIONAL,
+  OUT BOOLEAN                   *Finished               OPTIONAL
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostSwitchBSP (
+  IN EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  UINTN                    ProcessorNumber,
+  IN  BOOLEAN                  EnableOldBSP
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostEnableDisableAP (
+  IN  EFI_MP_SERVICES_PROTOCOL  *This,
+  IN  UINTN                     ProcessorNumber,
+  IN  BOOLEAN                   EnableAP,
+  IN  UINT32                    *HealthFlag OPTIONAL
+  )
+{
+  return EFI_UNSUPPORTED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostWhoAmI (
+  IN EFI_MP_SERVICES_PROTOCOL  *This,
+  OUT UINTN                    *ProcessorNumber
+  )
+{
+  *ProcessorNumber = mProcessorNumber;
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_MP_SERVICES_PROTOCOL  mHostMpServices = {
+  HostGetNumberOfProcessors,
+  HostGetProcessorInfo,
+  HostStartupAllAPs,
+  HostStartupThisAP,
+  HostSwitchBSP,
+  HostEnableDisableAP,
+  HostWhoAmI
+};
+
+STATIC FLASH_RESCUE_DIGEST_PROCESSORS  mHostProcessors = {
+  &mHostMpServices,
+  &mWaitEvent,
+  HostWaitForEvent
+};
+
+STATIC
+UINT64
+NowNs (
+  VOID
+  )
+{
+  struct timespec  Time;
+
+  clock_gettime (CLOCK_MONOTONIC, &Time);
+  return (UINT64)Time.tv_sec * 1000000000ULL + (UINT64)Time.tv_nsec;
+}
+
+/**
+  Entry point of the benchmark.
+
+  @param[in] argc  Optional arguments: region size in MiB, then the most processors.
+  @param[in] argv  Arguments.
+**/
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  UINTN                         RegionSize;
+  UINTN                         BlockCount;
+  UINTN                         Processors;
+  UINTN                         MaxProcessors;
+  UINT8                         *Region;
+  UINT64                        *Expected;
+  UINT64                        *Digests;
+  UINTN                         Index;
+  UINTN                         Digest;
+  UINTN                         Pass;
+  UINT64                        Start;
+  UINT64                        Best;
+  UINT64                        Serial;
+  UINT64                        Elapsed;
+  FLASH_RESCUE_DIGEST_FUNCTION  DigestFunction;
+  int                           Status;
+
+  RegionSize = DEFAULT_REGION;
+  if (argc > 1) {
+    RegionSize = (UINTN)strtoul (argv[1], NULL, 0) * 1024 * 1024;
+  }
+
+  MaxProcessors = (UINTN)sysconf (_SC_NPROCESSORS_ONLN);
+  if (argc > 2) {
+    MaxProcessors = (UINTN)strtoul (argv[2], NULL, 0);
+  }
+
+  MaxProcessors = MAX (MIN (MaxProcessors, MAX_PROCESSORS), 1);
+
+  BlockCount = RegionSize / SIZE_BLOCK;
+  Region     = malloc (RegionSize);
+  Expected   = malloc (BlockCount * sizeof (UINT64));
+  Digests    = malloc (BlockCount * sizeof (UINT64));
+  if ((Region == NULL) || (Expected == NULL) || (Digests == NULL) || (BlockCount == 0)) {
+    return 1;
+  }
+
+  // Incompressible, but reproducible contents
+  srand (0);
+  for (Index = 0; Index < RegionSize; Index++) {
+    Region[Index] = (UINT8)rand ();
+  }
+
+  printf ("Hashing %u MiB in %u-byte blocks on up to %u processors, best of %u passes\n\n",
+    (unsigned)(RegionSize / (1024 * 1024)), SIZE_BLOCK, (unsigned)MaxProcessors, BENCH_PASSES);
+
+  Status = 0;
+  for (Digest = 0; Digest < ARRAY_SIZE (mDigests); Digest++) {
+    DigestFunction = FlashRescueGetDigestFunction (mDigests[Digest].DigestType);
+    for (Index = 0; Index < BlockCount; Index++) {
+      Expected[Index] = DigestFunction (Region + Index * SIZE_BLOCK, SIZE_BLOCK);
+    }
+
+    // The BSP alone, then twice the processors each time, then all of them
+    Serial     = 0;
+    Processors = 1;
+    while (TRUE) {
+      mApCount = Processors - 1;
+      Best     = MAX_UINT64;
+      for (Pass = 0; Pass < BENCH_PASSES; Pass++) {
+        memset (Digests, 0, BlockCount * sizeof (UINT64));
+        mWaitEvent.Awaited = FALSE;
+        Start = NowNs ();
+        FlashRescueDigestBlocks (
+          (Processors > 1) ? &mHostProcessors : NULL,
+          DigestFunction,
+          Region,
+          BlockCount,
+          SIZE_BLOCK,
+          Digests
+          );
+        Elapsed = NowNs () - Start;
+        if (Elapsed < Best) {
+          Best = Elapsed;
+        }
+
+        if (memcmp (Digests, Expected, BlockCount * sizeof (UINT64)) != 0) {
+          printf ("%-6s on %3u processors: digests differ from the BSP's!\n",
+            mDigests[Digest].Name, (unsigned)Processors);
+          Status = 1;
+          break;
+        }
+
+        // The BSP shares the work, so it must not be blocked, yet must await the APs
+        if ((Processors > 1) && !mWaitEvent.Awaited) {
+          printf ("%-6s on %3u processors: the APs blocked the BSP, or were not awaited!\n",
+            mDigests[Digest].Name, (unsigned)Processors);
+          Status = 1;
+          break;
+        }
+      }
+
+      if (Processors == 1) {
+        Serial = Best;
+      }
+
+      printf ("%-6s on %3u processors %8.1f MiB/s %6.2fx\n",
+        mDigests[Digest].Name,
+        (unsigned)Processors,
+        ((double)RegionSize / (1024 * 1024)) / ((double)Best / 1e9),
+        (double)Serial / (double)Best);
+
+      if (Processors == MaxProcessors) {
+        break;
+      }
+
+      Processors = MIN (Processors * 2, MaxProcessors);
+    }
+
+    printf ("\n");
+  }
+
+  free (Digests);
+  free (Expected);
+  free (Region);
+  return Status;
+}
@@ -9,11 +9,18 @@
 #define FLASH_RESCUE_BOARD_H
 
 #include <Base.h>
+#include <Pi/PiMultiPhase.h>
+#include <Library/FlashRescueDigestLib.h>
 #include <Protocol/Spi2.h>
 
 #define SIZE_BLOCK	4096
 #define MS_IN_SECOND	1000
 #define NS_IN_SECOND	(1000 * 1000 * 1000)
+#define NS_IN_MS	(1000 * 1000)
+
+// Resend HELLO at least this often, and at least this many times per wait
+#define HELLO_RESEND_INTERVAL_MS	250
+#define HELLO_BURST_LENGTH		4
 
 #define EARLY_FLASH_RESCUE_PROTOCOL_VERSION	0.50
 #define EARLY_FLASH_RESCUE_COMMAND_HELLO	0x10
@@ -22,6 +29,58 @@
 #define EARLY_FLASH_RESCUE_COMMAND_WRITE	0x13
 #define EARLY_FLASH_RESCUE_COMMAND_RESET	0x14
 #define EARLY_FLASH_RESCUE_COMMAND_EXIT		0x15
+#define EARLY_FLASH_RESCUE_COMMAND_DIGEST	0x16
+#define EARLY_FLASH_RESCUE_COMMAND_STAGE	0x17
+#define EARLY_FLASH_RESCUE_COMMAND_ERASE	0x18
+#define EARLY_FLASH_RESCUE_COMMAND_FILL		0x19
+#define EARLY_FLASH_RESCUE_COMMAND_COPY		0x1A
+#define EARLY_FLASH_RESCUE_COMMAND_KEEPALIVE	0x1B
+#define EARLY_FLASH_RESCUE_COMMAND_DIGEST_TABLE	0x1C
+#define EARLY_FLASH_RESCUE_COMMAND_MANIFEST_READ	0x1D
+#define EARLY_FLASH_RESCUE_COMMAND_MANIFEST_STORE	0x1E
+#define EARLY_FLASH_RESCUE_COMMAND_LOG	0x1F
+#define EARLY_FLASH_RESCUE_COMMAND_ECHO	0x20
+#define EARLY_FLASH_RESCUE_COMMAND_SET_XFER	0x21
+#define EARLY_FLASH_RESCUE_COMMAND_SET_BAUD	0x22
+#define EARLY_FLASH_RESCUE_COMMAND_INFO	0x23
+
+// In place of `Acknowledge`: `Size` bytes of board log follow, then the awaited response
+#define EARLY_FLASH_RESCUE_LOG_FRAME	0x4C
+// In `Size` of a NACK: board cannot serve this command at all, rather than this request
+#define EARLY_FLASH_RESCUE_NACK_UNSUPPORTED	0xFFFF
+// Log bytes sent ahead of each response, so logging cannot starve the data path
+#define LOG_FRAME_MAX_SIZE	128
+
+// Abandon a staging stream after this many seconds without data
+#define STAGE_STREAM_TIMEOUT_S	10
+#define COMMAND_IDLE_TIMEOUT_S	10
+
+// Link calibration. An ECHO packet that stops arriving ends the echo, once the line is quiet
+// A WRITE that loses a packet also waits for the quiet line before it NACKs
+#define ECHO_PACKET_TIMEOUT_MS	250
+#define ECHO_QUIET_MS		50
+// SET_BAUD takes the rate in these units. The board reverts unless it is confirmed in time
+#define BAUD_RATE_UNIT		100
+#define BAUD_SWITCH_DELAY_MS	10
+#define BAUD_CONFIRM_TIMEOUT_MS	3000
+
+// Digests per DIGEST_TABLE response
+#define DIGEST_TABLE_BLOCKS	256
+
+// Buffer arena of each session: a scratch block for reads of SPI flash, then a window for data
+// from userspace. It takes a share of free NEM or DRAM, within these bounds
+// - STAGE accepts as many blocks as the window holds. Their numbers are held in the scratch block
+#define ARENA_MIN_BLOCKS	2
+#define ARENA_MAX_BLOCKS	1025
+#define ARENA_MEMORY_SHARE	4
+
+#define FLASH_RESCUE_BOARD_INFO_VERSION	1
+
+// Manifest of the last verified session, at PcdFlashRescueManifestBlock
+#define FLASH_RESCUE_MANIFEST_SIGNATURE	SIGNATURE_32 ('F', 'R', 'M', 'F')
+#define FLASH_RESCUE_MANIFEST_VERSION	1
+// Blocks read back to validate a manifest, before its digests are trusted
+#define MANIFEST_SPOT_CHECKS		16
 
 #pragma pack(push, 1)
 typedef struct {
@@ -33,6 +92,30 @@ typedef struct {
 	UINT8   Acknowledge;  // Usually, ACK == 0x01
 	UINT16  Size;         // OPTIONAL?
 } EARLY_FLASH_RESCUE_RESPONSE;
+
+// Followed by `BlockCount` UINT64 digests, spanning the manifest blocks
+typedef struct {
+	UINT32  Signature;
+	UINT8   Version;
+	UINT8   DigestType;          // Of the digests in the table
+	UINT16  ManifestBlock;
+	UINT16  ManifestBlockCount;
+	UINT16  Reserved;
+	UINT32  BlockCount;          // Blocks in BIOS region
+	UINT32  ImageCrc;            // Supplied by userspace, identifying its image
+	UINT32  TableCrc;            // CRC32 of the digest table
+	UINT8   Reserved2[8];
+} FLASH_RESCUE_MANIFEST;
+
+// Sent in response to INFO, describing the board's session
+typedef struct {
+	UINT8   Version;
+	UINT8   Reserved;
+	UINT16  XferBlockSize;  // Of WRITE packets, as SET_XFER last selected
+	UINT32  ArenaSize;      // Bytes of buffers, from NEM or DRAM
+	UINT16  StageBlocks;    // Most blocks per STAGE
+	UINT16  Reserved2;
+} FLASH_RESCUE_BOARD_INFO;
 #pragma pack(pop)
 
 /**
@@ -56,24 +139,167 @@ PerformSystemReset (
   VOID
   );
 
+/**
+ * Bytes of memory this phase may allocate, which bound the session's buffer arena.
+ *
+ * @return Free bytes of NEM or DRAM.
+**/
+UINTN
+EFIAPI
+GetFreeMemorySize (
+  VOID
+  );
+
+/**
+ * Whether permanent memory is installed, so the session may take its fast path.
+ *
+ * @return TRUE   Running with DRAM.
+ * @return FALSE  Running in CAR.
+**/
+BOOLEAN
+EFIAPI
+InPermanentMemory (
+  VOID
+  );
+
+/**
+ * Processors on which the session digests blocks, with MP services.
+ *
+ * @return Processors, or NULL to digest on the BSP alone.
+**/
+FLASH_RESCUE_DIGEST_PROCESSORS *
+EFIAPI
+GetDigestProcessors (
+  VOID
+  );
+
+/**
+ * Read from userspace, until `NumberOfBytes` arrive or the transport gives up.
+ *
+ * @param[out] Buffer         Buffer to read into.
+ * @param[in]  NumberOfBytes  Bytes to read.
+ *
+ * @return Number of bytes read.
+**/
+UINTN
+EFIAPI
+RescueTransportRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  NumberOfBytes
+  );
+
+/**
+ * Write to userspace.
+ *
+ * @param[in] Buffer         Buffer to write.
+ * @param[in] NumberOfBytes  Bytes to write.
+ *
+ * @return Number of bytes written.
+**/
+UINTN
+EFIAPI
+RescueTransportWrite (
+  IN UINT8  *Buffer,
+  IN UINTN  NumberOfBytes
+  );
+
+/**
+ * Poll for data from userspace.
+ *
+ * @return TRUE   Data is waiting.
+ * @return FALSE  No data is waiting.
+**/
+BOOLEAN
+EFIAPI
+RescueTransportPoll (
+  VOID
+  );
+
+/**
+ * Whether reads wait for a whole frame, with a hardware timeout.
+ * Otherwise, stall before reading so that the frame has arrived.
+ *
+ * @return TRUE   Reads wait for whole frames.
+ * @return FALSE  Reads require a stall.
+**/
+BOOLEAN
+EFIAPI
+RescueTransportAwaitsFrames (
+  VOID
+  );
+
+/**
+ * Change the baud rate of the link to userspace.
+ *
+ * @param[in] BaudRate  New baud rate, or zero for the default.
+ *
+ * @return EFI_SUCCESS  Baud rate changed.
+ * @return Others       The transport cannot use this baud rate.
+**/
+EFI_STATUS
+EFIAPI
+RescueTransportSetBaudRate (
+  IN UINT64  BaudRate
+  );
+
+/**
+ * Handle a command that only this phase implements.
+ *
+ * @param[in] CommandPacket  Command received from userspace.
+ *
+ * @return TRUE   Command handled, and userspace has been responded to.
+ * @return FALSE  Command is unknown to this phase.
+**/
+BOOLEAN
+EFIAPI
+HandlePhaseCommand (
+  IN EARLY_FLASH_RESCUE_COMMAND  *CommandPacket
+  );
+
+/**
+ * Forget the cached digest of a block that is about to be programmed.
+ * - It is recomputed from SPI flash, so verification still reads back what was programmed
+**/
+VOID
+EFIAPI
+InvalidateBlockDigest (
+  IN UINTN  BlockNumber
+  );
+
 /**
  * Send HELLO command to an awaiting userspace.
  *
+ * @param[in] WaitTimeout  Milliseconds to await an acknowledgement.
+ *
  * @return EFI_SUCCESS  Command acknowledged.
  * @return EFI_TIMEOUT  Command timed-out.
 **/
 EFI_STATUS
 EFIAPI
 SendHelloPacket (
+  IN UINT32  WaitTimeout
+  );
+
+/**
+ * Probe for an awaiting userspace, on the boot path.
+ * Boards without a userspace attached continue within PcdUserspaceHostProbeTimeout.
+ *
+ * @return EFI_SUCCESS  Userspace acknowledged HELLO.
+ * @return EFI_TIMEOUT  No userspace is attached.
+**/
+EFI_STATUS
+EFIAPI
+ProbeForUserspace (
   VOID
   );
 
 /**
  * Perform flash.
  *
- * @return EFI_SUCCESS       Successful flash.
- * @return EFI_DEVICE_ERROR  Successful flash.
- * @return EFI_TIMEOUT       Await command timed-out.
+ * @return EFI_SUCCESS           Successful flash.
+ * @return EFI_DEVICE_ERROR      Successful flash.
+ * @return EFI_OUT_OF_RESOURCES  No memory for the buffer arena.
+ * @return EFI_TIMEOUT           Await command timed-out.
 **/
 EFI_STATUS
 EFIAPI
@@ -7,6 +7,7 @@
 
 #include <Uefi.h>
 #include <Library/DebugLib.h>
+#include <Library/PcdLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
 
@@ -17,6 +18,8 @@
 
 extern SPI_INSTANCE  *mSpiInstance;
 
+STATIC FLASH_RESCUE_DIGEST_PROCESSORS  mDigestProcessors;
+
 
 /**
   Returns a pointer to the PCH SPI PPI.
@@ -47,12 +50,126 @@ PerformSystemReset (
   DEBUG ((DEBUG_INFO, "Optionally verify the region with FPT\n"));
 }
 
+/**
+ * Bytes of memory this phase may allocate, which bound the session's buffer arena.
+ * - DRAM is plentiful, so ARENA_MAX_BLOCKS bounds the arena, or an allocation failing
+ *
+ * @return Free bytes of DRAM.
+**/
+UINTN
+EFIAPI
+GetFreeMemorySize (
+  VOID
+  )
+{
+  return MAX_UINTN;
+}
+
+/**
+ * Whether permanent memory is installed, so the session may take its fast path.
+ *
+ * @return TRUE  DXE always runs with DRAM.
+**/
+BOOLEAN
+EFIAPI
+InPermanentMemory (
+  VOID
+  )
+{
+  return TRUE;
+}
+
+/**
+ * Wait for the APs digesting blocks to finish.
+ *
+ * @param[in] Event  Event that StartupAllAPs() signals.
+ *
+ * @return EFI_SUCCESS  Event was signalled.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+WaitForDigestProcessors (
+  IN EFI_EVENT  Event
+  )
+{
+  UINTN  Index;
+
+  return gBS->WaitForEvent (1, &Event, &Index);
+}
+
+/**
+ * Processors on which the session digests blocks, with MP services.
+ * - The event is created once, and closed as the application exits
+ *
+ * @return Processors, or NULL if the platform has no MP services.
+**/
+FLASH_RESCUE_DIGEST_PROCESSORS *
+EFIAPI
+GetDigestProcessors (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+
+  if (mDigestProcessors.WaitEvent != NULL) {
+    return &mDigestProcessors;
+  }
+
+  Status = gBS->LocateProtocol (
+                  &gEfiMpServiceProtocolGuid,
+                  NULL,
+                  (VOID **)&mDigestProcessors.MpServices
+                  );
+  if (EFI_ERROR (Status)) {
+    return NULL;
+  }
+
+  // Without an event, StartupAllAPs() would block the BSP
+  Status = gBS->CreateEvent (0, TPL_CALLBACK, NULL, NULL, &mDigestProcessors.WaitEvent);
+  if (EFI_ERROR (Status)) {
+    mDigestProcessors.WaitEvent = NULL;
+    return NULL;
+  }
+
+  mDigestProcessors.WaitForEvent = WaitForDigestProcessors;
+  return &mDigestProcessors;
+}
+
+/**
+ * Handle a command that only this phase implements.
+ *
+ * @param[in] CommandPacket  Command received from userspace.
+ *
+ * @return FALSE  Command is unknown to this phase.
+**/
+BOOLEAN
+EFIAPI
+HandlePhaseCommand (
+  IN EARLY_FLASH_RESCUE_COMMAND  *CommandPacket
+  )
+{
+  return FALSE;
+}
+
 VOID
 EFIAPI
 SpiServiceDeInit (
   VOID
   );
 
+EFI_STATUS
+EFIAPI
+RescueTransportInit (
+  IN EFI_HANDLE  ImageHandle
+  );
+
+VOID
+EFIAPI
+RescueTransportDeInit (
+  VOID
+  );
+
 /**
   Entry Point function
 
@@ -70,9 +187,15 @@ FlashRescueBoardAppEntryPoint (
 
   Print (L"FlashRescueBoardAppEntryPoint() Start\n");
 
+  // Prefer the serial I/O protocol, its reads wait for whole frames
+  Status = RescueTransportInit (ImageHandle);
+  if (EFI_ERROR (Status)) {
+    Print (L"No serial I/O protocol. Using SerialPortLib\n");
+  }
+
   // Step 1
   Print (L"Sending HELLO to userspace...\n");
-  Status = SendHelloPacket ();
+  Status = SendHelloPacket (FixedPcdGet32 (PcdUserspaceHostWaitTimeout));
   if (EFI_ERROR (Status)) {
     Print (L"Userspace failed to acknowledge HELLO!\n");
     goto End;
@@ -92,6 +215,10 @@ FlashRescueBoardAppEntryPoint (
 
 End:
   SpiServiceDeInit ();
+  RescueTransportDeInit ();
+  if (mDigestProcessors.WaitEvent != NULL) {
+    gBS->CloseEvent (mDigestProcessors.WaitEvent);
+  }
 
   Print (L"FlashRescueBoardAppEntryPoint() End\n");
 
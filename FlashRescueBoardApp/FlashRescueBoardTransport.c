@@ -0,0 +1,329 @@
+/** @file
+  Early SPI flash rescue protocol - DXE transport.
+
+  Prefers EFI_SERIAL_IO_PROTOCOL, whose hardware timeout lets a read wait
+  for a whole frame, over SerialPortLib's fixed stalls and polling.
+  Only SerialPortLib's own UART is used, as published by SerialDxe.
+  Falls back to SerialPortLib when that instance cannot be opened.
+
+  Copyright (c) 2022, Baruch Binyamin Doron.<BR>
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+**/
+
+#include <Uefi.h>
+#include <Guid/SerialPortLibVendor.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/SerialPortLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/SerialIo.h>
+#include "FlashRescueBoard.h"
+
+// Per-character timeout. A read gives up after a frame stops arriving
+#define SERIAL_IO_TIMEOUT_US  (50 * MS_IN_SECOND)
+
+STATIC EFI_SERIAL_IO_PROTOCOL  *mSerialIo = NULL;
+STATIC EFI_HANDLE              mSerialIoHandle = NULL;
+STATIC EFI_HANDLE              mAgentHandle = NULL;
+STATIC EFI_SERIAL_IO_MODE      mSavedMode;
+
+/**
+ * Restore the serial I/O instance's attributes, then return it and reconnect its console.
+**/
+VOID
+EFIAPI
+RescueTransportDeInit (
+  VOID
+  )
+{
+  if (mSerialIoHandle == NULL) {
+    return;
+  }
+
+  // The console expects its own baud rate and timeout back
+  if (mSerialIo != NULL) {
+    mSerialIo->SetAttributes (
+                 mSerialIo,
+                 mSavedMode.BaudRate,
+                 mSavedMode.ReceiveFifoDepth,
+                 mSavedMode.Timeout,
+                 (EFI_PARITY_TYPE)mSavedMode.Parity,
+                 (UINT8)mSavedMode.DataBits,
+                 (EFI_STOP_BITS_TYPE)mSavedMode.StopBits
+                 );
+  }
+
+  gBS->CloseProtocol (mSerialIoHandle, &gEfiSerialIoProtocolGuid, mAgentHandle, NULL);
+  gBS->ConnectController (mSerialIoHandle, NULL, NULL, TRUE);
+
+  mSerialIo = NULL;
+  mSerialIoHandle = NULL;
+}
+
+/**
+ * Whether a serial I/O instance drives the UART that SerialPortLib uses.
+ * - SerialDxe publishes SerialPortLib under a vendor node of this GUID
+ *
+ * @param[in] Handle  Handle of the serial I/O instance.
+ *
+ * @return TRUE   The instance is SerialPortLib's UART.
+ * @return FALSE  The instance is another serial port.
+**/
+STATIC
+BOOLEAN
+IsSerialPortLibUart (
+  IN EFI_HANDLE  Handle
+  )
+{
+  EFI_STATUS                Status;
+  EFI_DEVICE_PATH_PROTOCOL  *DevicePath;
+
+  Status = gBS->HandleProtocol (Handle, &gEfiDevicePathProtocolGuid, (VOID **)&DevicePath);
+  if (EFI_ERROR (Status)) {
+    return FALSE;
+  }
+
+  for ( ; !IsDevicePathEnd (DevicePath); DevicePath = NextDevicePathNode (DevicePath)) {
+    if ((DevicePathType (DevicePath) == HARDWARE_DEVICE_PATH) &&
+        (DevicePathSubType (DevicePath) == HW_VENDOR_DP) &&
+        CompareGuid (&((VENDOR_DEVICE_PATH *)DevicePath)->Guid, &gEdkiiSerialPortLibVendorGuid))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+ * Open the serial I/O instance of SerialPortLib's UART for userspace, if there is one.
+ * - Another port may not be wired to the host at all
+ * - Exclusive access disconnects the console, which would consume our commands
+ *
+ * @param[in] ImageHandle  Handle of this application.
+ *
+ * @return EFI_SUCCESS    Serial I/O protocol is in use.
+ * @return EFI_NOT_FOUND  Falling back to SerialPortLib.
+**/
+EFI_STATUS
+EFIAPI
+RescueTransportInit (
+  IN EFI_HANDLE  ImageHandle
+  )
+{
+  EFI_STATUS              Status;
+  EFI_HANDLE              *Handles;
+  UINTN                   HandleCount;
+  UINTN                   Index;
+  EFI_SERIAL_IO_PROTOCOL  *SerialIo;
+
+  Status = gBS->LocateHandleBuffer (
+                  ByProtocol,
+                  &gEfiSerialIoProtocolGuid,
+                  NULL,
+                  &HandleCount,
+                  &Handles
+                  );
+  if (EFI_ERROR (Status)) {
+    return EFI_NOT_FOUND;
+  }
+
+  for (Index = 0; Index < HandleCount; Index++) {
+    if (IsSerialPortLibUart (Handles[Index])) {
+      break;
+    }
+  }
+
+  if (Index == HandleCount) {
+    gBS->FreePool (Handles);
+    return EFI_NOT_FOUND;
+  }
+
+  Status = gBS->OpenProtocol (
+                  Handles[Index],
+                  &gEfiSerialIoProtocolGuid,
+                  (VOID **)&SerialIo,
+                  ImageHandle,
+                  NULL,
+                  EFI_OPEN_PROTOCOL_EXCLUSIVE
+                  );
+  if (EFI_ERROR (Status)) {
+    gBS->FreePool (Handles);
+    return EFI_NOT_FOUND;
+  }
+
+  mSerialIoHandle = Handles[Index];
+  mAgentHandle = ImageHandle;
+  gBS->FreePool (Handles);
+  CopyMem (&mSavedMode, SerialIo->Mode, sizeof (mSavedMode));
+
+  // Only the timeout changes. Keep the FIFO and the line settings userspace expects
+  Status = SerialIo->SetAttributes (
+                       SerialIo,
+                       SerialIo->Mode->BaudRate,
+                       SerialIo->Mode->ReceiveFifoDepth,
+                       SERIAL_IO_TIMEOUT_US,
+                       (EFI_PARITY_TYPE)SerialIo->Mode->Parity,
+                       (UINT8)SerialIo->Mode->DataBits,
+                       (EFI_STOP_BITS_TYPE)SerialIo->Mode->StopBits
+                       );
+  if (EFI_ERROR (Status)) {
+    RescueTransportDeInit ();
+    return EFI_NOT_FOUND;
+  }
+
+  mSerialIo = SerialIo;
+  return EFI_SUCCESS;
+}
+
+/**
+ * Read from userspace, until `NumberOfBytes` arrive or the transport gives up.
+ *
+ * @param[out] Buffer         Buffer to read into.
+ * @param[in]  NumberOfBytes  Bytes to read.
+ *
+ * @return Number of bytes read.
+**/
+UINTN
+EFIAPI
+RescueTransportRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  NumberOfBytes
+  )
+{
+  UINTN       Received;
+  UINTN       Size;
+  EFI_STATUS  Status;
+
+  if (mSerialIo == NULL) {
+    return SerialPortRead (Buffer, NumberOfBytes);
+  }
+
+  // One read per frame, unless the FIFO was drained mid-frame
+  for (Received = 0; Received < NumberOfBytes; Received += Size) {
+    Size = NumberOfBytes - Received;
+    Status = mSerialIo->Read (mSerialIo, &Size, Buffer + Received);
+    if ((EFI_ERROR (Status) && (Status != EFI_TIMEOUT)) || (Size == 0)) {
+      break;
+    }
+  }
+
+  return Received;
+}
+
+/**
+ * Write to userspace.
+ *
+ * @param[in] Buffer         Buffer to write.
+ * @param[in] NumberOfBytes  Bytes to write.
+ *
+ * @return Number of bytes written.
+**/
+UINTN
+EFIAPI
+RescueTransportWrite (
+  IN UINT8  *Buffer,
+  IN UINTN  NumberOfBytes
+  )
+{
+  UINTN  Size;
+
+  if (mSerialIo == NULL) {
+    return SerialPortWrite (Buffer, NumberOfBytes);
+  }
+
+  Size = NumberOfBytes;
+  mSerialIo->Write (mSerialIo, &Size, Buffer);
+  return Size;
+}
+
+/**
+ * Poll for data from userspace.
+ *
+ * @return TRUE   Data is waiting.
+ * @return FALSE  No data is waiting.
+**/
+BOOLEAN
+EFIAPI
+RescueTransportPoll (
+  VOID
+  )
+{
+  UINT32  Control;
+
+  if (mSerialIo == NULL) {
+    return SerialPortPoll ();
+  }
+
+  if (EFI_ERROR (mSerialIo->GetControl (mSerialIo, &Control))) {
+    return FALSE;
+  }
+
+  return (Control & EFI_SERIAL_INPUT_BUFFER_EMPTY) == 0;
+}
+
+/**
+ * Change the baud rate of the link to userspace.
+ *
+ * @param[in] BaudRate  New baud rate, or zero for the default.
+ *
+ * @return EFI_SUCCESS  Baud rate changed.
+ * @return Others       The serial port cannot use this baud rate.
+**/
+EFI_STATUS
+EFIAPI
+RescueTransportSetBaudRate (
+  IN UINT64  BaudRate
+  )
+{
+  UINT32              ReceiveFifoDepth;
+  UINT32              Timeout;
+  EFI_PARITY_TYPE     Parity;
+  UINT8               DataBits;
+  EFI_STOP_BITS_TYPE  StopBits;
+
+  if (mSerialIo != NULL) {
+    return mSerialIo->SetAttributes (
+                        mSerialIo,
+                        BaudRate,
+                        mSerialIo->Mode->ReceiveFifoDepth,
+                        SERIAL_IO_TIMEOUT_US,
+                        (EFI_PARITY_TYPE)mSerialIo->Mode->Parity,
+                        (UINT8)mSerialIo->Mode->DataBits,
+                        (EFI_STOP_BITS_TYPE)mSerialIo->Mode->StopBits
+                        );
+  }
+
+  // Zeroes keep the line settings userspace expects
+  ReceiveFifoDepth = 0;
+  Timeout  = 0;
+  Parity   = DefaultParity;
+  DataBits = 0;
+  StopBits = DefaultStopBits;
+
+  return (EFI_STATUS)SerialPortSetAttributes (
+                       &BaudRate,
+                       &ReceiveFifoDepth,
+                       &Timeout,
+                       &Parity,
+                       &DataBits,
+                       &StopBits
+                       );
+}
+
+/**
+ * Whether reads wait for a whole frame, with a hardware timeout.
+ *
+ * @return TRUE   Reads wait for whole frames.
+ * @return FALSE  Reads require a stall.
+**/
+BOOLEAN
+EFIAPI
+RescueTransportAwaitsFrames (
+  VOID
+  )
+{
+  return mSerialIo != NULL;
+}
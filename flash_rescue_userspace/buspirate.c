@@ -0,0 +1,170 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include "flash_rescue_userspace.h"
+#include "buspirate.h"
+#include "estimate.h"
+#include "session.h"
+#include "util.h"
+
+// F12 leaves the debug port's macro
+static uint8_t bp_debug_port_exit[] = {0x1B, 0x5B, 0x32, 0x34, 0x7E};
+
+
+bool bp_in_use(void)
+{
+	return implementation == FLASH_RESCUE_MODE_BUS_PIRATE
+	       || implementation == FLASH_RESCUE_MODE_BUS_PIRATE_BRIDGE;
+}
+
+// Read the Bus Pirate's answer until it ends with `prompt`. Returns false if it does not
+static bool bp_await(const char *prompt, int timeout_ms)
+{
+	char answer[64];
+	size_t length = 0;
+	size_t prompt_length = strlen(prompt);
+	uint64_t deadline_ns = estimate_clock() + timeout_ms * 1000000ULL;
+	uint64_t now_ns;
+
+	while ((now_ns = estimate_clock()) < deadline_ns) {
+		// Only the tail can match
+		if (length == sizeof(answer)) {
+			memmove(answer, answer + 1, sizeof(answer) - 1);
+			length--;
+		}
+		if (!serial_fifo_read_timeout(&answer[length], 1,
+					      (deadline_ns - now_ns + 999999) / 1000000))
+			return false;
+		length++;
+
+		if (length >= prompt_length
+		    && memcmp(answer + length - prompt_length, prompt, prompt_length) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Discard what the Bus Pirate says, until it is quiet
+static void bp_drain(void)
+{
+	char discarded;
+
+	while (serial_fifo_read_timeout(&discarded, 1, BP_QUIET_MS))
+		;
+}
+
+// Type a line at the console, then await the prompt that follows its answer
+static bool bp_send(char *keys, const char *prompt)
+{
+	serial_fifo_write(keys, strlen(keys));
+	return bp_await(prompt, BP_PROMPT_TIMEOUT_MS);
+}
+
+// Text-mode debug port, whose macro bridges to the board
+// - Menus are stepped through as each prompts, rather than after fixed delays
+static bool bp_open_debug_port(void)
+{
+	serial_fifo_write(bp_debug_port_exit, sizeof(bp_debug_port_exit));
+	if (!bp_send("\n", ">") || !bp_send("#\n", ">"))
+		return false;
+
+	// TODO: Debugging
+	if (implementation_high_speed)
+		bp_switch_baudrate_generator(true);
+
+	if (!bp_send("m\n", ">") || !bp_send("4\n", ">") || !bp_send("2\n", ">"))
+		return false;
+
+	// Macro echoes, then announces the bridge without a prompt
+	if (!bp_send("(5)\n", "\n"))
+		return false;
+	bp_drain();
+	return true;
+}
+
+// Binary UART mode's transparent bridge, which buffers whole packets
+// - Entered from the console, or from binary mode. It lasts until the Bus Pirate is reset
+static bool bp_open_uart_bridge(void)
+{
+	uint8_t resets[BP_BINARY_RESETS] = {0};
+	uint8_t uart_setup[] = {BP_BINARY_UART_SPEED, BP_BINARY_UART_CONF};
+	uint8_t command;
+
+	if (implementation_high_speed)
+		fprintf(session_err,
+			"High speed applies to the debug port, not the UART bridge\n");
+
+	serial_fifo_write(bp_debug_port_exit, sizeof(bp_debug_port_exit));
+	if (bp_send("\n", ">"))
+		bp_send("#\n", ">");
+
+	// Already in binary mode, each zero answers. Drain the extra answers
+	serial_fifo_write(resets, sizeof(resets));
+	if (!bp_await("BBIO1", BP_PROMPT_TIMEOUT_MS))
+		return false;
+	bp_drain();
+
+	command = BP_BINARY_UART;
+	serial_fifo_write(&command, sizeof(command));
+	if (!bp_await("ART1", BP_PROMPT_TIMEOUT_MS))
+		return false;
+	for (size_t i = 0; i < sizeof(uart_setup); i++) {
+		serial_fifo_write(&uart_setup[i], sizeof(uart_setup[i]));
+		if (!bp_await("\x01", BP_PROMPT_TIMEOUT_MS))
+			return false;
+	}
+
+	// Bridge does not answer
+	command = BP_BINARY_BRIDGE;
+	serial_fifo_write(&command, sizeof(command));
+	return true;
+}
+
+// Bring up the Bus Pirate's bridge to the board
+// - Returns false if the Bus Pirate did not answer, as when a bridge is still open
+bool bp_initialise(void)
+{
+	if (implementation == FLASH_RESCUE_MODE_BUS_PIRATE_BRIDGE)
+		return bp_open_uart_bridge();
+
+	// TODO: Appropriate size
+	xfer_block_size = 64;
+	return bp_open_debug_port();
+}
+
+// Bus Pirate toggle baudrate generator
+// - Menu entry 9 is 115200 baud. BRG value 3 is 1Mbaud
+void bp_switch_baudrate_generator(bool to_high_speed)
+{
+	speed_t sys_this_speed = (to_high_speed == 1) ? B1000000 : B115200;
+
+	bp_send("b\n", ">");
+	if (to_high_speed)
+		bp_send("10\n", ">");
+
+	// Bus Pirate switches once it has asked for a space
+	bp_send(to_high_speed ? "3\n" : "9\n", "continue");
+	serial_close();
+	serial_open(p_dev, sys_this_speed);
+
+	bp_send(" ", ">");
+}
+
+// Bus Pirate exit helper
+void bp_exit(void)
+{
+	// UART bridge lasts until the Bus Pirate is reset
+	if (implementation == FLASH_RESCUE_MODE_BUS_PIRATE_BRIDGE)
+		return;
+
+	serial_fifo_write(bp_debug_port_exit, sizeof(bp_debug_port_exit));
+	bp_send("\n", ">");
+
+	if (implementation_high_speed)
+		bp_switch_baudrate_generator(false);
+	serial_flush();
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef BUSPIRATE_H
+#define BUSPIRATE_H
+
+#include <stdbool.h>
+
+// Menus answer within this, or the Bus Pirate is not at its console
+#define BP_PROMPT_TIMEOUT_MS 1000
+
+// Bridges announce themselves without a prompt. Once this quiet, the bridge is open
+#define BP_QUIET_MS 20
+
+// Binary mode is entered by this many zero bytes, and answers "BBIO1"
+#define BP_BINARY_RESETS 20
+
+// Binary UART mode: 115200 baud, then 8N1 with push-pull 3.3V outputs
+#define BP_BINARY_UART	     0x03
+#define BP_BINARY_UART_SPEED 0x6A
+#define BP_BINARY_UART_CONF  0x90
+#define BP_BINARY_BRIDGE     0x0F
+
+bool bp_in_use(void);
+bool bp_initialise(void);
+void bp_switch_baudrate_generator(bool to_high_speed);
+void bp_exit(void);
+
+#endif
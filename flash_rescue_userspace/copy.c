@@ -0,0 +1,299 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash_rescue_userspace.h"
+#include "copy.h"
+#include "digest.h"
+
+#define NO_BLOCK UINT32_MAX
+
+// Board blocks by digest, preferring unmodified sources
+struct digest_index {
+	uint64_t *digests;
+	uint32_t *blocks;
+	uint32_t mask;
+};
+
+static bool digest_index_init(struct digest_index *index, uint32_t entries)
+{
+	uint32_t size = 1;
+
+	while (size < entries * 2)
+		size <<= 1;
+	index->digests = malloc(size * sizeof(*index->digests));
+	index->blocks = malloc(size * sizeof(*index->blocks));
+	index->mask = size - 1;
+	if (index->digests == NULL || index->blocks == NULL)
+		return false;
+	memset(index->blocks, 0xFF, size * sizeof(*index->blocks));
+	return true;
+}
+
+static uint32_t *digest_index_slot(struct digest_index *index, uint64_t digest)
+{
+	uint32_t slot = (uint32_t)(digest ^ (digest >> 32)) * 0x9E3779B1;
+
+	for (slot &= index->mask; index->blocks[slot] != NO_BLOCK; slot = (slot + 1) & index->mask) {
+		if (index->digests[slot] == digest)
+			break;
+	}
+	index->digests[slot] = digest;
+	return &index->blocks[slot];
+}
+
+static void digest_index_free(struct digest_index *index)
+{
+	free(index->digests);
+	free(index->blocks);
+}
+
+// rsync-style weak checksum, which rolls one byte at a time
+static uint32_t weak_checksum(uint8_t *data, uint32_t *a, uint32_t *b)
+{
+	*a = 0;
+	*b = 0;
+	for (uint32_t i = 0; i < SIZE_BLOCK; i++) {
+		*a += data[i];
+		*b += (SIZE_BLOCK - i) * data[i];
+	}
+	return (*a & 0xFFFF) | (*b << 16);
+}
+
+// Match modified blocks against every window of the reference image. The board
+// must hold the reference in each source block, and the window must match exactly.
+// Without CRC64, windows must be unaligned: an aligned window is a board block whose
+// digest alone matched, and a collision there would verify too
+static void match_reference(struct copy_block *copies, uint32_t *copy_count, uint32_t *dirty_blocks,
+			    uint32_t dirty_count, bool *matched, struct block_digest *digests,
+			    uint32_t image_blocks, uint8_t *reference)
+{
+	uint8_t *dirty_data;
+	bool *board_has_reference;
+	int32_t *buckets;
+	int32_t *next;
+	uint32_t bucket_mask = 1;
+	uint32_t a, b, weak;
+	uint32_t first, last;
+	size_t reference_size = (size_t)image_blocks * SIZE_BLOCK;
+
+	while (bucket_mask < dirty_count * 2)
+		bucket_mask <<= 1;
+	bucket_mask--;
+
+	dirty_data = malloc((size_t)dirty_count * SIZE_BLOCK);
+	board_has_reference = calloc(image_blocks, sizeof(*board_has_reference));
+	buckets = malloc((bucket_mask + 1) * sizeof(*buckets));
+	next = calloc(dirty_count, sizeof(*next));
+	if (dirty_data == NULL || board_has_reference == NULL || buckets == NULL || next == NULL)
+		goto end;
+
+	for (uint32_t i = 0; i < image_blocks; i++) {
+		board_has_reference[i] =
+			digests[i].board_known
+			&& digests[i].board
+				   == calculate_digest(digest_type, reference + (size_t)i * SIZE_BLOCK,
+						       SIZE_BLOCK);
+	}
+
+	// Bucket the unmatched blocks by weak checksum
+	memset(buckets, 0xFF, (bucket_mask + 1) * sizeof(*buckets));
+	for (uint32_t i = 0; i < dirty_count; i++) {
+		if (matched[i])
+			continue;
+		read_image_block(dirty_blocks[i], dirty_data + (size_t)i * SIZE_BLOCK);
+		weak = weak_checksum(dirty_data + (size_t)i * SIZE_BLOCK, &a, &b);
+		next[i] = buckets[weak & bucket_mask];
+		buckets[weak & bucket_mask] = i;
+	}
+
+	weak = weak_checksum(reference, &a, &b);
+	for (size_t offset = 0;; offset++) {
+		for (int32_t i = buckets[weak & bucket_mask]; i >= 0; i = next[i]) {
+			if (matched[i])
+				continue;
+
+			first = offset / SIZE_BLOCK;
+			last = (offset + SIZE_BLOCK - 1) / SIZE_BLOCK;
+			if (!board_has_reference[first] || !board_has_reference[last])
+				continue;
+			if (first == last && digest_type != DIGEST_CRC64)
+				continue;
+			if (memcmp(reference + offset, dirty_data + (size_t)i * SIZE_BLOCK, SIZE_BLOCK)
+			    != 0)
+				continue;
+
+			copies[*copy_count].block = dirty_blocks[i];
+			copies[*copy_count].src_address = offset;
+			(*copy_count)++;
+			matched[i] = true;
+		}
+
+		if (offset + SIZE_BLOCK >= reference_size)
+			break;
+
+		// Roll the window forward a byte
+		a += reference[offset + SIZE_BLOCK] - reference[offset];
+		b += a - SIZE_BLOCK * reference[offset];
+		weak = (a & 0xFFFF) | (b << 16);
+	}
+
+end:
+	free(next);
+	free(buckets);
+	free(board_has_reference);
+	free(dirty_data);
+}
+
+// Order copies so that no source is overwritten before it is read. A copy
+// in a cycle is demoted, it is written after every copy instead
+static uint32_t order_copies(struct copy_block *copies, uint32_t copy_count, bool *demoted,
+			     uint32_t image_blocks)
+{
+	struct copy_block *ordered;
+	uint32_t *copy_of;
+	uint32_t (*readers)[2];
+	uint32_t *indegree;
+	uint32_t *queue;
+	uint32_t head = 0, tail = 0, ordered_count = 0, scan = 0;
+	uint32_t first, last, writer, i;
+
+	ordered = malloc(copy_count * sizeof(*ordered));
+	copy_of = malloc(image_blocks * sizeof(*copy_of));
+	readers = malloc(copy_count * sizeof(*readers));
+	indegree = calloc(copy_count, sizeof(*indegree));
+	queue = malloc(copy_count * sizeof(*queue));
+	if (ordered == NULL || copy_of == NULL || readers == NULL || indegree == NULL
+	    || queue == NULL) {
+		// Cannot order, so copy nothing
+		for (uint32_t i = 0; i < copy_count; i++)
+			demoted[i] = true;
+		goto end;
+	}
+
+	memset(copy_of, 0xFF, image_blocks * sizeof(*copy_of));
+	for (uint32_t i = 0; i < copy_count; i++)
+		copy_of[copies[i].block] = i;
+
+	// A copy must precede the copies that overwrite its source blocks
+	for (uint32_t i = 0; i < copy_count; i++) {
+		first = copies[i].src_address / SIZE_BLOCK;
+		last = (copies[i].src_address + SIZE_BLOCK - 1) / SIZE_BLOCK;
+		readers[i][0] = copy_of[first];
+		readers[i][1] = (last != first) ? copy_of[last] : NO_BLOCK;
+		for (int j = 0; j < 2; j++) {
+			writer = readers[i][j];
+			if (writer == i)
+				readers[i][j] = NO_BLOCK;
+			else if (writer != NO_BLOCK)
+				indegree[writer]++;
+		}
+		demoted[i] = false;
+	}
+
+	for (uint32_t i = 0; i < copy_count; i++) {
+		if (indegree[i] == 0)
+			queue[tail++] = i;
+	}
+
+	for (uint32_t done = 0; done < copy_count; done++) {
+		if (head < tail) {
+			i = queue[head++];
+			ordered[ordered_count++] = copies[i];
+		} else {
+			// Only cycles remain. Demote a copy still waiting
+			while (demoted[scan] || indegree[scan] == 0)
+				scan++;
+			i = scan;
+			demoted[i] = true;
+		}
+
+		for (int j = 0; j < 2; j++) {
+			writer = readers[i][j];
+			if (writer != NO_BLOCK && --indegree[writer] == 0 && !demoted[writer])
+				queue[tail++] = writer;
+		}
+	}
+
+	memcpy(copies, ordered, ordered_count * sizeof(*ordered));
+
+end:
+	free(queue);
+	free(indegree);
+	free(readers);
+	free(copy_of);
+	free(ordered);
+	return ordered_count;
+}
+
+// Find modified blocks whose contents the board already holds, aligned given CRC64
+// digests or, given the image the board holds, at any offset. Returns copies in a
+// safe order, and removes them from the modified blocks
+uint32_t plan_copies(struct copy_block *copies, uint32_t *dirty_blocks, uint32_t *dirty_count,
+		     struct block_digest *digests, uint32_t image_blocks, uint8_t *reference)
+{
+	struct digest_index index = {NULL, NULL, 0};
+	bool *matched;
+	bool *demoted;
+	bool *copied;
+	uint32_t *source;
+	uint32_t copy_count = 0;
+	uint32_t remaining = 0;
+	// A 32-bit digest collision would copy the wrong data, and then verify. Without
+	// CRC64, only a source straddling two blocks of the reference is trusted, as the
+	// data copied from a collision is unlikely to verify
+	bool aligned = (digest_type == DIGEST_CRC64);
+
+	matched = calloc(*dirty_count, sizeof(*matched));
+	demoted = calloc(*dirty_count, sizeof(*demoted));
+	copied = calloc(image_blocks, sizeof(*copied));
+	if (matched == NULL || demoted == NULL || copied == NULL
+	    || !digest_index_init(&index, image_blocks)) {
+		copy_count = 0;
+		goto end;
+	}
+
+	// Unmodified blocks are preferred sources, as they impose no ordering
+	for (uint32_t i = 0; i < image_blocks && aligned; i++) {
+		if (!digests[i].board_known)
+			continue;
+		source = digest_index_slot(&index, digests[i].board);
+		if (*source == NO_BLOCK
+		    || (digests[i].board == digests[i].image
+			&& digests[*source].board != digests[*source].image))
+			*source = i;
+	}
+
+	for (uint32_t i = 0; i < *dirty_count && aligned; i++) {
+		source = digest_index_slot(&index, digests[dirty_blocks[i]].image);
+		if (*source == NO_BLOCK || *source == dirty_blocks[i])
+			continue;
+		copies[copy_count].block = dirty_blocks[i];
+		copies[copy_count].src_address = *source * SIZE_BLOCK;
+		copy_count++;
+		matched[i] = true;
+	}
+
+	if (reference != NULL)
+		match_reference(copies, &copy_count, dirty_blocks, *dirty_count, matched, digests,
+				image_blocks, reference);
+
+	// Demoted copies remain modified blocks, to be written
+	copy_count = order_copies(copies, copy_count, demoted, image_blocks);
+	for (uint32_t i = 0; i < copy_count; i++)
+		copied[copies[i].block] = true;
+	for (uint32_t i = 0; i < *dirty_count; i++) {
+		if (!copied[dirty_blocks[i]])
+			dirty_blocks[remaining++] = dirty_blocks[i];
+	}
+	*dirty_count = remaining;
+
+end:
+	digest_index_free(&index);
+	free(copied);
+	free(demoted);
+	free(matched);
+	return copy_count;
+}
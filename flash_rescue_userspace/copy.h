@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Digests of one block, on the board and in the image
+struct block_digest {
+	uint64_t board;
+	uint64_t image;
+	bool board_known; // Board digest was requested, or block was confirmed clean
+};
+
+// Modified block whose contents already exist elsewhere on the board
+struct copy_block {
+	uint32_t block;	      // Destination block
+	uint32_t src_address; // Source in BIOS region; need not be block-aligned
+};
+
+uint32_t plan_copies(struct copy_block *copies, uint32_t *dirty_blocks, uint32_t *dirty_count,
+		     struct block_digest *digests, uint32_t image_blocks, uint8_t *reference);
+
+#endif
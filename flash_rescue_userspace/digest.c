@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include "digest.h"
+
+static const char *digest_names[] = {"crc32", "crc32c", "crc64"};
+static uint32_t crc32c_table[256];
+static uint64_t crc64_table[256];
+// Sessions run on threads of their own, so build the tables once
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+
+static void build_tables(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c32 = i;
+		uint64_t c64 = i;
+
+		for (int bit = 0; bit < 8; bit++) {
+			c32 = (c32 & 1) ? (c32 >> 1) ^ 0x82F63B78 : c32 >> 1;
+			c64 = (c64 & 1) ? (c64 >> 1) ^ 0xC96C5795D7870F42ULL : c64 >> 1;
+		}
+		crc32c_table[i] = c32;
+		crc64_table[i] = c64;
+	}
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint8_t *data, size_t length)
+{
+	uint64_t crc = 0xFFFFFFFF;
+	uint64_t word;
+
+	for (; length >= sizeof(word); data += sizeof(word), length -= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		crc = __builtin_ia32_crc32di(crc, word);
+	}
+	for (; length > 0; data++, length--)
+		crc = __builtin_ia32_crc32qi(crc, *data);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+static uint32_t crc32c(uint8_t *data, size_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42(data, length);
+
+	for (; length > 0; data++, length--)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *data) & 0xFF];
+	return crc ^ 0xFFFFFFFF;
+}
+
+static uint64_t crc64(uint8_t *data, size_t length)
+{
+	uint64_t crc = UINT64_MAX;
+
+	for (; length > 0; data++, length--)
+		crc = (crc >> 8) ^ crc64_table[(crc ^ *data) & 0xFF];
+	return crc ^ UINT64_MAX;
+}
+
+// Returns -1 for unknown digests
+int digest_from_name(char *name)
+{
+	for (size_t i = 0; i < sizeof(digest_names) / sizeof(digest_names[0]); i++) {
+		if (strcmp(name, digest_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+char *digest_name(uint8_t type)
+{
+	if (type >= sizeof(digest_names) / sizeof(digest_names[0]))
+		return "unknown";
+	return (char *)digest_names[type];
+}
+
+size_t digest_size(uint8_t type)
+{
+	switch (type) {
+	case DIGEST_CRC32:
+	case DIGEST_CRC32C:
+		return sizeof(uint32_t);
+	case DIGEST_CRC64:
+		return sizeof(uint64_t);
+	default:
+		return 0;
+	}
+}
+
+// Narrower digests are zero-extended, as received from the board
+uint64_t calculate_digest(uint8_t type, void *data, size_t length)
+{
+	pthread_once(&tables_once, build_tables);
+
+	switch (type) {
+	case DIGEST_CRC32C:
+		return crc32c(data, length);
+	case DIGEST_CRC64:
+		return crc64(data, length);
+	default:
+		return crc32(0, data, length);
+	}
+}
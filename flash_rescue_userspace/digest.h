@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Synchronise with board's FlashRescueDigestLib
+#define DIGEST_CRC32  0x00
+#define DIGEST_CRC32C 0x01
+#define DIGEST_CRC64  0x02
+
+int digest_from_name(char *name);
+char *digest_name(uint8_t type);
+size_t digest_size(uint8_t type);
+uint64_t calculate_digest(uint8_t type, void *data, size_t length);
+
+#endif
@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+// Full-duplex exchanges: a writer thread sends commands while a reader thread receives the
+// responses to earlier ones, so neither direction of the link idles while the other is busy
+// - The session's thread submits requests and collects their responses. Each pair of threads
+//   shares a single-producer, single-consumer ring, which needs no lock
+// - The board answers in order, so each response belongs to the oldest request in flight. It
+//   echoes the request's block number in `Size`, so a lost response is noticed
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash_rescue_userspace.h"
+#include "duplex.h"
+#include "estimate.h"
+#include "session.h"
+#include "util.h"
+
+// Ring of `size` records, a power of two. Each index is advanced by one thread only
+// - Release and acquire order a record's contents with the index that publishes it
+struct ring {
+	uint8_t *records;
+	size_t record_size;
+	size_t size;
+	atomic_size_t head; // Next to produce
+	atomic_size_t tail; // Next to consume
+};
+
+// Request in flight, as the reader thread expects its response
+struct duplex_request {
+	uint32_t tag;
+	uint16_t block_number;
+	uint16_t data_size;
+};
+
+// Semaphores only wake a thread that awaits a ring, they do not guard it
+struct duplex {
+	struct session_context context;
+	pthread_t writer;
+	pthread_t reader;
+	bool writer_started;
+	bool reader_started;
+	bool out_of_step; // Reader's, until it is joined
+	int first_timeout_ms;
+	atomic_bool stopping;
+	uint32_t in_flight;
+	sem_t credits;	 // Requests that may yet be submitted
+	sem_t tx_ready;	 // Commands for the writer
+	sem_t submitted; // Requests for the reader
+	sem_t completed; // Responses for the session's thread
+	sem_t collected; // Responses the session's thread has taken, freeing their records
+	struct ring tx;
+	struct ring requests;
+	struct ring completions;
+	uint8_t tx_records[DUPLEX_TX_RING_SIZE];
+	struct duplex_request request_records[DUPLEX_IN_FLIGHT];
+	struct duplex_completion completion_records[DUPLEX_IN_FLIGHT];
+};
+
+static _Thread_local struct duplex *engine;
+
+
+static void ring_init(struct ring *ring, void *records, size_t record_size, size_t size)
+{
+	ring->records = records;
+	ring->record_size = record_size;
+	ring->size = size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+// Records that may yet be produced. Consumption only grows it, so the producer may rely on it
+static size_t ring_space(struct ring *ring)
+{
+	return ring->size - (atomic_load_explicit(&ring->head, memory_order_relaxed)
+			     - atomic_load_explicit(&ring->tail, memory_order_acquire));
+}
+
+// Publish `count` records at once, or none unless they all fit
+static bool ring_push_all(struct ring *ring, const void *records, size_t count)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	if (ring_space(ring) < count)
+		return false;
+	for (size_t i = 0; i < count; i++)
+		memcpy(ring->records + ((head + i) & (ring->size - 1)) * ring->record_size,
+		       (const uint8_t *)records + i * ring->record_size, ring->record_size);
+	atomic_store_explicit(&ring->head, head + count, memory_order_release);
+	return true;
+}
+
+static bool ring_push(struct ring *ring, const void *record)
+{
+	return ring_push_all(ring, record, 1);
+}
+
+static bool ring_pop(struct ring *ring, void *record)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+		return false;
+	memcpy(record, ring->records + (tail & (ring->size - 1)) * ring->record_size,
+	       ring->record_size);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static void await(sem_t *semaphore)
+{
+	while (sem_wait(semaphore) != 0 && errno == EINTR)
+		;
+}
+
+// Send commands as they are submitted. Awaiting the port to drain holds up this thread alone
+static void *writer_thread(void *arg)
+{
+	struct duplex *duplex = arg;
+	uint8_t data[DUPLEX_TX_RING_SIZE];
+	size_t length;
+
+	session_adopt_context(&duplex->context);
+	while (true) {
+		await(&duplex->tx_ready);
+		length = 0;
+		while (length < sizeof(data) && ring_pop(&duplex->tx, &data[length]))
+			length++;
+
+		if (length != 0)
+			serial_fifo_write(data, length);
+		else if (atomic_load(&duplex->stopping))
+			return NULL;
+	}
+}
+
+// Match each response to the oldest request. Log frames ahead of it are demultiplexed
+// - A late response, or another request's, puts the link out of step. Later requests are
+//   failed without reading, as duplex_stop() drains their responses
+static void *reader_thread(void *arg)
+{
+	struct duplex *duplex = arg;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	struct duplex_completion completion;
+	struct duplex_request request;
+	int timeout_ms = duplex->first_timeout_ms;
+
+	session_adopt_context(&duplex->context);
+	while (true) {
+		await(&duplex->submitted);
+		if (!ring_pop(&duplex->requests, &request))
+			return NULL;
+
+		completion.tag = request.tag;
+		completion.acknowledged = false;
+		completion.data = 0;
+		if (!duplex->out_of_step
+		    && (!read_response_timeout(&response_packet, timeout_ms)
+			|| response_packet.Acknowledge > 1
+			|| response_packet.Size != request.block_number))
+			duplex->out_of_step = true;
+
+		// Board NACKs a block it cannot read, and then answers the next request
+		if (!duplex->out_of_step && response_packet.Acknowledge == 1) {
+			completion.acknowledged = true;
+			serial_fifo_read(&completion.data, request.data_size);
+		}
+		timeout_ms = DUPLEX_RESPONSE_TIMEOUT_MS;
+
+		// Credits bound the responses, but a full ring is awaited rather than overrun
+		while (!ring_push(&duplex->completions, &completion))
+			await(&duplex->collected);
+		sem_post(&duplex->completed);
+	}
+}
+
+// Start exchanging in full duplex. Until duplex_stop(), only the threads may use the link
+// - Board may digest up to `region_blocks` before its first answer
+// - Returns false if the threads could not be started, leaving the link as it was
+bool duplex_start(uint32_t region_blocks)
+{
+	struct duplex *duplex;
+
+	duplex = calloc(1, sizeof(*duplex));
+	if (duplex == NULL)
+		return false;
+
+	session_save_context(&duplex->context);
+	duplex->first_timeout_ms =
+		DUPLEX_RESPONSE_TIMEOUT_MS
+		+ (int)(DUPLEX_DIGEST_MARGIN * estimate_ms(ESTIMATE_TABLE, region_blocks));
+	atomic_init(&duplex->stopping, false);
+	ring_init(&duplex->tx, duplex->tx_records, 1, DUPLEX_TX_RING_SIZE);
+	ring_init(&duplex->requests, duplex->request_records, sizeof(struct duplex_request),
+		  DUPLEX_IN_FLIGHT);
+	ring_init(&duplex->completions, duplex->completion_records,
+		  sizeof(struct duplex_completion), DUPLEX_IN_FLIGHT);
+	sem_init(&duplex->credits, 0, DUPLEX_IN_FLIGHT);
+	sem_init(&duplex->tx_ready, 0, 0);
+	sem_init(&duplex->submitted, 0, 0);
+	sem_init(&duplex->completed, 0, 0);
+	sem_init(&duplex->collected, 0, 0);
+
+	engine = duplex;
+	duplex->writer_started =
+		pthread_create(&duplex->writer, NULL, writer_thread, duplex) == 0;
+	duplex->reader_started =
+		duplex->writer_started
+		&& pthread_create(&duplex->reader, NULL, reader_thread, duplex) == 0;
+	if (!duplex->reader_started) {
+		duplex_stop();
+		return false;
+	}
+	return true;
+}
+
+// Submit a request, whose ACK is followed by `data_size` bytes. False while too many are in
+// flight, or the writer is behind, so a response must be collected first
+bool duplex_submit(EARLY_FLASH_RESCUE_COMMAND *command, uint16_t data_size, uint32_t tag)
+{
+	struct duplex_request request = {
+		.tag = tag, .block_number = command->BlockNumber, .data_size = data_size};
+
+	if (sem_trywait(&engine->credits) != 0)
+		return false;
+
+	// Both are queued, or neither. Only this thread produces commands, so space remains
+	// - Reader must expect the response before it can arrive
+	if (ring_space(&engine->tx) < sizeof(*command)
+	    || !ring_push(&engine->requests, &request)) {
+		sem_post(&engine->credits);
+		return false;
+	}
+	sem_post(&engine->submitted);
+	ring_push_all(&engine->tx, command, sizeof(*command));
+	sem_post(&engine->tx_ready);
+	engine->in_flight++;
+	return true;
+}
+
+// Await the response to the oldest request in flight. False if there is none
+bool duplex_complete(struct duplex_completion *completion)
+{
+	if (engine->in_flight == 0)
+		return false;
+
+	await(&engine->completed);
+	if (!ring_pop(&engine->completions, completion))
+		return false;
+	sem_post(&engine->collected);
+	engine->in_flight--;
+	sem_post(&engine->credits);
+	return true;
+}
+
+// Collect every response still in flight, then stop the threads
+// - Once out of step, the link is drained, so later exchanges do not read stale responses
+void duplex_stop(void)
+{
+	struct duplex_completion completion;
+
+	while (duplex_complete(&completion))
+		;
+
+	atomic_store(&engine->stopping, true);
+	if (engine->writer_started) {
+		sem_post(&engine->tx_ready);
+		pthread_join(engine->writer, NULL);
+	}
+	if (engine->reader_started) {
+		sem_post(&engine->submitted);
+		pthread_join(engine->reader, NULL);
+	}
+	if (engine->out_of_step)
+		serial_drain(engine->first_timeout_ms);
+
+	sem_destroy(&engine->credits);
+	sem_destroy(&engine->tx_ready);
+	sem_destroy(&engine->submitted);
+	sem_destroy(&engine->completed);
+	sem_destroy(&engine->collected);
+	free(engine);
+	engine = NULL;
+}
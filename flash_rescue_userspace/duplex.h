@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef DUPLEX_H
+#define DUPLEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "flash_rescue_userspace.h"
+
+// Requests sent ahead of their responses. The board's 16-byte UART FIFO holds their commands
+// while it works on the oldest, so none are overrun
+#define DUPLEX_IN_FLIGHT 4
+
+// Bytes of commands awaiting the writer thread. A power of two
+#define DUPLEX_TX_RING_SIZE 64
+
+// Once a response is this late, or not the request's, the link is out of step
+#define DUPLEX_RESPONSE_TIMEOUT_MS 3000
+
+// Board may digest the rest of the region before its first answer. That answer is allowed this
+// multiple of a digest table's measured cost per block, besides the usual timeout. A link out
+// of step is drained until quiet that long, as the board may still be digesting
+#define DUPLEX_DIGEST_MARGIN 2
+
+// Response to a request, in the order submitted
+// - Unacknowledged when NACK'd, or once the link is out of step
+struct duplex_completion {
+	uint32_t tag; // As submitted
+	bool acknowledged;
+	uint64_t data; // Up to 8 bytes that follow the ACK
+};
+
+bool duplex_start(uint32_t region_blocks);
+bool duplex_submit(EARLY_FLASH_RESCUE_COMMAND *command, uint16_t data_size, uint32_t tag);
+bool duplex_complete(struct duplex_completion *completion);
+void duplex_stop(void);
+
+#endif
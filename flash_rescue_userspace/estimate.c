@@ -0,0 +1,219 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "flash_rescue_userspace.h"
+#include "estimate.h"
+#include "session.h"
+#include "util.h"
+
+// Per-block costs before a port is calibrated: 115200 baud, and typical SPI erase and program
+static const double default_ms[ESTIMATE_OPERATIONS] = {
+	[ESTIMATE_CHECKSUM] = 10, [ESTIMATE_TABLE] = 2, [ESTIMATE_WRITE] = 420,
+	[ESTIMATE_STAGE] = 380,	  [ESTIMATE_FILL] = 60, [ESTIMATE_COPY] = 80,
+};
+
+// Costs measured by earlier sessions on this port. Zero until an operation is measured
+static _Thread_local double model_ms[ESTIMATE_OPERATIONS];
+static _Thread_local bool model_loaded;
+static _Thread_local bool model_calibrated;
+
+// This session's measurements, not yet saved
+static _Thread_local uint64_t session_ns[ESTIMATE_OPERATIONS];
+static _Thread_local uint32_t session_blocks[ESTIMATE_OPERATIONS];
+
+// Phase that the progress bar shows
+static _Thread_local uint8_t phase;
+static _Thread_local uint64_t phase_start_ns;
+static _Thread_local uint32_t phase_total;
+static _Thread_local double phase_predicted_ms;
+
+
+uint64_t estimate_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Entry of the cache: "<checksum> <table> <write> <stage> <fill> <copy> <port>"
+// - Costs are in microseconds per block. Returns its port
+static char *parse_cached(char *line, unsigned int *costs_us)
+{
+	int dev_offset;
+
+	line[strcspn(line, "\n")] = 0;
+	if (sscanf(line, "%u %u %u %u %u %u %n", &costs_us[ESTIMATE_CHECKSUM],
+		   &costs_us[ESTIMATE_TABLE], &costs_us[ESTIMATE_WRITE],
+		   &costs_us[ESTIMATE_STAGE], &costs_us[ESTIMATE_FILL], &costs_us[ESTIMATE_COPY],
+		   &dev_offset)
+	    != ESTIMATE_OPERATIONS)
+		return NULL;
+	return line + dev_offset;
+}
+
+static void load_model(void)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX + 128];
+	unsigned int costs_us[ESTIMATE_OPERATIONS];
+	char *dev;
+	FILE *cache_fp;
+
+	if (model_loaded)
+		return;
+	model_loaded = true;
+	if (!cache_path(path, sizeof(path), ESTIMATE_CACHE_NAME)
+	    || (cache_fp = fopen(path, "r")) == NULL)
+		return;
+
+	// Later entries supersede earlier ones
+	while (fgets(line, sizeof(line), cache_fp) != NULL) {
+		dev = parse_cached(line, costs_us);
+		if (dev == NULL || strcmp(dev, p_dev) != 0)
+			continue;
+
+		for (int i = 0; i < ESTIMATE_OPERATIONS; i++)
+			model_ms[i] = costs_us[i] / 1000.0;
+		model_calibrated = true;
+	}
+
+	fclose(cache_fp);
+}
+
+// Cost of an operation, from the model and this session. Zero when neither has measured it
+static double measured_ms(uint8_t operation)
+{
+	double session_ms;
+
+	load_model();
+	if (session_blocks[operation] == 0)
+		return model_ms[operation];
+
+	session_ms = session_ns[operation] / 1e6 / session_blocks[operation];
+	if (model_ms[operation] == 0)
+		return session_ms;
+	return model_ms[operation] * (1 - ESTIMATE_SESSION_WEIGHT)
+	       + session_ms * ESTIMATE_SESSION_WEIGHT;
+}
+
+// Account for an operation on `blocks`, begun at `start_ns`
+void estimate_record(uint8_t operation, uint64_t start_ns, uint32_t blocks)
+{
+	session_ns[operation] += estimate_clock() - start_ns;
+	session_blocks[operation] += blocks;
+}
+
+// Predicted time for an operation on `blocks`
+double estimate_ms(uint8_t operation, uint32_t blocks)
+{
+	double cost_ms = measured_ms(operation);
+
+	return blocks * ((cost_ms != 0) ? cost_ms : default_ms[operation]);
+}
+
+// Whether an earlier session on this port measured the link
+bool estimate_calibrated(void)
+{
+	load_model();
+	return model_calibrated;
+}
+
+// Fold this session's timings into the model, and cache it for later sessions
+void estimate_save(void)
+{
+	char path[PATH_MAX];
+	char new_path[PATH_MAX + 4];
+	char line[PATH_MAX + 128];
+	unsigned int costs_us[ESTIMATE_OPERATIONS];
+	bool measured = false;
+	char *dev;
+	FILE *cache_fp;
+	FILE *new_fp;
+
+	for (int i = 0; i < ESTIMATE_OPERATIONS; i++) {
+		measured |= (session_blocks[i] != 0);
+		model_ms[i] = measured_ms(i);
+		session_ns[i] = 0;
+		session_blocks[i] = 0;
+	}
+	if (!measured || !cache_path(path, sizeof(path), ESTIMATE_CACHE_NAME))
+		return;
+	snprintf(new_path, sizeof(new_path), "%s.new", path);
+	new_fp = fopen(new_path, "w");
+	if (new_fp == NULL)
+		return;
+
+	cache_fp = fopen(path, "r");
+	while (cache_fp != NULL && fgets(line, sizeof(line), cache_fp) != NULL) {
+		dev = parse_cached(line, costs_us);
+		if (dev == NULL || strcmp(dev, p_dev) == 0)
+			continue;
+		fprintf(new_fp, "%s\n", line);
+	}
+	if (cache_fp != NULL)
+		fclose(cache_fp);
+
+	for (int i = 0; i < ESTIMATE_OPERATIONS; i++)
+		fprintf(new_fp, "%u ", (unsigned int)(model_ms[i] * 1000));
+	fprintf(new_fp, "%s\n", p_dev);
+	if (fclose(new_fp) != 0 || rename(new_path, path) != 0)
+		unlink(new_path);
+}
+
+void estimate_format(char *buffer, size_t size, double ms)
+{
+	unsigned int seconds = (ms + 999) / MS_IN_SECOND;
+
+	snprintf(buffer, size, "%um%02us", seconds / 60, seconds % 60);
+}
+
+// Begin a phase of `total` steps, which the model predicts will take `predicted_ms`
+void progress_start(uint8_t new_phase, uint32_t total, double predicted_ms)
+{
+	phase = new_phase;
+	phase_start_ns = estimate_clock();
+	phase_total = total;
+	phase_predicted_ms = predicted_ms;
+}
+
+// Draw the phase's progress, with its throughput and remaining time. The caller is told too
+// - Remaining time is predicted by the model at first, then increasingly by the phase's pace
+void progress_update(uint32_t done)
+{
+	struct flash_rescue_progress progress = {
+		.phase = phase,
+		.done = done,
+		.total = phase_total,
+	};
+	char status[64];
+	char rate[24] = "";
+	char eta[16];
+	double elapsed_ms = (estimate_clock() - phase_start_ns) / 1e6;
+	double done_fraction = (double)done / phase_total;
+	double remaining_ms;
+
+	remaining_ms = phase_predicted_ms * (1 - done_fraction);
+	if (done != 0)
+		remaining_ms = remaining_ms * (1 - done_fraction)
+			       + elapsed_ms * (phase_total - done) / done * done_fraction;
+	estimate_format(eta, sizeof(eta), remaining_ms);
+
+	progress.remaining_ms = remaining_ms;
+	if (elapsed_ms >= 1) {
+		progress.bytes_per_second =
+			(double)done * SIZE_BLOCK / (elapsed_ms / MS_IN_SECOND);
+		snprintf(rate, sizeof(rate), "%.1f KiB/s", progress.bytes_per_second / 1024);
+	}
+	snprintf(status, sizeof(status), "%3u%% %14s  ETA %s", TO_PERCENTAGE(done, phase_total),
+		 rate, eta);
+	draw_progress_bar(TO_PERCENTAGE(done, phase_total), status);
+	session_progress(&progress);
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Operations that the flash time is modelled from, each costed per block
+enum {
+	ESTIMATE_CHECKSUM, // Single CHECKSUM, while scanning or verifying
+	ESTIMATE_TABLE,	   // Block described by a DIGEST_TABLE
+	ESTIMATE_WRITE,	   // Single WRITE
+	ESTIMATE_STAGE,	   // Block streamed by STAGE
+	ESTIMATE_FILL,	   // ERASE or FILL
+	ESTIMATE_COPY,	   // COPY
+	ESTIMATE_OPERATIONS
+};
+
+// File in the user's cache directory
+#define ESTIMATE_CACHE_NAME "flash_rescue_timings"
+
+// Weight of a session's timings against the model's, once it has been calibrated
+#define ESTIMATE_SESSION_WEIGHT 0.5
+
+uint64_t estimate_clock(void);
+void estimate_record(uint8_t operation, uint64_t start_ns, uint32_t blocks);
+double estimate_ms(uint8_t operation, uint32_t blocks);
+bool estimate_calibrated(void);
+void estimate_save(void);
+void estimate_format(char *buffer, size_t size, double ms);
+void progress_start(uint8_t phase, uint32_t total, double predicted_ms);
+void progress_update(uint32_t done);
+
+#endif
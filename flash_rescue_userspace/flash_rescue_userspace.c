@@ -1,7 +1,6 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
-#include <assert.h>
-#include <signal.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,142 +8,244 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include <zlib.h>
 #include "flash_rescue_userspace.h"
+#include "buspirate.h"
+#include "copy.h"
+#include "digest.h"
+#include "duplex.h"
+#include "estimate.h"
+#include "fv.h"
+#include "journal.h"
+#include "region.h"
+#include "session.h"
+#include "trace.h"
+#include "tune.h"
 #include "util.h"
+#include "watch.h"
 
-FILE *bios_fp;
-int serial_dev;
-char *p_dev;
-uint8_t implementation = 0xFF;
-bool implementation_high_speed = false;
-static uint16_t xfer_block_size = SIZE_BLOCK;
+// State of the session running on this thread
+_Thread_local FILE *bios_fp;
+_Thread_local char *bios_path;
+_Thread_local int serial_dev;
+_Thread_local char *p_dev;
+_Thread_local uint8_t implementation = 0xFF;
+_Thread_local bool implementation_high_speed = false;
+_Thread_local char *journal_path;
+_Thread_local char *reference_path;
+_Thread_local bool watch_mode = false;
+_Thread_local bool include_volatile = false;
+_Thread_local bool ignore_manifest = false;
+_Thread_local bool board_modified = false;
+_Thread_local FILE *board_log_fp;
+_Thread_local uint8_t digest_type = DIGEST_CRC32;
+_Thread_local uint16_t xfer_block_size = SIZE_BLOCK;
+_Thread_local uint16_t xfer_window = 1;
+_Thread_local bool autotune = false;
+_Thread_local bool dry_run = false;
 
+// Optional commands are unknown until the board first answers them
+enum { COMMAND_UNKNOWN, COMMAND_SUPPORTED, COMMAND_UNSUPPORTED };
+static _Thread_local uint8_t erase_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t fill_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t copy_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t keepalive_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t stage_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t digest_table_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t manifest_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t log_support = COMMAND_UNKNOWN;
+static _Thread_local uint8_t info_support = COMMAND_UNKNOWN;
 
-// Initialise userspace
-int initialise_userspace(int argc, char *argv[])
-{
-	int opt;
+// A block of one repeated byte, which need not be transferred
+struct constant_block {
+	uint32_t block;
+	uint8_t pattern;
+};
 
-	while ((opt = getopt(argc, argv, "f:d:m:s")) != -1) {
-		// Required parameter is in global "optarg"
-		switch (opt) {
-		case 'f':
-			bios_fp = fopen(optarg, "r");
-			break;
-		case 'd':
-			serial_dev = serial_open(optarg, B115200);
-			p_dev = optarg;
-			break;
-		case 'm':
-			implementation = atoi(optarg);
-			break;
-		case 's':
-			implementation_high_speed = true;
-			break;
-		}
-	}
+// Optional commands are answered promptly, or not at all by older boards
+#define PROBE_TIMEOUT_MS 1000
 
-	if (bios_fp == NULL || serial_dev < 0 || implementation == 0xFF) {
-		printf("Usage: %s [OPTIONS]", argv[0]);
-		printf("\n");
-		printf("  -f <BIOS image>\n");
-		printf("  -d <serial port>\n");
-		printf("  -m [mode]\n");
-		printf("  -s [high speed; OPTIONAL]\n");
-		printf("\n");
-		printf("Implementation modes:\n");
-		printf("  1: Bus Pirate\n");
-		printf("  254: (No initialisation or quirks required)\n");
-		printf("  255: (Reserved - MAX)\n");
-		return 1;
-	}
+// Echoed packets are abandoned sooner by the board, which then answers
+#define ECHO_TIMEOUT_MS 1000
 
-	// Might wait infinitely. Be polite and clean up if the user escapes
-	signal(SIGINT, sig_handler);
+// Blocks per staged stream, bounding the work lost to an interrupted stream
+#define STAGE_BATCH_BLOCKS 1024
 
-	return 0;
-}
-
-// Implementation-specific methods to bring-up underlying layer
-void initialise_debug_port(void)
-{
-	uint8_t bp_debug_port_exit[] = {0x1B, 0x5B, 0x32, 0x34, 0x7E};
-	char *bp_not_exits = "\n";
-	char *bp_rst_sequence = "\n#\n";
-	char *bp_i2c_sequence = "m\n4\n2\n";
-	char *bp_debug_port = "(5)\n";
+// Modified blocks of a streamed image are staged in small batches, to follow the stream closely
+#define STREAM_STAGE_BLOCKS 64
 
-	if (implementation == 1) {
-		// TODO: Appropriate size
-		xfer_block_size = 64;
+// Board's buffers may hold fewer blocks than a batch
+static _Thread_local uint16_t stage_batch_blocks = STAGE_BATCH_BLOCKS;
 
-		// usleep() to allow interactive console to keep up
-		serial_fifo_write(bp_debug_port_exit, sizeof(bp_debug_port_exit));
-		usleep(100 * MS_IN_SECOND);
-		serial_fifo_write(bp_not_exits, strlen(bp_not_exits));
-		usleep(100 * MS_IN_SECOND);
-		serial_fifo_write(bp_rst_sequence, strlen(bp_rst_sequence));
-		usleep(100 * MS_IN_SECOND);
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
-		// TODO: Debugging
-		if (implementation_high_speed)
-			bp_switch_baudrate_generator(true);
 
-		serial_fifo_write(bp_i2c_sequence, strlen(bp_i2c_sequence));
-		usleep(100 * MS_IN_SECOND);
-		serial_fifo_write(bp_debug_port, strlen(bp_debug_port));
-		usleep(100 * MS_IN_SECOND);
-	}
+// Implementation-specific methods to bring-up underlying layer
+void initialise_debug_port(void)
+{
+	if (bp_in_use() && !bp_initialise())
+		fprintf(session_err, "Bus Pirate did not answer. Assuming its bridge is open\n");
 
 	// Don't care what debug port responded
-	tcflush(serial_dev, TCIOFLUSH);
+	serial_flush();
 }
 
 // Wait for `HELLO` command packet
 void wait_for_hello(void)
 {
-	EARLY_FLASH_RESCUE_COMMAND hello_packet;
+	// Command, then the bytes of its block number
+	uint8_t frame[sizeof(EARLY_FLASH_RESCUE_COMMAND)];
 	EARLY_FLASH_RESCUE_RESPONSE response_packet;
 
-	printf("Awaiting a COMMAND_HELLO...\n");
-	serial_fifo_read(&hello_packet, sizeof(hello_packet));
-	while (hello_packet.Command != EARLY_FLASH_RESCUE_COMMAND_HELLO) {
-		fprintf(stderr, "Still awaiting a COMMAND_HELLO. Serial port busy...\n");
-		serial_fifo_read(&hello_packet, sizeof(hello_packet));
+	fprintf(session_out, "Awaiting a COMMAND_HELLO...\n");
+	// Board only probes briefly, so resynchronise on debug output bytewise
+	serial_fifo_read(frame, sizeof(frame));
+	while (!session_stopped()) {
+		if (frame[0] == EARLY_FLASH_RESCUE_COMMAND_HELLO) {
+			if (frame[1] == 0 && frame[2] == 0)
+				break;
+			fprintf(session_err,
+				"Still awaiting a COMMAND_HELLO. Serial port busy...\n");
+		}
+
+		// A HELLO may begin at any byte of this frame
+		memmove(frame, frame + 1, sizeof(frame) - 1);
+		serial_fifo_read(&frame[sizeof(frame) - 1], 1);
 	}
 
-	printf("Board is present! Acknowledging its COMMAND_HELLO...\n");
+	if (session_stopped())
+		return;
+
+	fprintf(session_out, "Board is present! Acknowledging its COMMAND_HELLO...\n");
 	response_packet.Acknowledge = 1;
+	response_packet.Size = 0;
 	serial_fifo_write(&response_packet, sizeof(response_packet));
 
 	// Flush spurious `HELLO`s
-	tcflush(serial_dev, TCIOFLUSH);
+	serial_flush();
+}
+
+// Agree on the block digest. Older boards only understand CRC32
+void negotiate_digest(void)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	if (digest_type == DIGEST_CRC32)
+		return;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_DIGEST;
+	command_packet.BlockNumber = digest_type;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Baseline boards drop the command, without answering
+	if (!read_response_timeout(&response_packet, PROBE_TIMEOUT_MS)
+	    || response_packet.Acknowledge != 1) {
+		fprintf(session_err, "Board cannot use %s digests. Falling back to CRC32\n",
+			digest_name(digest_type));
+		digest_type = DIGEST_CRC32;
+		return;
+	}
+
+	fprintf(session_out, "Using %s block digests\n", digest_name(digest_type));
 }
 
-/* TODO: Handle NACKs */
 // By requesting checksums, we attempt optimising the flash procedure
-uint32_t request_block_checksum(uint32_t address)
+// - Returns false when the board cannot read the block, and NACKs
+bool request_block_checksum(uint32_t address, uint64_t *checksum)
 {
 	EARLY_FLASH_RESCUE_COMMAND command_packet;
-	uint32_t response_crc = 0;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	uint64_t start_ns = estimate_clock();
 
 	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_CHECKSUM;
 	command_packet.BlockNumber = (address / SIZE_BLOCK);
 	serial_fifo_write(&command_packet, sizeof(command_packet));
 
-	// Board acknowledges when it's ready
-	wait_for_ack_on("COMMAND_CHECKSUM", address);
+	read_response(&response_packet);
+	if (response_packet.Acknowledge != 1) {
+		fprintf(session_err, "\nBoard cannot read the block at 0x%x\n", address);
+		return false;
+	}
 
 	// Retrieve packet with requested data
-	serial_fifo_read(&response_crc, sizeof(response_crc));
-	return response_crc;
+	*checksum = 0;
+	serial_fifo_read(checksum, digest_size(digest_type));
+	estimate_record(ESTIMATE_CHECKSUM, start_ns, 1);
+	return true;
 }
 
-// Write one block
-void write_block(uint32_t address, void *block)
+// Request the checksums of many blocks, indexed by block, one at a time
+// - Returns how many leading blocks the board answered
+static uint32_t request_block_checksums_singly(uint32_t *blocks, uint32_t count,
+					       uint64_t *checksums)
+{
+	uint32_t answered = 0;
+
+	while (answered < count && !session_stopped()) {
+		progress_update(blocks[answered]);
+		if (!request_block_checksum(blocks[answered] * SIZE_BLOCK,
+					    &checksums[blocks[answered]]))
+			break;
+		answered++;
+	}
+	return answered;
+}
+
+// Request the checksums of many blocks, indexed by block. Each request is sent while the board
+// answers earlier ones, unless full duplex is unavailable
+// - Board may digest the whole region, of `image_blocks`, before its first answer
+// - Returns how many leading blocks the board answered
+static uint32_t request_block_checksums(uint32_t *blocks, uint32_t count, uint64_t *checksums,
+					uint32_t image_blocks)
 {
 	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	struct duplex_completion completion;
+	uint64_t start_ns = estimate_clock();
+	uint32_t submitted = 0;
+	uint32_t completed = 0;
+
+	if (count == 0)
+		return 0;
+
+	if (!duplex_start(image_blocks))
+		return request_block_checksums_singly(blocks, count, checksums);
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_CHECKSUM;
+	while (completed < count && !session_stopped()) {
+		while (submitted < count) {
+			command_packet.BlockNumber = blocks[submitted];
+			if (!duplex_submit(&command_packet, digest_size(digest_type), submitted))
+				break;
+			submitted++;
+		}
+
+		// Answered in order, so the oldest block is next
+		progress_update(blocks[completed]);
+		if (!duplex_complete(&completion) || !completion.acknowledged)
+			break;
+		checksums[blocks[completion.tag]] = completion.data;
+		completed++;
+	}
+	duplex_stop();
+	estimate_record(ESTIMATE_CHECKSUM, start_ns, completed);
+
+	// NACK'd, or the link fell out of step. Those still outstanding are requested singly
+	if (completed < count && !session_stopped()) {
+		fprintf(session_err, "\nRequesting checksums singly, from the block at 0x%x\n",
+			blocks[completed] * SIZE_BLOCK);
+		completed += request_block_checksums_singly(blocks + completed,
+							    count - completed, checksums);
+	}
+	return completed;
+}
+
+// Write one block. False if the board lost a packet, leaving the block unwritten
+bool write_block(uint32_t address, void *block)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	uint64_t start_ns = estimate_clock();
 
 	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_WRITE;
 	command_packet.BlockNumber = (address / SIZE_BLOCK);
@@ -154,134 +255,1094 @@ void write_block(uint32_t address, void *block)
 	wait_for_ack_on("COMMAND_WRITE", address);
 
 	// Start streaming block
-	void *xfer_block = block;
-	for (int i = 0; i < SIZE_BLOCK; i += xfer_block_size) {
-		serial_fifo_write(xfer_block, xfer_block_size);
-		xfer_block += xfer_block_size;
+	if (!send_packets(block, SIZE_BLOCK, -1)) {
+		fprintf(session_err, "\nBoard lost a packet of the block at 0x%x. Resending\n",
+			address);
+		return false;
+	}
+	estimate_record(ESTIMATE_WRITE, start_ns, 1);
+	return true;
+}
+
+// Stream data in packets, keeping up to `xfer_window` of them unacknowledged
+// - A NACK means a packet was lost. Without a timeout, the board is awaited until it says so
+bool send_packets(void *data, size_t size, int timeout_ms)
+{
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	size_t packets = (size + xfer_block_size - 1) / xfer_block_size;
+	size_t sent = 0;
+	size_t offset;
+
+	for (size_t acked = 0; acked < packets; acked++) {
+		while (sent < packets && sent - acked < xfer_window) {
+			offset = sent * xfer_block_size;
+			serial_fifo_write((uint8_t *)data + offset,
+					  MIN((size_t)xfer_block_size, size - offset));
+			sent++;
+		}
+
 		// FIXME: This will incur some penalty, but we must wait
-		wait_for_ack_on("WRITE_DATA", address);
+		if (timeout_ms < 0)
+			read_response(&response_packet);
+		else if (!read_response_timeout(&response_packet, timeout_ms))
+			return false;
+		if (response_packet.Acknowledge != 1)
+			return false;
+	}
+	return true;
+}
+
+// Have the board echo `size` bytes, sent as WRITE data is. False if they were lost or garbled
+bool echo_data(uint8_t *data, uint16_t size, uint8_t *echoed)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_ECHO;
+	command_packet.BlockNumber = size;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Older boards do not answer
+	if (!read_response_timeout(&response_packet, ECHO_TIMEOUT_MS)
+	    || response_packet.Acknowledge != 1)
+		return false;
+	if (!send_packets(data, size, ECHO_TIMEOUT_MS))
+		return false;
+
+	if (!read_response_timeout(&response_packet, ECHO_TIMEOUT_MS)
+	    || response_packet.Acknowledge != 1 || response_packet.Size != size)
+		return false;
+	return serial_fifo_read_timeout(echoed, size, ECHO_TIMEOUT_MS)
+	       && memcmp(data, echoed, size) == 0;
+}
+
+// Have the board receive WRITE data in packets of `size`
+bool set_xfer_size(uint16_t size)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_SET_XFER;
+	command_packet.BlockNumber = size;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	if (!read_response_timeout(&response_packet, PROBE_TIMEOUT_MS)
+	    || response_packet.Acknowledge != 1)
+		return false;
+	xfer_block_size = size;
+	return true;
+}
+
+// Ask the board to switch baud rate, after answering. Repeated, this confirms the new rate
+bool request_baud_rate(uint32_t baud)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_SET_BAUD;
+	command_packet.BlockNumber = baud / BAUD_RATE_UNIT;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	return read_response_timeout(&response_packet, PROBE_TIMEOUT_MS)
+	       && response_packet.Acknowledge == 1;
+}
+
+// Answer to an optional command. Older boards drop unknown commands silently
+static bool read_optional_response(EARLY_FLASH_RESCUE_RESPONSE *response_packet,
+				   uint8_t *support)
+{
+	if (*support == COMMAND_UNKNOWN) {
+		if (!read_response_timeout(response_packet, PROBE_TIMEOUT_MS)) {
+			*support = COMMAND_UNSUPPORTED;
+			return false;
+		}
+	} else {
+		read_response(response_packet);
+	}
+
+	// Board marks NACKs of commands it cannot serve. Other NACKs fail only this request
+	if (response_packet->Acknowledge != 1
+	    && response_packet->Size == EARLY_FLASH_RESCUE_NACK_UNSUPPORTED) {
+		*support = COMMAND_UNSUPPORTED;
+		return false;
+	}
+
+	*support = COMMAND_SUPPORTED;
+	return response_packet->Acknowledge == 1;
+}
+
+// Fetch the board's digests in bulk. Returns how many leading blocks are described
+// - Older boards, or blocks beyond its table, are checksummed singly instead
+// - Only `selected` blocks are described, unless it is NULL
+uint32_t request_digest_table(uint64_t *table, uint32_t image_blocks, bool *selected)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	uint8_t *digest_data;
+	size_t size = digest_size(digest_type);
+	uint32_t first = 0;
+	uint32_t count;
+	uint64_t start_ns;
+
+	while (first < image_blocks && digest_table_support != COMMAND_UNSUPPORTED
+	       && !session_stopped()) {
+		while (selected != NULL && first < image_blocks && !selected[first])
+			first++;
+		if (first == image_blocks)
+			break;
+		progress_update(first);
+
+		start_ns = estimate_clock();
+		command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_DIGEST_TABLE;
+		command_packet.BlockNumber = first;
+		serial_fifo_write(&command_packet, sizeof(command_packet));
+
+		// Board acknowledges with the number of digests, before computing them
+		if (!read_optional_response(&response_packet, &digest_table_support))
+			break;
+		count = response_packet.Size;
+		digest_data = malloc(count * size);
+		if (digest_data == NULL)
+			break;
+		serial_fifo_read(digest_data, count * size);
+
+		// Board NACKs when a block could not be read
+		read_response(&response_packet);
+		if (response_packet.Acknowledge != 1 || count == 0) {
+			free(digest_data);
+			break;
+		}
+
+		for (uint32_t i = 0; i < count && first + i < image_blocks; i++) {
+			table[first + i] = 0;
+			memcpy(&table[first + i], digest_data + i * size, size);
+		}
+		free(digest_data);
+		estimate_record(ESTIMATE_TABLE, start_ns, count);
+		first += count;
+	}
+
+	return MIN(first, image_blocks);
+}
+
+// Fetch the manifest the board stored after its last verified flash
+// - Board seeds its digest table from a valid manifest, whichever image it describes
+static bool request_manifest(FLASH_RESCUE_MANIFEST *manifest)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	if (manifest_support == COMMAND_UNSUPPORTED)
+		return false;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_MANIFEST_READ;
+	command_packet.BlockNumber = 0;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Board acknowledges with no header when it holds no valid manifest
+	if (!read_optional_response(&response_packet, &manifest_support))
+		return false;
+	if (response_packet.Size == 0)
+		return false;
+
+	serial_fifo_read(manifest, sizeof(*manifest));
+	return true;
+}
+
+// Have the board record its digests, so that the next session need not read the whole region
+static bool store_manifest(uint32_t image_crc)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	if (manifest_support != COMMAND_SUPPORTED)
+		return false;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_MANIFEST_STORE;
+	command_packet.BlockNumber = 0;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Board acknowledges before the image CRC, and again once stored
+	read_response(&response_packet);
+	if (response_packet.Acknowledge != 1)
+		return false;
+
+	serial_fifo_write(&image_crc, sizeof(image_crc));
+	read_response(&response_packet);
+	return response_packet.Acknowledge == 1;
+}
+
+// Erase a block, or erase it and program a repeated byte, instead of writing it
+bool fill_block(uint32_t address, uint8_t pattern)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	uint8_t *support = (pattern == 0xFF) ? &erase_support : &fill_support;
+	uint64_t start_ns = estimate_clock();
+
+	if (*support == COMMAND_UNSUPPORTED)
+		return false;
+
+	command_packet.Command = (pattern == 0xFF) ? EARLY_FLASH_RESCUE_COMMAND_ERASE
+						   : EARLY_FLASH_RESCUE_COMMAND_FILL;
+	command_packet.BlockNumber = (address / SIZE_BLOCK);
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Board acknowledges ERASE once erased. FILL is acknowledged before its pattern
+	if (!read_optional_response(&response_packet, support))
+		return false;
+	if (command_packet.Command == EARLY_FLASH_RESCUE_COMMAND_FILL) {
+		serial_fifo_write(&pattern, sizeof(pattern));
+		read_response(&response_packet);
+		if (response_packet.Acknowledge != 1)
+			return false;
+	}
+
+	estimate_record(ESTIMATE_FILL, start_ns, 1);
+	return true;
+}
+
+// Copy a block's worth from elsewhere on the board, instead of writing the block
+bool copy_block(uint32_t address, uint32_t src_address)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	uint64_t start_ns = estimate_clock();
+
+	if (copy_support == COMMAND_UNSUPPORTED)
+		return false;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_COPY;
+	command_packet.BlockNumber = (address / SIZE_BLOCK);
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Board acknowledges before its source address
+	if (!read_optional_response(&response_packet, &copy_support))
+		return false;
+
+	serial_fifo_write(&src_address, sizeof(src_address));
+	read_response(&response_packet);
+	if (response_packet.Acknowledge != 1)
+		return false;
+
+	estimate_record(ESTIMATE_COPY, start_ns, 1);
+	return true;
+}
+
+// Hold the session open for `idle_timeout_s`, while there is nothing to flash
+bool send_keepalive(uint16_t idle_timeout_s)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	if (keepalive_support == COMMAND_UNSUPPORTED)
+		return false;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_KEEPALIVE;
+	command_packet.BlockNumber = idle_timeout_s;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	return read_optional_response(&response_packet, &keepalive_support);
+}
+
+// Ask the board to send its DEBUG() output in log frames, rather than hold it
+void request_board_log(void)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_LOG;
+	command_packet.BlockNumber = 1;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	if (!read_optional_response(&response_packet, &log_support))
+		fprintf(session_out, "Board cannot send its log\n");
+}
+
+// Ask the board how large its buffers are, which bound staged batches
+// - Older boards do not answer, and stage whatever batch they can allocate
+void request_board_info(void)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	FLASH_RESCUE_BOARD_INFO info;
+	uint8_t discarded;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_INFO;
+	command_packet.BlockNumber = 0;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	if (!read_optional_response(&response_packet, &info_support))
+		return;
+
+	// Fields appended by later versions are skipped
+	memset(&info, 0, sizeof(info));
+	serial_fifo_read(&info, MIN(response_packet.Size, sizeof(info)));
+	for (size_t i = sizeof(info); i < response_packet.Size; i++)
+		serial_fifo_read(&discarded, sizeof(discarded));
+
+	fprintf(session_out, "Board has %u KiB of buffers, and stages up to %u blocks at once\n",
+		info.ArenaSize / 1024, info.StageBlocks);
+	stage_batch_blocks = MIN(info.StageBlocks, STAGE_BATCH_BLOCKS);
+	if (stage_batch_blocks == 0)
+		stage_support = COMMAND_UNSUPPORTED;
+}
+
+// Leave the board's polling loop. A modified board should be reset
+// - A stopped session may have left a command unfinished, so the board is left to time out
+void end_session(bool reset)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+
+	if (session_stopped())
+		return;
+	session_result()->board_reset = reset;
+
+	command_packet.Command =
+		reset ? EARLY_FLASH_RESCUE_COMMAND_RESET : EARLY_FLASH_RESCUE_COMMAND_EXIT;
+	command_packet.BlockNumber = 0;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+}
+
+// Load the image the board is believed to hold
+static uint8_t *load_reference(uint32_t image_blocks)
+{
+	FILE *reference_fp;
+	uint8_t *reference;
+	struct stat reference_stats;
+
+	reference_fp = fopen(reference_path, "r");
+	if (reference_fp == NULL)
+		return NULL;
+
+	fstat(fileno(reference_fp), &reference_stats);
+	reference = malloc((size_t)image_blocks * SIZE_BLOCK);
+	if (reference != NULL
+	    && (reference_stats.st_size != (off_t)image_blocks * SIZE_BLOCK
+		|| fread(reference, SIZE_BLOCK, image_blocks, reference_fp) != image_blocks)) {
+		free(reference);
+		reference = NULL;
+	}
+
+	fclose(reference_fp);
+	return reference;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+	uint32_t block_a = *(const uint32_t *)a;
+	uint32_t block_b = *(const uint32_t *)b;
+
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+// Read one block of the image. A short image fails the session
+void read_image_block(uint32_t block, void *data)
+{
+	fseek(bios_fp, (long)block * SIZE_BLOCK, SEEK_SET);
+	if (fread(data, SIZE_BLOCK, 1, bios_fp) != 1) {
+		fprintf(session_err, "\nCannot read block %u of the image!\n", block);
+		memset(data, 0, SIZE_BLOCK);
+		session_fail();
+	}
+}
+
+// Boards stage blocks in their buffers. Older PEI boards, in CAR, do not
+bool probe_staging(void)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+
+	// Without per-packet handshakes, a bridge's small buffers overflow
+	if (xfer_block_size != SIZE_BLOCK)
+		return false;
+
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_STAGE;
+	command_packet.BlockNumber = 0;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	if (!read_response_timeout(&response_packet, PROBE_TIMEOUT_MS))
+		return false;
+	return response_packet.Acknowledge == 1;
+}
+
+// Stream a batch of blocks for the board to stage, then program in one go
+bool stage_blocks(uint32_t *blocks, uint32_t count, uint8_t *stage_data)
+{
+	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	EARLY_FLASH_RESCUE_RESPONSE response_packet;
+	uint16_t block_numbers[STAGE_BATCH_BLOCKS];
+	uint64_t start_ns;
+
+	// Prepare the stream first, the board abandons a stalled one
+	for (uint32_t i = 0; i < count; i++) {
+		block_numbers[i] = blocks[i];
+		read_image_block(blocks[i], stage_data + i * SIZE_BLOCK);
+	}
+
+	start_ns = estimate_clock();
+	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_STAGE;
+	command_packet.BlockNumber = count;
+	serial_fifo_write(&command_packet, sizeof(command_packet));
+
+	// Board NACKs when it cannot allocate the batch
+	read_response(&response_packet);
+	if (response_packet.Acknowledge != 1)
+		return false;
+
+	serial_fifo_write(block_numbers, count * sizeof(block_numbers[0]));
+	serial_fifo_write(stage_data, count * SIZE_BLOCK);
+
+	// Board responds once every block is programmed
+	read_response(&response_packet);
+	if (response_packet.Acknowledge != 1 || response_packet.Size != count)
+		return false;
+
+	estimate_record(ESTIMATE_STAGE, start_ns, count);
+	return true;
+}
+
+// Receive the next block of a streamed image, spooling it for verification. False once it ends
+// - Holds the board's session open while the image is still being produced
+static bool receive_image_block(int stream_fd, uint32_t block, void *data, bool *torn)
+{
+	struct pollfd stream_poll = {.fd = stream_fd, .events = POLLIN};
+	size_t received = 0;
+	ssize_t status;
+
+	while (received < SIZE_BLOCK) {
+		if (poll(&stream_poll, 1, KEEPALIVE_INTERVAL_MS) == 0) {
+			send_keepalive(KEEPALIVE_IDLE_TIMEOUT_S);
+			continue;
+		}
+
+		status = read(stream_fd, (uint8_t *)data + received, SIZE_BLOCK - received);
+		if (status <= 0)
+			break;
+		received += status;
+	}
+
+	if (received == 0)
+		return false;
+
+	fseek(bios_fp, (long)block * SIZE_BLOCK, SEEK_SET);
+	if (received != SIZE_BLOCK || fwrite(data, SIZE_BLOCK, 1, bios_fp) != 1
+	    || fflush(bios_fp) != 0) {
+		*torn = true;
+		return false;
+	}
+	return true;
+}
+
+// Request every checksum the scan will need at once, rather than as it reaches each block
+// - Returns the block from which the scan requests them singly, as the board did not answer it
+static uint32_t prefetch_checksums(uint64_t *board_table, uint32_t first_block,
+				   uint32_t image_blocks, bool *selected,
+				   FLASH_RESCUE_MANIFEST *manifest)
+{
+	uint32_t *blocks;
+	uint32_t count = 0;
+	uint32_t answered;
+	uint32_t table_blocks;
+
+	blocks = malloc(image_blocks * sizeof(*blocks));
+	if (blocks == NULL)
+		return first_block;
+
+	// As the scan skips blocks outside the session, the manifest's own, and confirmed ones
+	for (uint32_t i = first_block; i < image_blocks; i++) {
+		if ((selected != NULL && !selected[i])
+		    || (manifest != NULL && i >= manifest->ManifestBlock
+			&& i < (uint32_t)manifest->ManifestBlock + manifest->ManifestBlockCount)
+		    || journal_block_state(i) != JOURNAL_BLOCK_PENDING)
+			continue;
+		blocks[count++] = i;
+	}
+
+	// The scan skips blocks that are not listed, so only the first unanswered one matters
+	answered = request_block_checksums(blocks, count, board_table, image_blocks);
+	table_blocks = (answered < count) ? blocks[answered] : image_blocks;
+	free(blocks);
+	return table_blocks;
+}
+
+// Execute: erase and fill constant blocks, then write modified blocks. Returns blocks written
+// - Boards that cannot fill constant blocks have them written instead
+static uint32_t execute_blocks(uint32_t *dirty_blocks, uint32_t dirty_count,
+			       struct constant_block *constant_blocks, uint32_t constant_count,
+			       uint32_t *filled_count, bool show_progress)
+{
+	uint32_t filled;
+	uint32_t written;
+	uint32_t batch;
+	uint8_t *stage_data;
+	uint8_t write_operation;
+	void *bios_block;
+
+	bios_block = malloc(SIZE_BLOCK);
+	if (bios_block == NULL)
+		return 0;
+
+	if (show_progress && constant_count != 0)
+		fprintf(session_out, "Erasing and filling...\n");
+	progress_start(FLASH_RESCUE_PHASE_FILL, constant_count,
+		       estimate_ms(ESTIMATE_FILL, constant_count));
+	filled = 0;
+	for (uint32_t i = 0; i < constant_count && !session_stopped(); i++) {
+		if (show_progress)
+			progress_update(i);
+
+		if (fill_block(constant_blocks[i].block * SIZE_BLOCK, constant_blocks[i].pattern)) {
+			journal_record(constant_blocks[i].block, JOURNAL_BLOCK_WRITTEN);
+			filled++;
+		} else {
+			dirty_blocks[dirty_count++] = constant_blocks[i].block;
+		}
 	}
+	if (show_progress && constant_count != 0)
+		fprintf(session_out, "\n");
+	*filled_count += filled;
+
+	// Staged blocks must be ascending
+	if (filled != constant_count)
+		qsort(dirty_blocks, dirty_count, sizeof(*dirty_blocks), compare_blocks);
+
+	// Plan: stream batches to a board that stages them, otherwise write singly
+	if (dirty_count != 0 && stage_support == COMMAND_UNKNOWN)
+		stage_support = probe_staging() ? COMMAND_SUPPORTED : COMMAND_UNSUPPORTED;
+	stage_data = NULL;
+	if (dirty_count != 0 && stage_support == COMMAND_SUPPORTED)
+		stage_data = malloc(MIN(dirty_count, stage_batch_blocks) * SIZE_BLOCK);
+	if (show_progress && stage_data != NULL)
+		fprintf(session_out, "Board stages blocks. Streaming %u modified blocks\n",
+			dirty_count);
+
+	if (show_progress)
+		fprintf(session_out, "Writing...\n");
+	write_operation = (stage_data != NULL) ? ESTIMATE_STAGE : ESTIMATE_WRITE;
+	progress_start(FLASH_RESCUE_PHASE_WRITE, dirty_count,
+		       estimate_ms(write_operation, dirty_count));
+	written = 0;
+	for (uint32_t i = 0; i < dirty_count && !session_stopped(); i += batch) {
+		if (show_progress)
+			progress_update(i);
+
+		batch = (stage_data != NULL) ? MIN(dirty_count - i, stage_batch_blocks) : 1;
+		if (stage_data != NULL) {
+			if (!stage_blocks(dirty_blocks + i, batch, stage_data)) {
+				fprintf(session_err,
+					"\nBoard could not stage blocks. Writing singly\n");
+				stage_support = COMMAND_UNSUPPORTED;
+				free(stage_data);
+				stage_data = NULL;
+				// Retry this batch
+				batch = 0;
+				continue;
+			}
+		} else {
+			tune_adapt();
+			read_image_block(dirty_blocks[i], bios_block);
+			if (!write_block(dirty_blocks[i] * SIZE_BLOCK, bios_block)) {
+				tune_note_error();
+				// Retry this block
+				batch = 0;
+				continue;
+			}
+		}
+
+		for (uint32_t j = 0; j < batch; j++)
+			journal_record(dirty_blocks[i + j], JOURNAL_BLOCK_WRITTEN);
+		written += batch;
+	}
+	if (show_progress)
+		fprintf(session_out, "\n");
+
+	free(stage_data);
+	free(bios_block);
+	return written;
+}
+
+// Predicted time to execute a plan, then verify it along with blocks an earlier session wrote
+static double predict_flash_ms(uint32_t dirty_count, uint32_t constant_count,
+			       uint32_t copy_count, double *verify_ms)
+{
+	uint8_t write_operation;
+	uint32_t verify_count;
+
+	write_operation = (stage_support == COMMAND_SUPPORTED) ? ESTIMATE_STAGE : ESTIMATE_WRITE;
+	verify_count = dirty_count + constant_count + copy_count
+		       + journal_count(JOURNAL_BLOCK_WRITTEN);
+	*verify_ms = estimate_ms(ESTIMATE_CHECKSUM, verify_count);
+	return estimate_ms(ESTIMATE_COPY, copy_count)
+	       + estimate_ms(ESTIMATE_FILL, constant_count)
+	       + estimate_ms(write_operation, dirty_count) + *verify_ms;
+}
+
+// Dry run: describe the plan, and how long executing it would take
+static void report_plan(uint32_t image_blocks, uint32_t *dirty_blocks, uint32_t dirty_count,
+			struct constant_block *constant_blocks, uint32_t constant_count,
+			struct copy_block *copies, uint32_t copy_count, double scan_ms)
+{
+	const char **actions;
+	uint32_t erased_count = 0;
+	uint32_t end;
+	double flash_ms, verify_ms;
+	char scan_time[16], flash_time[16], verify_time[16];
+
+	actions = calloc(image_blocks, sizeof(*actions));
+	if (actions == NULL)
+		return;
+	for (uint32_t i = 0; i < dirty_count; i++)
+		actions[dirty_blocks[i]] = "write";
+	for (uint32_t i = 0; i < copy_count; i++)
+		actions[copies[i].block] = "copy";
+	for (uint32_t i = 0; i < constant_count; i++) {
+		if (constant_blocks[i].pattern == 0xFF) {
+			actions[constant_blocks[i].block] = "erase";
+			erased_count++;
+		} else {
+			actions[constant_blocks[i].block] = "fill";
+		}
+	}
+
+	// Consecutive blocks flashed alike are reported as one range
+	fprintf(session_out, "Modified blocks:\n");
+	for (uint32_t i = 0; i < image_blocks; i = end) {
+		end = i + 1;
+		if (actions[i] == NULL)
+			continue;
+		while (end < image_blocks && actions[end] == actions[i])
+			end++;
+		fprintf(session_out, "  0x%08x-0x%08x %s, %u block%s\n", i * SIZE_BLOCK,
+			end * SIZE_BLOCK - 1, actions[i], end - i, (end - i == 1) ? "" : "s");
+	}
+	free(actions);
+
+	fprintf(session_out,
+		"Would write %u blocks (%.2f MiB to transfer), copy %u, fill %u and erase %u\n",
+		dirty_count, (float)dirty_count * SIZE_BLOCK / SIZE_MB, copy_count,
+		constant_count - erased_count, erased_count);
+	fprintf(session_out, "Would erase %u blocks in all\n",
+		dirty_count + copy_count + constant_count);
+
+	// A session scans as this one did, then executes and verifies
+	flash_ms = predict_flash_ms(dirty_count, constant_count, copy_count, &verify_ms);
+	estimate_format(scan_time, sizeof(scan_time), scan_ms);
+	estimate_format(flash_time, sizeof(flash_time), scan_ms + flash_ms);
+	estimate_format(verify_time, sizeof(verify_time), verify_ms);
+	fprintf(session_out,
+		"Estimated flash time: %s, of which %s scanning and %s verifying%s\n",
+		flash_time, scan_time, verify_time,
+		estimate_calibrated() ? "" : " (this port is not yet calibrated by a session)");
 }
 
-// Orchestrate flash operations
-void perform_flash(void)
+// Orchestrate flash operations: scan, plan, execute, then verify
+// - With `board_image`, the board is known to hold it and is not scanned
+// - A streamed image is executed as it arrives, so nothing is planned across it
+bool perform_flash(uint8_t *board_image)
 {
 	struct stat bios_fp_stats;
 	bool region_modified;
-	uint16_t modified_blocks;
+	bool streaming;
+	bool manifest_valid;
+	bool manifest_current;
+	FLASH_RESCUE_MANIFEST manifest;
+	bool stream_torn;
+	FILE *stream_fp;
+	uint32_t stream_window;
+	uint32_t image_blocks;
+	uint32_t image_crc;
+	uint32_t session_crc;
+	uint32_t resumed_blocks;
+	uint32_t *dirty_blocks;
+	uint32_t dirty_count;
+	uint32_t verify_count;
+	uint32_t block;
+	uint32_t written_count;
+	struct constant_block *constant_blocks;
+	uint32_t constant_count;
+	uint32_t filled_count;
+	uint8_t pattern;
+	struct block_digest *digests;
+	struct copy_block *copies;
+	uint32_t copy_count;
+	uint32_t copied_count;
+	uint8_t *reference;
+	uint64_t *board_table;
+	uint32_t board_table_blocks;
+	bool *selected;
+	uint64_t volatile_blocks;
 	void *bios_block;
 	time_t start_time, stop_time, diff_time;
-	size_t status;
-	uint32_t crc;
-	EARLY_FLASH_RESCUE_COMMAND command_packet;
+	uint64_t scan_start_ns;
+	double scan_ms, flash_ms, verify_ms;
+	char flash_time[16];
+	uint64_t digest;
+	uint64_t checksum;
+	struct flash_rescue_result *result = session_result();
 
-	// Determine size
+	// Determine size. A pipe's is only known once it ends
 	// - TODO: Check that region matches image by stashing total
 	fstat(fileno(bios_fp), &bios_fp_stats);
-	printf("BIOS image is %.2f MiB (%d blocks)\n", (float)bios_fp_stats.st_size / SIZE_MB,
-	       (int)bios_fp_stats.st_size / SIZE_BLOCK);
-	if (bios_fp_stats.st_size % SIZE_BLOCK != 0) {
-		printf("BIOS image is not a multiple of %d!", SIZE_BLOCK);
-		return;
+	streaming = !S_ISREG(bios_fp_stats.st_mode);
+	stream_fp = NULL;
+	if (streaming) {
+		stream_fp = bios_fp;
+		bios_fp = tmpfile();
+		if (bios_fp == NULL) {
+			bios_fp = stream_fp;
+			fprintf(session_err, "Cannot spool the streamed image!\n");
+			return false;
+		}
+		fprintf(session_out, "Streaming BIOS image, flashing as it arrives\n");
+		image_blocks = MAX_IMAGE_BLOCKS;
+	} else {
+		fprintf(session_out, "BIOS image is %.2f MiB (%d blocks)\n",
+			(float)bios_fp_stats.st_size / SIZE_MB,
+			(int)bios_fp_stats.st_size / SIZE_BLOCK);
+		if (bios_fp_stats.st_size % SIZE_BLOCK != 0) {
+			fprintf(session_out, "BIOS image is not a multiple of %d!", SIZE_BLOCK);
+			return false;
+		}
+		image_blocks = bios_fp_stats.st_size / SIZE_BLOCK;
 	}
 
-	// Write modified blocks
-	printf("Writing...\n");
-	region_modified = false;
-	modified_blocks = 0;
+	// Identify this image, so that an interrupted session can be resumed
 	bios_block = malloc(SIZE_BLOCK);
+	image_crc = crc32(0, NULL, 0);
+	for (uint32_t i = 0; i < image_blocks && !streaming; i++) {
+		read_image_block(i, bios_block);
+		image_crc = crc32(image_crc, bios_block, SIZE_BLOCK);
+	}
+
+	if (streaming && journal_path != NULL)
+		fprintf(session_err,
+			"A streamed image cannot be identified. Not journalling\n");
+	if (journal_open(streaming ? NULL : journal_path, image_crc, image_blocks, p_dev) != 0) {
+		fprintf(session_err, "Cannot open journal %s!\n", journal_path);
+		free(bios_block);
+		return false;
+	}
+	resumed_blocks = journal_count(JOURNAL_BLOCK_CLEAN) + journal_count(JOURNAL_BLOCK_WRITTEN);
+	if (resumed_blocks != 0)
+		fprintf(session_out, "Resuming session: %u blocks already confirmed\n",
+			resumed_blocks);
+
+	// Only the session's blocks are scanned and flashed. Volatile regions are not, unless requested
+	selected = NULL;
+	if (!streaming && region_select(image_blocks, &selected) == 0) {
+		fprintf(session_err, "No blocks to flash!\n");
+		free(selected);
+		free(bios_block);
+		journal_close(false);
+		return false;
+	}
+
+	// A manifest describes the blocks of one session, so they identify it too
+	session_crc = image_crc;
+	if (selected != NULL)
+		session_crc = crc32(image_crc, (uint8_t *)selected, image_blocks * sizeof(*selected));
+
+	// The board's previous image is a better reference than the one given
+	reference = NULL;
+	if (reference_path != NULL && board_image == NULL && !streaming) {
+		reference = load_reference(image_blocks);
+		if (reference == NULL)
+			fprintf(session_err, "Cannot use %s, it must match the image's size\n",
+				reference_path);
+	}
+
+	// Scan: find modified blocks
+	fprintf(session_out, "Scanning...\n");
+	region_modified = false;
+	dirty_blocks = calloc(image_blocks, sizeof(*dirty_blocks));
+	constant_blocks = malloc(image_blocks * sizeof(*constant_blocks));
+	digests = malloc(image_blocks * sizeof(*digests));
+	copies = malloc(image_blocks * sizeof(*copies));
+	if (dirty_blocks == NULL || constant_blocks == NULL || digests == NULL || copies == NULL) {
+		free(copies);
+		free(digests);
+		free(constant_blocks);
+		free(dirty_blocks);
+		free(reference);
+		free(selected);
+		free(bios_block);
+		journal_close(false);
+		return false;
+	}
+	dirty_count = 0;
+	written_count = 0;
+	constant_count = 0;
+	filled_count = 0;
+
+	// Streamed blocks are executed in small batches, so writes follow the stream closely
+	stream_window = 1;
+	stream_torn = false;
+	if (streaming && stage_support == COMMAND_UNKNOWN)
+		stage_support = probe_staging() ? COMMAND_SUPPORTED : COMMAND_UNSUPPORTED;
+	if (stage_support == COMMAND_SUPPORTED)
+		stream_window = MIN(STREAM_STAGE_BLOCKS, stage_batch_blocks);
+
+	volatile_blocks = 0;
 	time(&start_time);
-	for (int i = 0; i < bios_fp_stats.st_size; i += SIZE_BLOCK) {
-		draw_progress_bar(TO_PERCENTAGE(i, bios_fp_stats.st_size));
+	scan_start_ns = estimate_clock();
 
-		// Read this block
-		fseek(bios_fp, i, SEEK_SET);
-		status = fread(bios_block, SIZE_BLOCK, 1, bios_fp);
-		assert(status > 0);
+	// A board's manifest seeds its digest table, which the scan still requests
+	// - Volatile regions change at runtime, after it is stored, so flashing them reads all
+	manifest_valid = false;
+	manifest_current = false;
+	if (!streaming && board_image == NULL && !include_volatile && !ignore_manifest)
+		manifest_valid = request_manifest(&manifest);
+	if (manifest_valid && manifest.ImageCrc == session_crc && manifest.BlockCount >= image_blocks) {
+		fprintf(session_out, "Board's manifest describes this image\n");
+		manifest_current = true;
+	}
 
-		// Independent checksums
-		crc = crc32(0, bios_block, SIZE_BLOCK);
-		if (request_block_checksum(i) != crc) {
-			// TODO/NB: printf("0x%x\n", i);
-			write_block(i, bios_block);
+	// A board that has a digest table sends it in bulk, saving a round trip per block
+	board_table = NULL;
+	board_table_blocks = 0;
+	if (!streaming && board_image == NULL)
+		board_table = malloc(image_blocks * sizeof(*board_table));
+	if (board_table != NULL) {
+		progress_start(FLASH_RESCUE_PHASE_SCAN, image_blocks,
+			       estimate_ms(ESTIMATE_TABLE, image_blocks));
+		board_table_blocks = request_digest_table(board_table, image_blocks, selected);
+	}
+
+	scan_ms = 0;
+	if (board_image == NULL)
+		scan_ms = estimate_ms(ESTIMATE_CHECKSUM, image_blocks - board_table_blocks);
+	progress_start(FLASH_RESCUE_PHASE_SCAN, image_blocks, scan_ms);
+
+	// Beyond the table, checksums are requested in full duplex, keeping both directions busy
+	if (board_table != NULL && board_table_blocks < image_blocks)
+		board_table_blocks = prefetch_checksums(board_table, board_table_blocks,
+							image_blocks, selected,
+							manifest_valid ? &manifest : NULL);
+
+	for (uint32_t i = 0; i < image_blocks && !session_stopped(); i++) {
+		if (streaming) {
+			if (!receive_image_block(fileno(stream_fp), i, bios_block, &stream_torn)) {
+				image_blocks = i;
+				break;
+			}
+			fprintf(session_out, "\rReceived %u blocks", i + 1);
+			fflush(session_out);
+		} else {
+			progress_update(i);
+			read_image_block(i, bios_block);
+		}
+		digests[i].image = calculate_digest(digest_type, bios_block, SIZE_BLOCK);
+
+		// A stream's volatile regions are recognised by their headers, as they arrive
+		if (streaming && !include_volatile && volatile_blocks == 0) {
+			volatile_blocks = (fv_volatile_length(bios_block, SIZE_BLOCK) + SIZE_BLOCK - 1)
+					  / SIZE_BLOCK;
+			if (volatile_blocks != 0)
+				fprintf(session_out, "\nPreserving volatile region at 0x%x\n",
+					i * SIZE_BLOCK);
+		}
+		if (volatile_blocks != 0) {
+			volatile_blocks--;
+			digests[i].board_known = false;
+			continue;
+		}
+
+		// Blocks outside the session, and the manifest's own blocks, are left alone
+		if ((selected != NULL && !selected[i])
+		    || (manifest_valid && i >= manifest.ManifestBlock
+			&& i < (uint32_t)manifest.ManifestBlock + manifest.ManifestBlockCount)) {
+			digests[i].board_known = false;
+			continue;
+		}
+
+		// Confirmed by a previous session. Written blocks might be torn
+		digests[i].board = digests[i].image;
+		digests[i].board_known = (journal_block_state(i) == JOURNAL_BLOCK_CLEAN);
+		if (journal_block_state(i) != JOURNAL_BLOCK_PENDING)
+			continue;
+
+		// Independent checksums, unless the board's contents are known
+		digests[i].board_known = true;
+		if (board_image != NULL)
+			digests[i].board = calculate_digest(
+				digest_type, board_image + (size_t)i * SIZE_BLOCK, SIZE_BLOCK);
+		else if (i < board_table_blocks)
+			digests[i].board = board_table[i];
+		else
+			digests[i].board_known =
+				request_block_checksum(i * SIZE_BLOCK, &digests[i].board);
+
+		// Blocks the board cannot read are rewritten
+		if (digests[i].board_known && digests[i].board == digests[i].image) {
+			journal_record(i, JOURNAL_BLOCK_CLEAN);
+		} else if (is_constant(bios_block, SIZE_BLOCK, &pattern)) {
+			constant_blocks[constant_count].block = i;
+			constant_blocks[constant_count].pattern = pattern;
+			constant_count++;
+		} else {
+			dirty_blocks[dirty_count++] = i;
+		}
+
+		// Execute: while the rest of the image is still being produced
+		if (streaming && dirty_count + constant_count >= stream_window) {
+			written_count += execute_blocks(dirty_blocks, dirty_count, constant_blocks,
+							constant_count, &filled_count, false);
+			dirty_count = 0;
+			constant_count = 0;
+		}
+	}
+	fprintf(session_out, "\n");
+	free(board_table);
+	result->image_blocks = image_blocks;
+
+	if (streaming) {
+		// The board addresses at most `MAX_IMAGE_BLOCKS`
+		if (image_blocks == MAX_IMAGE_BLOCKS
+		    && receive_image_block(fileno(stream_fp), image_blocks, bios_block,
+					   &stream_torn))
+			stream_torn = true;
+		if (stream_torn) {
+			fprintf(session_err,
+				"Streamed image is not a multiple of %d, or too large!\n",
+				SIZE_BLOCK);
 			region_modified = true;
-			modified_blocks++;
 		}
+		fprintf(session_out, "BIOS image is %.2f MiB (%u blocks)\n",
+			(float)image_blocks * SIZE_BLOCK / SIZE_MB, image_blocks);
 	}
-	printf("\n");
 
-	if (!region_modified) {
-		command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_EXIT;
+	// Plan: copy blocks whose contents the board already holds
+	copy_count = 0;
+	if (!streaming)
+		copy_count = plan_copies(copies, dirty_blocks, &dirty_count, digests, image_blocks,
+					 (board_image != NULL) ? board_image : reference);
+
+	// Predict the rest of the session. Whether the board stages blocks is part of the plan
+	if (!streaming && dirty_count != 0 && stage_support == COMMAND_UNKNOWN)
+		stage_support = probe_staging() ? COMMAND_SUPPORTED : COMMAND_UNSUPPORTED;
+	if (dry_run) {
+		scan_ms = (estimate_clock() - scan_start_ns) / 1e6;
+		report_plan(image_blocks, dirty_blocks, dirty_count, constant_blocks,
+			    constant_count, copies, copy_count, scan_ms);
 		goto end;
 	}
+	if (!streaming && dirty_count + constant_count + copy_count != 0) {
+		flash_ms = predict_flash_ms(dirty_count, constant_count, copy_count, &verify_ms);
+		estimate_format(flash_time, sizeof(flash_time), flash_ms);
+		fprintf(session_out, "Estimated %s to flash and verify\n", flash_time);
+	}
 
-	// Perform verification
-	printf("Verifying...\n");
-	region_modified = false;
-	for (int i = 0; i < bios_fp_stats.st_size; i += SIZE_BLOCK) {
-		draw_progress_bar(TO_PERCENTAGE(i, bios_fp_stats.st_size));
+	// Execute: copy relocated blocks, before any of their sources are modified
+	if (copy_count != 0)
+		fprintf(session_out, "Copying %u relocated blocks...\n", copy_count);
+	progress_start(FLASH_RESCUE_PHASE_COPY, copy_count,
+		       estimate_ms(ESTIMATE_COPY, copy_count));
+	copied_count = 0;
+	for (uint32_t i = 0; i < copy_count && !session_stopped(); i++) {
+		progress_update(i);
 
-		// Read this block
-		fseek(bios_fp, i, SEEK_SET);
-		status = fread(bios_block, SIZE_BLOCK, 1, bios_fp);
-		assert(status > 0);
+		if (copy_block(copies[i].block * SIZE_BLOCK, copies[i].src_address)) {
+			journal_record(copies[i].block, JOURNAL_BLOCK_WRITTEN);
+			copied_count++;
+		} else {
+			dirty_blocks[dirty_count++] = copies[i].block;
+		}
+	}
+	if (copy_count != 0) {
+		fprintf(session_out, "\n");
+		qsort(dirty_blocks, dirty_count, sizeof(*dirty_blocks), compare_blocks);
+	}
+
+	written_count += execute_blocks(dirty_blocks, dirty_count, constant_blocks, constant_count,
+					&filled_count, !streaming);
+	result->written_blocks += written_count;
+	result->copied_blocks += copied_count;
+	result->filled_blocks += filled_count;
+
+	// Programming voids the board's manifest, so it is stored afresh
+	if (written_count + copied_count + filled_count != 0)
+		manifest_current = false;
+
+	// Blocks written by a previous session still require verification
+	if (journal_count(JOURNAL_BLOCK_WRITTEN) == 0)
+		goto end;
+	board_modified = true;
+
+	// Verify: unwritten blocks were just confirmed. Checksums are requested in full duplex
+	fprintf(session_out, "Verifying...\n");
+	progress_start(FLASH_RESCUE_PHASE_VERIFY, image_blocks,
+		       estimate_ms(ESTIMATE_CHECKSUM, journal_count(JOURNAL_BLOCK_WRITTEN)));
+	// Execution is done with its list of blocks
+	verify_count = 0;
+	for (uint32_t i = 0; i < image_blocks; i++) {
+		if (journal_block_state(i) == JOURNAL_BLOCK_WRITTEN)
+			dirty_blocks[verify_count++] = i;
+	}
+	board_table = malloc(image_blocks * sizeof(*board_table));
+	if (board_table == NULL
+	    || request_block_checksums(dirty_blocks, verify_count, board_table, image_blocks)
+		       != verify_count) {
+		if (!session_stopped())
+			fprintf(session_err, "\nCannot verify the written blocks!\n");
+		region_modified = true;
+		verify_count = 0;
+	}
+	for (uint32_t i = 0; i < verify_count && !session_stopped(); i++) {
+		block = dirty_blocks[i];
 
 		// Independent checksums
-		crc = crc32(0, bios_block, SIZE_BLOCK);
-		if (request_block_checksum(i) != crc) {
-			fprintf(stderr, "Verification FAILURE at 0x%x!\n", i);
+		read_image_block(block, bios_block);
+		digest = calculate_digest(digest_type, bios_block, SIZE_BLOCK);
+		checksum = board_table[block];
+		if (checksum != digest) {
+			fprintf(session_err, "Verification FAILURE at 0x%x!\n",
+				block * SIZE_BLOCK);
+			tune_note_error();
+			journal_record(block, JOURNAL_BLOCK_PENDING);
+			result->failed_blocks++;
 			region_modified = true;
+		} else {
+			journal_record(block, JOURNAL_BLOCK_CLEAN);
 		}
 	}
+	free(board_table);
 	time(&stop_time);
 	diff_time = stop_time - start_time;
-	printf("\nFlash operation took %ldm%lds\n", diff_time / 60, diff_time % 60);
-	printf("Wrote %d blocks\n", modified_blocks);
-
-	// Finalise
-	command_packet.Command = EARLY_FLASH_RESCUE_COMMAND_RESET;
+	fprintf(session_out, "\nFlash operation took %ldm%lds\n", diff_time / 60,
+		diff_time % 60);
+	fprintf(session_out, "Wrote %u blocks, copied %u blocks, erased or filled %u blocks\n",
+		written_count, copied_count, filled_count);
 
 end:
-	serial_fifo_write(&command_packet, sizeof(command_packet));
-	free(bios_block);
-
-	if (!region_modified)
-		printf("Flash operations completed successfully.\n");
-	else
-		fprintf(stderr, "Flash operations failed!\n");
-}
-
-// TODO: Win32 support; implement read and complete interface
-int main(int argc, char *argv[])
-{
-	int return_value;
+	// A stopped session's blocks are unconfirmed. Its journal resumes them
+	if (session_stopped())
+		region_modified = true;
 
-	// Print hello text
-	printf("Early BIOS flash rescue v%.2f (Userspace side)\n",
-	       EARLY_FLASH_RESCUE_PROTOCOL_VERSION);
-	printf("NB: Terminal must be closed as serial FIFO is racey\n\n");
+	// Streamed images cannot be identified, so a manifest would never be current
+	if (!region_modified && !streaming && !manifest_current && !dry_run
+	    && store_manifest(session_crc))
+		fprintf(session_out, "Board stored a manifest of this image\n");
 
-	// Step 1
-	return_value = initialise_userspace(argc, argv);
-	if (return_value != 0)
-		goto cleanup;
-
-	// Step 2
-	initialise_debug_port();
-
-	// Step 3
-	wait_for_hello();
-
-	// Step 4
-	perform_flash();
+	if (stream_fp != NULL)
+		fclose(stream_fp);
+	free(copies);
+	free(digests);
+	free(constant_blocks);
+	free(dirty_blocks);
+	free(reference);
+	free(selected);
+	free(bios_block);
+	journal_close(!region_modified && !dry_run);
+	estimate_save();
 
-cleanup:
-	// Step 5
-	if (bios_fp)
-		fclose(bios_fp);
-	if (implementation == 1)
-		bp_exit();
-	if (serial_dev)
-		close(serial_dev);
-	return return_value;
+	if (dry_run) {
+		fprintf(session_out, "Dry run: nothing was flashed.\n");
+	} else if (!region_modified) {
+		fprintf(session_out, "Flash operations completed successfully.\n");
+		result->flashes++;
+	} else {
+		fprintf(session_err, "Flash operations failed!\n");
+	}
+	return !region_modified;
 }
@@ -11,13 +11,44 @@
 #define SIZE_MB	     (1024 * 1024)
 #define MS_IN_SECOND 1000
 
-#define EARLY_FLASH_RESCUE_PROTOCOL_VERSION 0.50
-#define EARLY_FLASH_RESCUE_COMMAND_HELLO    0x10
-#define EARLY_FLASH_RESCUE_COMMAND_CHECKSUM 0x11
-#define EARLY_FLASH_RESCUE_COMMAND_READ	    0x12
-#define EARLY_FLASH_RESCUE_COMMAND_WRITE    0x13
-#define EARLY_FLASH_RESCUE_COMMAND_RESET    0x14
-#define EARLY_FLASH_RESCUE_COMMAND_EXIT	    0x15
+// Board addresses blocks with a UINT16
+#define MAX_IMAGE_BLOCKS 0x10000
+
+// Ping the board well within its idle timeout, while there is nothing to send
+#define KEEPALIVE_INTERVAL_MS	 2000
+#define KEEPALIVE_IDLE_TIMEOUT_S 30
+
+#define EARLY_FLASH_RESCUE_PROTOCOL_VERSION	  0.50
+#define EARLY_FLASH_RESCUE_COMMAND_HELLO	  0x10
+#define EARLY_FLASH_RESCUE_COMMAND_CHECKSUM	  0x11
+#define EARLY_FLASH_RESCUE_COMMAND_READ		  0x12
+#define EARLY_FLASH_RESCUE_COMMAND_WRITE	  0x13
+#define EARLY_FLASH_RESCUE_COMMAND_RESET	  0x14
+#define EARLY_FLASH_RESCUE_COMMAND_EXIT		  0x15
+#define EARLY_FLASH_RESCUE_COMMAND_DIGEST	  0x16
+#define EARLY_FLASH_RESCUE_COMMAND_STAGE	  0x17
+#define EARLY_FLASH_RESCUE_COMMAND_ERASE	  0x18
+#define EARLY_FLASH_RESCUE_COMMAND_FILL		  0x19
+#define EARLY_FLASH_RESCUE_COMMAND_COPY		  0x1A
+#define EARLY_FLASH_RESCUE_COMMAND_KEEPALIVE	  0x1B
+#define EARLY_FLASH_RESCUE_COMMAND_DIGEST_TABLE	  0x1C
+#define EARLY_FLASH_RESCUE_COMMAND_MANIFEST_READ  0x1D
+#define EARLY_FLASH_RESCUE_COMMAND_MANIFEST_STORE 0x1E
+#define EARLY_FLASH_RESCUE_COMMAND_LOG		  0x1F
+#define EARLY_FLASH_RESCUE_COMMAND_ECHO		  0x20
+#define EARLY_FLASH_RESCUE_COMMAND_SET_XFER	  0x21
+#define EARLY_FLASH_RESCUE_COMMAND_SET_BAUD	  0x22
+#define EARLY_FLASH_RESCUE_COMMAND_INFO		  0x23
+
+// SET_BAUD takes the rate in these units. The board reverts it, unless it is repeated in time
+#define BAUD_RATE_UNIT		100
+#define BAUD_SWITCH_DELAY_MS	10
+#define BAUD_CONFIRM_TIMEOUT_MS	3000
+
+// In place of `Acknowledge`: `Size` bytes of board log follow, then the awaited response
+#define EARLY_FLASH_RESCUE_LOG_FRAME 0x4C
+// In `Size` of a NACK: the board cannot serve this command at all, rather than this request
+#define EARLY_FLASH_RESCUE_NACK_UNSUPPORTED 0xFFFF
 
 #pragma pack(push, 1)
 typedef struct {
@@ -29,12 +60,63 @@ typedef struct {
 	uint8_t Acknowledge; // Usually, ACK == 0x01
 	uint16_t Size;	     // OPTIONAL?
 } EARLY_FLASH_RESCUE_RESPONSE;
+
+// Header of the manifest the board stores after a verified flash
+typedef struct {
+	uint32_t Signature;
+	uint8_t Version;
+	uint8_t DigestType;
+	uint16_t ManifestBlock; // Blocks holding the manifest, rather than the image
+	uint16_t ManifestBlockCount;
+	uint16_t Reserved;
+	uint32_t BlockCount;
+	uint32_t ImageCrc; // As supplied when the manifest was stored
+	uint32_t TableCrc;
+	uint8_t Reserved2[8];
+} FLASH_RESCUE_MANIFEST;
+
+// Board's answer to INFO. Later versions may append fields
+typedef struct {
+	uint8_t Version;
+	uint8_t Reserved;
+	uint16_t XferBlockSize;
+	uint32_t ArenaSize;   // Bytes of buffers, from NEM or DRAM
+	uint16_t StageBlocks; // Most blocks per STAGE
+	uint16_t Reserved2;
+} FLASH_RESCUE_BOARD_INFO;
 #pragma pack(pop)
 
-extern FILE *bios_fp;
-extern int serial_dev;
-extern char *p_dev;
-extern uint8_t implementation;
-extern bool implementation_high_speed;
+extern _Thread_local FILE *bios_fp;
+extern _Thread_local char *bios_path;
+extern _Thread_local int serial_dev;
+extern _Thread_local char *p_dev;
+extern _Thread_local uint8_t implementation;
+extern _Thread_local bool implementation_high_speed;
+extern _Thread_local char *journal_path;
+extern _Thread_local char *reference_path;
+extern _Thread_local bool watch_mode;
+extern _Thread_local bool include_volatile;
+extern _Thread_local bool ignore_manifest;
+extern _Thread_local bool board_modified;
+extern _Thread_local FILE *board_log_fp;
+extern _Thread_local uint8_t digest_type;
+extern _Thread_local uint16_t xfer_block_size;
+extern _Thread_local uint16_t xfer_window;
+extern _Thread_local bool autotune;
+extern _Thread_local bool dry_run;
+
+void initialise_debug_port(void);
+void wait_for_hello(void);
+void negotiate_digest(void);
+void request_board_log(void);
+void request_board_info(void);
+void read_image_block(uint32_t block, void *data);
+bool perform_flash(uint8_t *board_image);
+bool send_keepalive(uint16_t idle_timeout_s);
+bool send_packets(void *data, size_t size, int timeout_ms);
+bool echo_data(uint8_t *data, uint16_t size, uint8_t *echoed);
+bool set_xfer_size(uint16_t size);
+bool request_baud_rate(uint32_t baud);
+void end_session(bool reset);
 
 #endif
@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include "flash_rescue_userspace.h"
+#include "buspirate.h"
+#include "digest.h"
+#include "estimate.h"
+#include "flashrescue.h"
+#include "region.h"
+#include "session.h"
+#include "trace.h"
+#include "tune.h"
+#include "util.h"
+#include "watch.h"
+
+struct flash_rescue_session {
+	struct flash_rescue_config config;
+	struct flash_rescue_callbacks callbacks;
+	void *context;
+	pthread_t thread;
+	sem_t configured;
+	bool config_valid;
+	atomic_bool cancelled;
+
+	// Set by whichever of the session's threads the link fails on
+	atomic_bool failed;
+
+	// Only the session's thread uses these
+	FILE *discard_fp;
+	struct flash_rescue_result result;
+
+	// Events for the caller. The pipe is written once, until the caller collects them
+	int event_pipe[2];
+	pthread_mutex_t event_lock;
+	bool event_notified;
+	bool progress_pending;
+	struct flash_rescue_progress progress;
+	bool complete_pending;
+	bool complete_delivered;
+	struct flash_rescue_result final_result;
+};
+
+_Thread_local FILE *session_out;
+_Thread_local FILE *session_err;
+static _Thread_local struct flash_rescue_session *current;
+
+
+// An I/O failure ends the session. Exchanges with the board are abandoned from then on
+void session_fail(void)
+{
+	atomic_store(&current->failed, true);
+}
+
+bool session_failed(void)
+{
+	return atomic_load(&current->failed);
+}
+
+bool session_cancelled(void)
+{
+	return atomic_load(&current->cancelled);
+}
+
+// Whether the session must stop exchanging with the board
+bool session_stopped(void)
+{
+	return session_failed() || session_cancelled();
+}
+
+// Counts for the caller, kept up to date as the session runs
+struct flash_rescue_result *session_result(void)
+{
+	return &current->result;
+}
+
+// Wake the caller, unless it has yet to collect an earlier event. Call with the lock held
+static void notify_caller(struct flash_rescue_session *session)
+{
+	char event = 0;
+
+	if (!session->event_notified && write(session->event_pipe[1], &event, 1) == 1)
+		session->event_notified = true;
+}
+
+// Only the latest progress is kept, so a slow caller is not flooded
+void session_progress(const struct flash_rescue_progress *progress)
+{
+	pthread_mutex_lock(&current->event_lock);
+	current->progress = *progress;
+	current->progress_pending = true;
+	notify_caller(current);
+	pthread_mutex_unlock(&current->event_lock);
+}
+
+void session_save_context(struct session_context *context)
+{
+	context->session = current;
+	context->out = session_out;
+	context->err = session_err;
+	context->board_log = board_log_fp;
+	serial_save_context(&context->serial);
+	trace_save_context(&context->trace);
+}
+
+// Threads that a session starts act for it, until they exit. They do not close its files
+void session_adopt_context(const struct session_context *context)
+{
+	current = context->session;
+	session_out = context->out;
+	session_err = context->err;
+	board_log_fp = context->board_log;
+	serial_adopt_context(&context->serial);
+	trace_adopt_context(&context->trace);
+}
+
+static void close_session_files(struct flash_rescue_session *session)
+{
+	if (bios_fp != NULL && bios_fp != stdin)
+		fclose(bios_fp);
+	if (board_log_fp != NULL)
+		fclose(board_log_fp);
+	serial_close();
+	trace_close();
+	region_clear();
+	if (session->discard_fp != NULL)
+		fclose(session->discard_fp);
+}
+
+static bool image_is_file(void)
+{
+	struct stat bios_fp_stats;
+
+	return fstat(fileno(bios_fp), &bios_fp_stats) == 0 && S_ISREG(bios_fp_stats.st_mode);
+}
+
+// Apply the config to this thread's session, as the CLI's options did
+static bool configure_session(struct flash_rescue_session *session)
+{
+	const struct flash_rescue_config *config = &session->config;
+	bool restricted = false;
+	bool valid = true;
+	int digest;
+
+	if (config->output == NULL || config->errors == NULL)
+		session->discard_fp = fopen("/dev/null", "w");
+	session_out = (config->output != NULL) ? config->output : session->discard_fp;
+	session_err = (config->errors != NULL) ? config->errors : session->discard_fp;
+	serial_dev = -1;
+	if (session_out == NULL || session_err == NULL)
+		return false;
+
+	if (config->image_path != NULL) {
+		if (strcmp(config->image_path, "-") == 0)
+			bios_fp = stdin;
+		else
+			bios_fp = fopen(config->image_path, "r");
+		bios_path = (char *)config->image_path;
+	}
+	if (config->device != NULL) {
+		if (!serial_open((char *)config->device, B115200))
+			fprintf(session_err, "Cannot open %s\n", config->device);
+		p_dev = (char *)config->device;
+	}
+	if (config->mode != 0)
+		implementation = config->mode;
+	implementation_high_speed = config->high_speed;
+	journal_path = (char *)config->journal_path;
+	reference_path = (char *)config->reference_path;
+	watch_mode = config->watch;
+	include_volatile = config->include_volatile;
+	ignore_manifest = config->ignore_manifest;
+	autotune = config->autotune;
+	dry_run = config->dry_run;
+
+	for (const char **spec = config->include_regions; spec != NULL && *spec != NULL;
+	     spec++) {
+		if (!region_add((char *)*spec, false)) {
+			fprintf(session_err, "Unknown region %s\n", *spec);
+			valid = false;
+		}
+		restricted = true;
+	}
+	for (const char **spec = config->exclude_regions; spec != NULL && *spec != NULL;
+	     spec++) {
+		if (!region_add((char *)*spec, true) && !region_load_map((char *)*spec)) {
+			fprintf(session_err, "Unknown region or map %s\n", *spec);
+			valid = false;
+		}
+		restricted = true;
+	}
+	if (config->board_log_path != NULL) {
+		board_log_fp = fopen(config->board_log_path, "a");
+		if (board_log_fp == NULL) {
+			fprintf(session_err, "Cannot open board log %s\n",
+				config->board_log_path);
+			valid = false;
+		}
+	}
+	if (config->trace_path != NULL && trace_open((char *)config->trace_path) != 0) {
+		fprintf(session_err, "Cannot open trace %s\n", config->trace_path);
+		valid = false;
+	}
+	if (config->digest != NULL) {
+		digest = digest_from_name((char *)config->digest);
+		if (digest < 0) {
+			fprintf(session_err, "Unknown digest %s\n", config->digest);
+			valid = false;
+		} else {
+			digest_type = digest;
+		}
+	}
+	// Without these, there is no session at all
+	if (config->image_path == NULL)
+		fprintf(session_err, "No BIOS image given\n");
+	else if (bios_fp == NULL)
+		fprintf(session_err, "Cannot open BIOS image %s\n", config->image_path);
+	if (config->device == NULL)
+		fprintf(session_err, "No serial device given\n");
+	if (implementation == 0xFF)
+		fprintf(session_err, "No mode selected\n");
+	if (bios_fp == NULL || serial_dev < 0 || implementation == 0xFF)
+		return false;
+
+	// Rebuilds are watched for by name
+	if (watch_mode && !image_is_file()) {
+		fprintf(session_err, "Watching requires an image file, not a stream\n");
+		valid = false;
+	}
+
+	// Nothing is flashed, so a stream would be consumed for nothing
+	if (dry_run && (watch_mode || !image_is_file())) {
+		fprintf(session_err, "A dry run requires an image file, and cannot watch it\n");
+		valid = false;
+	}
+
+	// Volumes are located before flashing, in the whole image
+	if (restricted && !image_is_file()) {
+		fprintf(session_err,
+			"Restricting a session requires an image file, not a stream\n");
+		valid = false;
+	}
+
+	return valid;
+}
+
+static void *session_thread(void *arg)
+{
+	struct flash_rescue_session *session = arg;
+	uint64_t start_ns = estimate_clock();
+	bool flashed = false;
+	sigset_t sigpipe;
+
+	// A closed socket or pipe fails the session, rather than killing the caller
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+	current = session;
+	session->config_valid = configure_session(session);
+	if (!session->config_valid) {
+		close_session_files(session);
+		sem_post(&session->configured);
+		return NULL;
+	}
+	sem_post(&session->configured);
+
+	// Step 2
+	initialise_debug_port();
+
+	// Step 3
+	wait_for_hello();
+
+	// Step 4
+	if (!session_stopped()) {
+		if (autotune)
+			tune_link();
+		negotiate_digest();
+		request_board_log();
+		request_board_info();
+		if (watch_mode) {
+			flashed = watch_image(session->config.watch_control_fd);
+		} else {
+			flashed = perform_flash(NULL);
+			end_session(board_modified);
+		}
+	}
+
+	// Step 5
+	if (session_cancelled())
+		fprintf(session_err, "\nSession cancelled\n");
+	if (bp_in_use())
+		bp_exit();
+	close_session_files(session);
+
+	if (session_cancelled())
+		session->result.status = FLASH_RESCUE_CANCELLED;
+	else if (flashed && !session_failed())
+		session->result.status = FLASH_RESCUE_SUCCEEDED;
+	else
+		session->result.status = FLASH_RESCUE_FAILED;
+	session->result.elapsed_ms = (estimate_clock() - start_ns) / 1e6;
+
+	pthread_mutex_lock(&session->event_lock);
+	session->final_result = session->result;
+	session->complete_pending = true;
+	notify_caller(session);
+	pthread_mutex_unlock(&session->event_lock);
+	return NULL;
+}
+
+static void destroy_session(struct flash_rescue_session *session)
+{
+	sem_destroy(&session->configured);
+	pthread_mutex_destroy(&session->event_lock);
+	close(session->event_pipe[0]);
+	close(session->event_pipe[1]);
+	free(session);
+}
+
+struct flash_rescue_session *
+flash_rescue_session_start(const struct flash_rescue_config *config,
+			   const struct flash_rescue_callbacks *callbacks, void *context)
+{
+	struct flash_rescue_session *session;
+
+	session = calloc(1, sizeof(*session));
+	if (session == NULL)
+		return NULL;
+	session->config = *config;
+	if (callbacks != NULL)
+		session->callbacks = *callbacks;
+	session->context = context;
+	atomic_init(&session->cancelled, false);
+	atomic_init(&session->failed, false);
+
+	if (pipe2(session->event_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		free(session);
+		return NULL;
+	}
+	pthread_mutex_init(&session->event_lock, NULL);
+	sem_init(&session->configured, 0, 0);
+	if (pthread_create(&session->thread, NULL, session_thread, session) != 0) {
+		destroy_session(session);
+		return NULL;
+	}
+
+	// Configuring opens files, but does not await the board
+	while (sem_wait(&session->configured) != 0 && errno == EINTR)
+		;
+	if (!session->config_valid) {
+		pthread_join(session->thread, NULL);
+		destroy_session(session);
+		return NULL;
+	}
+	return session;
+}
+
+int flash_rescue_session_fd(struct flash_rescue_session *session)
+{
+	return session->event_pipe[0];
+}
+
+bool flash_rescue_session_step(struct flash_rescue_session *session)
+{
+	struct flash_rescue_progress progress;
+	struct flash_rescue_result result;
+	bool progress_pending, complete_pending;
+	char events[16];
+
+	pthread_mutex_lock(&session->event_lock);
+	while (read(session->event_pipe[0], events, sizeof(events)) > 0)
+		;
+	session->event_notified = false;
+	progress_pending = session->progress_pending;
+	progress = session->progress;
+	complete_pending = session->complete_pending;
+	result = session->final_result;
+	session->progress_pending = false;
+	session->complete_pending = false;
+	pthread_mutex_unlock(&session->event_lock);
+
+	if (progress_pending && session->callbacks.progress != NULL)
+		session->callbacks.progress(session, &progress, session->context);
+	if (complete_pending) {
+		session->complete_delivered = true;
+		if (session->callbacks.complete != NULL)
+			session->callbacks.complete(session, &result, session->context);
+	}
+	return !session->complete_delivered;
+}
+
+void flash_rescue_session_cancel(struct flash_rescue_session *session)
+{
+	if (session != NULL)
+		atomic_store(&session->cancelled, true);
+}
+
+void flash_rescue_session_free(struct flash_rescue_session *session)
+{
+	if (session == NULL)
+		return;
+	pthread_join(session->thread, NULL);
+	destroy_session(session);
+}
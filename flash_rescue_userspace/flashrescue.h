@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+// libflashrescue: flash boards from another program, several at once
+// - Each session runs on a thread of its own. Its callbacks run on the caller's thread,
+//   from flash_rescue_session_step(), so the caller needs no locking
+
+#ifndef FLASHRESCUE_H
+#define FLASHRESCUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define FLASH_RESCUE_PROTOCOL_VERSION 0.50
+
+// Implementation modes, as the bridge to the board requires
+#define FLASH_RESCUE_MODE_BUS_PIRATE	    1 // Text-mode debug port
+#define FLASH_RESCUE_MODE_BUS_PIRATE_BRIDGE 2 // Binary UART mode's transparent bridge
+#define FLASH_RESCUE_MODE_DIRECT	    254
+
+// Phases that progress is reported for
+enum flash_rescue_phase {
+	FLASH_RESCUE_PHASE_SCAN,
+	FLASH_RESCUE_PHASE_COPY,
+	FLASH_RESCUE_PHASE_FILL,
+	FLASH_RESCUE_PHASE_WRITE,
+	FLASH_RESCUE_PHASE_VERIFY,
+};
+
+enum flash_rescue_status {
+	FLASH_RESCUE_RUNNING,
+	FLASH_RESCUE_SUCCEEDED,
+	FLASH_RESCUE_FAILED,	// Board or image could not be flashed, or the link failed
+	FLASH_RESCUE_CANCELLED, // Stopped by flash_rescue_session_cancel()
+};
+
+// As the CLI's options. Strings must outlive the session. Zero leaves an option unset
+struct flash_rescue_config {
+	const char *image_path; // Image file, or "-" to stream it from stdin
+	const char *device;	// Serial port, or another transport, as `-d`
+	uint8_t mode;		// FLASH_RESCUE_MODE_*
+	bool high_speed;
+	const char *journal_path;
+	const char *reference_path;
+	const char **include_regions; // NULL-terminated, as `-o`
+	const char **exclude_regions; // NULL-terminated, as `-x`
+	bool include_volatile;
+	bool ignore_manifest;
+	const char *digest; // "crc32", "crc32c" or "crc64"
+	bool autotune;
+	bool dry_run;
+	bool watch;
+	// While watching, 'r' read from it resets the board, 'q' leaves it running. -1 if none
+	int watch_control_fd;
+	const char *board_log_path;
+	const char *trace_path;
+
+	// Messages, as the CLI prints them. NULL discards them
+	FILE *output;
+	FILE *errors;
+};
+
+struct flash_rescue_progress {
+	enum flash_rescue_phase phase;
+	uint32_t done;
+	uint32_t total;
+	double remaining_ms;
+	double bytes_per_second;
+};
+
+struct flash_rescue_result {
+	enum flash_rescue_status status;
+	uint32_t image_blocks;
+	uint32_t written_blocks;
+	uint32_t copied_blocks;
+	uint32_t filled_blocks;
+	uint32_t failed_blocks; // Failed verification
+	uint32_t flashes;	// Images flashed, of which a watching session may flash many
+	bool board_reset;
+	double elapsed_ms;
+};
+
+struct flash_rescue_session;
+
+// Each is optional. The result is only valid during the callback
+struct flash_rescue_callbacks {
+	void (*progress)(struct flash_rescue_session *session,
+			 const struct flash_rescue_progress *progress, void *context);
+	void (*complete)(struct flash_rescue_session *session,
+			 const struct flash_rescue_result *result, void *context);
+};
+
+// Opens the image and serial port, then the session awaits the board on its own thread
+// - Returns NULL, having described the problem to `config->errors`, for an invalid config
+struct flash_rescue_session *
+flash_rescue_session_start(const struct flash_rescue_config *config,
+			   const struct flash_rescue_callbacks *callbacks, void *context);
+
+// Readable whenever flash_rescue_session_step() has callbacks to run. Poll it with others
+int flash_rescue_session_fd(struct flash_rescue_session *session);
+
+// Runs pending callbacks without blocking. Returns whether the session is still running
+bool flash_rescue_session_step(struct flash_rescue_session *session);
+
+// Stops the session at its next exchange with the board. Async-signal-safe
+void flash_rescue_session_cancel(struct flash_rescue_session *session);
+
+// Waits for the session to stop, so cancel it first to free it early
+void flash_rescue_session_free(struct flash_rescue_session *session);
+
+#endif
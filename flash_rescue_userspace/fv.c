@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include "fv.h"
+
+// Fault-tolerant write working block header
+#define FTW_HEADER_SIZE	      32
+#define FTW_CRC_OFFSET	      16
+#define FTW_STATE_OFFSET      20
+#define FTW_QUEUE_SIZE_OFFSET 24
+
+// File systems whose files can be walked
+static const uint8_t ffs2_guid[GUID_SIZE] = { 0x78, 0xE5, 0x8C, 0x8C, 0x3D, 0x8A, 0x1C, 0x4F,
+					      0x99, 0x35, 0x89, 0x61, 0x85, 0xC3, 0x2D, 0xD3 };
+static const uint8_t ffs3_guid[GUID_SIZE] = { 0x7A, 0xC0, 0x73, 0x54, 0xCB, 0x3D, 0xCA, 0x4D,
+					      0xBD, 0x6F, 0x1E, 0x96, 0x89, 0xE7, 0x34, 0x9A };
+
+// Written by the board at runtime: the variable store's file system, and the FTW signature
+static const uint8_t nv_guid[GUID_SIZE] = { 0x8D, 0x2B, 0xF1, 0xFF, 0x96, 0x76, 0x8B, 0x4C,
+					    0xA9, 0x85, 0x27, 0x47, 0x07, 0x5B, 0x4F, 0x50 };
+static const uint8_t ftw_guid[GUID_SIZE] = { 0x2B, 0x29, 0x58, 0x9E, 0x68, 0x7C, 0x7D, 0x49,
+					     0xA0, 0xCE, 0x65, 0x00, 0xFD, 0x9F, 0x1B, 0x95 };
+
+// A NULL `guid` matches every file, and no volume
+struct fv_search {
+	uint8_t *image;
+	const uint8_t *guid;
+	struct fv_area *areas;
+	uint32_t max_areas;
+	uint32_t count;
+};
+
+
+uint16_t get16(const uint8_t *p)
+{
+	uint16_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+uint32_t get24(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+uint32_t get32(const uint8_t *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+uint64_t get64(const uint8_t *p)
+{
+	uint64_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// Parse "XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX" into the byte order of an image
+bool guid_from_string(const char *string, uint8_t *guid)
+{
+	unsigned int data1;
+	unsigned short data2, data3;
+	unsigned char data4[8];
+	int end = 0;
+
+	if (sscanf(string, "%8x-%4hx-%4hx-%2hhx%2hhx-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%n", &data1,
+		   &data2, &data3, &data4[0], &data4[1], &data4[2], &data4[3], &data4[4],
+		   &data4[5], &data4[6], &data4[7], &end)
+		    != 11
+	    || end != 36 || string[end] != '\0')
+		return false;
+
+	memcpy(guid, &data1, sizeof(uint32_t));
+	memcpy(guid + 4, &data2, sizeof(uint16_t));
+	memcpy(guid + 6, &data3, sizeof(uint16_t));
+	memcpy(guid + 8, data4, sizeof(data4));
+	return true;
+}
+
+// A firmware volume header, with a valid checksum, within the `available` bytes
+static bool is_fv_header(const uint8_t *fv, size_t available)
+{
+	uint16_t header_length;
+	uint16_t sum = 0;
+
+	if (available < FV_MIN_HEADER_LENGTH || get32(fv + FV_SIGNATURE_OFFSET) != FV_SIGNATURE)
+		return false;
+
+	header_length = get16(fv + FV_HEADER_LENGTH_OFFSET);
+	if (header_length < FV_MIN_HEADER_LENGTH || header_length % 2 != 0
+	    || header_length > available || get64(fv + FV_LENGTH_OFFSET) < header_length)
+		return false;
+
+	for (uint16_t i = 0; i < header_length; i += 2)
+		sum += get16(fv + i);
+	return sum == 0;
+}
+
+// A firmware volume at `offset`, which ends by `limit`
+static bool is_fv(const uint8_t *image, size_t limit, size_t offset)
+{
+	return offset < limit && is_fv_header(image + offset, limit - offset)
+	       && get64(image + offset + FV_LENGTH_OFFSET) <= limit - offset;
+}
+
+bool is_erased(const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] != 0xFF)
+			return false;
+	}
+	return true;
+}
+
+bool is_constant(const uint8_t *data, size_t size, uint8_t *pattern)
+{
+	for (size_t i = 1; i < size; i++) {
+		if (data[i] != data[0])
+			return false;
+	}
+
+	*pattern = data[0];
+	return true;
+}
+
+static void add_area(struct fv_search *search, size_t offset, size_t length)
+{
+	if (search->count >= search->max_areas)
+		return;
+
+	search->areas[search->count].offset = offset;
+	search->areas[search->count].length = length;
+	search->count++;
+}
+
+static void walk_fv(struct fv_search *search, size_t offset);
+
+// Volumes nested in an FV image file, unless they are compressed
+static void walk_sections(struct fv_search *search, size_t offset, size_t end)
+{
+	const uint8_t *section;
+	size_t section_size;
+	size_t header_size;
+
+	while (offset + SECTION_HEADER_SIZE <= end) {
+		section = search->image + offset;
+		section_size = get24(section);
+		header_size = SECTION_HEADER_SIZE;
+		if (section_size == 0xFFFFFF) {
+			if (offset + SECTION2_HEADER_SIZE > end)
+				return;
+			section_size = get32(section + SECTION_HEADER_SIZE);
+			header_size = SECTION2_HEADER_SIZE;
+		}
+		if (section_size < header_size || section_size > end - offset)
+			return;
+
+		if (section[SECTION_TYPE_OFFSET] == SECTION_TYPE_FV_IMAGE
+		    && is_fv(search->image, offset + section_size, offset + header_size))
+			walk_fv(search, offset + header_size);
+		offset = ALIGN_UP(offset + section_size, SECTION_ALIGNMENT);
+	}
+}
+
+// Match the volume, by its name or file system, then each of its files
+static void walk_fv(struct fv_search *search, size_t offset)
+{
+	uint8_t *fv = search->image + offset;
+	uint8_t *file;
+	size_t length = get64(fv + FV_LENGTH_OFFSET);
+	size_t file_offset = get16(fv + FV_HEADER_LENGTH_OFFSET);
+	size_t ext_offset = get16(fv + FV_EXT_HEADER_OFFSET);
+	size_t file_size;
+	size_t header_size;
+	bool named = false;
+
+	// Name is in the extended header, which files follow
+	if (ext_offset != 0 && ext_offset + GUID_SIZE + sizeof(uint32_t) <= length) {
+		named = search->guid != NULL
+			&& memcmp(fv + ext_offset, search->guid, GUID_SIZE) == 0;
+		file_offset = ext_offset + get32(fv + ext_offset + GUID_SIZE);
+	}
+	if (named
+	    || (search->guid != NULL
+		&& memcmp(fv + FV_FILE_SYSTEM_OFFSET, search->guid, GUID_SIZE) == 0))
+		add_area(search, offset, length);
+
+	if (memcmp(fv + FV_FILE_SYSTEM_OFFSET, ffs2_guid, GUID_SIZE) != 0
+	    && memcmp(fv + FV_FILE_SYSTEM_OFFSET, ffs3_guid, GUID_SIZE) != 0)
+		return;
+
+	for (file_offset = ALIGN_UP(file_offset, FV_ALIGNMENT);
+	     file_offset + FFS_HEADER_SIZE <= length;
+	     file_offset = ALIGN_UP(file_offset + file_size, FV_ALIGNMENT)) {
+		file = fv + file_offset;
+
+		// Free space follows the last file
+		if (is_erased(file, FFS_HEADER_SIZE))
+			return;
+
+		file_size = get24(file + FFS_SIZE_OFFSET);
+		header_size = FFS_HEADER_SIZE;
+		if (file[FFS_ATTRIBUTES_OFFSET] & FFS_ATTRIB_LARGE_FILE) {
+			if (file_offset + FFS2_HEADER_SIZE > length)
+				return;
+			file_size = get32(file + FFS_HEADER_SIZE);
+			header_size = FFS2_HEADER_SIZE;
+		}
+		if (file_size < header_size || file_size > length - file_offset)
+			return;
+
+		if (search->guid == NULL || memcmp(file, search->guid, GUID_SIZE) == 0)
+			add_area(search, offset + file_offset, file_size);
+		if (file[FFS_TYPE_OFFSET] == FFS_TYPE_FV_IMAGE)
+			walk_sections(search, offset + file_offset + header_size,
+				      offset + file_offset + file_size);
+	}
+}
+
+// Walk each volume of the image. Volumes are found at any 8-byte offset, so an image need
+// not begin with one
+static uint32_t search_image(struct fv_search *search, size_t size)
+{
+	size_t offset = 0;
+
+	while (offset < size) {
+		if (is_fv(search->image, size, offset)) {
+			walk_fv(search, offset);
+			offset += ALIGN_UP(get64(search->image + offset + FV_LENGTH_OFFSET),
+					   FV_ALIGNMENT);
+		} else {
+			offset += FV_ALIGNMENT;
+		}
+	}
+
+	return search->count;
+}
+
+// Locate the volumes and files named `guid`. Returns how many were found, up to `max_areas`
+uint32_t fv_find(uint8_t *image, size_t size, const uint8_t *guid, struct fv_area *areas,
+		 uint32_t max_areas)
+{
+	struct fv_search search = {
+		.image = image,
+		.guid = guid,
+		.areas = areas,
+		.max_areas = max_areas,
+		.count = 0,
+	};
+
+	return search_image(&search, size);
+}
+
+// Locate every FFS file, in the order they are stored. Returns how many, up to `max_areas`
+// - Files of nested volumes follow their FV image file
+uint32_t fv_find_files(uint8_t *image, size_t size, struct fv_area *areas, uint32_t max_areas)
+{
+	struct fv_search search = {
+		.image = image,
+		.guid = NULL,
+		.areas = areas,
+		.max_areas = max_areas,
+		.count = 0,
+	};
+
+	return search_image(&search, size);
+}
+
+// Length of a volatile area that begins at `data`: a variable store volume, or an FTW working
+// block. Only its header need be in the `available` bytes
+size_t fv_volatile_length(const uint8_t *data, size_t available)
+{
+	uint8_t header[FTW_HEADER_SIZE];
+
+	if (is_fv_header(data, available)
+	    && memcmp(data + FV_FILE_SYSTEM_OFFSET, nv_guid, GUID_SIZE) == 0)
+		return get64(data + FV_LENGTH_OFFSET);
+
+	if (available < FTW_HEADER_SIZE || memcmp(data, ftw_guid, GUID_SIZE) != 0)
+		return 0;
+
+	// Drivers hold the signature too. Its CRC omits the CRC and state, as if erased
+	memcpy(header, data, FTW_HEADER_SIZE);
+	memset(header + FTW_CRC_OFFSET, 0xFF, sizeof(uint32_t));
+	header[FTW_STATE_OFFSET] = 0xFF;
+	if (crc32(0, header, FTW_HEADER_SIZE) != get32(data + FTW_CRC_OFFSET))
+		return 0;
+	return FTW_HEADER_SIZE + get64(data + FTW_QUEUE_SIZE_OFFSET);
+}
+
+// Locate the areas that the board writes at runtime. Returns how many, up to `max_areas`
+// - FTW spare areas have no header, so are not found
+uint32_t fv_find_volatile(uint8_t *image, size_t size, struct fv_area *areas,
+			  uint32_t max_areas)
+{
+	size_t offset = 0;
+	size_t length;
+	uint32_t count = 0;
+
+	while (offset < size && count < max_areas) {
+		length = fv_volatile_length(image + offset, size - offset);
+		if (length == 0 || length > size - offset) {
+			offset += FV_ALIGNMENT;
+			continue;
+		}
+
+		areas[count].offset = offset;
+		areas[count].length = length;
+		count++;
+		offset += ALIGN_UP(length, FV_ALIGNMENT);
+	}
+
+	return count;
+}
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef FV_H
+#define FV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GUID_SIZE 16
+
+// Firmware volume header, as far as it is needed to walk the volume
+#define FV_FILE_SYSTEM_OFFSET	16
+#define FV_LENGTH_OFFSET	32
+#define FV_SIGNATURE_OFFSET	40
+#define FV_HEADER_LENGTH_OFFSET	48
+#define FV_EXT_HEADER_OFFSET	52
+#define FV_SIGNATURE		0x4856465F
+// Including one block map entry, and its terminator
+#define FV_MIN_HEADER_LENGTH 72
+#define FV_ALIGNMENT	     8
+
+// FFS file and section headers
+#define FFS_HEADER_SIZE	      24
+#define FFS2_HEADER_SIZE      32
+#define FFS_TYPE_OFFSET	      18
+#define FFS_ATTRIBUTES_OFFSET 19
+#define FFS_SIZE_OFFSET	      20
+#define FFS_ATTRIB_LARGE_FILE 0x01
+#define FFS_TYPE_FV_IMAGE     0x0B
+#define SECTION_HEADER_SIZE   4
+#define SECTION2_HEADER_SIZE  8
+#define SECTION_TYPE_OFFSET   3
+#define SECTION_TYPE_FV_IMAGE 0x17
+#define SECTION_ALIGNMENT     4
+
+#define ALIGN_UP(value, alignment) (((value) + (alignment)-1) & ~((size_t)(alignment)-1))
+
+// Bytes of the image occupied by a firmware volume or FFS file
+struct fv_area {
+	uint32_t offset;
+	uint32_t length;
+};
+
+// Little-endian fields, at any alignment
+uint16_t get16(const uint8_t *p);
+uint32_t get24(const uint8_t *p);
+uint32_t get32(const uint8_t *p);
+uint64_t get64(const uint8_t *p);
+// Every byte is as an erased flash leaves it
+bool is_erased(const uint8_t *data, size_t size);
+// Every byte is `pattern`, so sessions erase or fill rather than write
+bool is_constant(const uint8_t *data, size_t size, uint8_t *pattern);
+
+bool guid_from_string(const char *string, uint8_t *guid);
+uint32_t fv_find(uint8_t *image, size_t size, const uint8_t *guid, struct fv_area *areas,
+		 uint32_t max_areas);
+uint32_t fv_find_files(uint8_t *image, size_t size, struct fv_area *areas, uint32_t max_areas);
+size_t fv_volatile_length(const uint8_t *data, size_t available);
+uint32_t fv_find_volatile(uint8_t *image, size_t size, struct fv_area *areas,
+			  uint32_t max_areas);
+
+#endif
@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "flash_rescue_userspace.h"
+#include "journal.h"
+#include "session.h"
+
+static _Thread_local FILE *journal_fp;
+static _Thread_local char *journal_file;
+static _Thread_local uint8_t *block_states;
+static _Thread_local uint32_t journal_blocks;
+
+
+// Replay an existing journal, if it describes this image and board
+static bool journal_replay(FILE *fp, uint32_t image_crc, uint32_t image_blocks, char *board)
+{
+	char line[512];
+	unsigned int version, crc, blocks, block;
+	char state;
+
+	// Header must match exactly, or the recorded progress is meaningless
+	if (fgets(line, sizeof(line), fp) == NULL
+	    || sscanf(line, "flash_rescue journal %u", &version) != 1 || version != JOURNAL_VERSION)
+		return false;
+	if (fgets(line, sizeof(line), fp) == NULL
+	    || sscanf(line, "image %x %u", &crc, &blocks) != 2 || crc != image_crc
+	    || blocks != image_blocks)
+		return false;
+	if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, "board ", 6) != 0)
+		return false;
+	line[strcspn(line, "\n")] = 0;
+	if (strcmp(line + 6, board) != 0)
+		return false;
+
+	// Later records supersede earlier ones. A torn final record is ignored
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%c %u", &state, &block) != 2 || block >= image_blocks)
+			continue;
+		if (state == JOURNAL_BLOCK_PENDING || state == JOURNAL_BLOCK_WRITTEN
+		    || state == JOURNAL_BLOCK_CLEAN)
+			block_states[block] = state;
+	}
+
+	return true;
+}
+
+// Track progress of this session, resuming from `path` when it is given
+int journal_open(char *path, uint32_t image_crc, uint32_t image_blocks, char *board)
+{
+	FILE *fp;
+
+	journal_blocks = image_blocks;
+	block_states = malloc(image_blocks);
+	if (block_states == NULL)
+		return -1;
+	memset(block_states, JOURNAL_BLOCK_PENDING, image_blocks);
+
+	// Without a file, states only live for this session
+	if (path == NULL)
+		return 0;
+	journal_file = path;
+
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (!journal_replay(fp, image_crc, image_blocks, board)) {
+			fprintf(session_out,
+				"Journal %s is for another image or board. Starting afresh\n",
+				path);
+			memset(block_states, JOURNAL_BLOCK_PENDING, image_blocks);
+			fclose(fp);
+			fp = NULL;
+		} else {
+			fclose(fp);
+			journal_fp = fopen(path, "a");
+		}
+	}
+
+	if (fp == NULL) {
+		journal_fp = fopen(path, "w");
+		if (journal_fp == NULL)
+			return -1;
+		fprintf(journal_fp, "flash_rescue journal %u\n", JOURNAL_VERSION);
+		fprintf(journal_fp, "image %08x %u\n", image_crc, image_blocks);
+		fprintf(journal_fp, "board %s\n", board);
+		fflush(journal_fp);
+	}
+
+	return (journal_fp != NULL) ? 0 : -1;
+}
+
+// Record a block that the board has confirmed
+void journal_record(uint32_t block, uint8_t state)
+{
+	if (block >= journal_blocks)
+		return;
+
+	block_states[block] = state;
+	if (journal_fp == NULL)
+		return;
+
+	// Flush every record, a bumped cable must not lose confirmed blocks
+	fprintf(journal_fp, "%c %u\n", state, block);
+	fflush(journal_fp);
+}
+
+uint8_t journal_block_state(uint32_t block)
+{
+	if (block >= journal_blocks)
+		return JOURNAL_BLOCK_PENDING;
+	return block_states[block];
+}
+
+uint32_t journal_count(uint8_t state)
+{
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < journal_blocks; i++) {
+		if (block_states[i] == state)
+			count++;
+	}
+	return count;
+}
+
+// A complete session leaves nothing to resume
+void journal_close(bool session_complete)
+{
+	if (journal_fp != NULL) {
+		fclose(journal_fp);
+		journal_fp = NULL;
+		if (session_complete)
+			unlink(journal_file);
+	}
+
+	free(block_states);
+	block_states = NULL;
+	journal_blocks = 0;
+}
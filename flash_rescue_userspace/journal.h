@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOURNAL_VERSION 1
+
+// Per-block progress, as confirmed by the board
+#define JOURNAL_BLOCK_PENDING 'P' // Unknown; must be checksummed
+#define JOURNAL_BLOCK_WRITTEN 'W' // Written and acknowledged; must be verified
+#define JOURNAL_BLOCK_CLEAN   'C' // Board checksum matches image
+
+int journal_open(char *path, uint32_t image_crc, uint32_t image_blocks, char *board);
+void journal_record(uint32_t block, uint8_t state);
+uint8_t journal_block_state(uint32_t block);
+uint32_t journal_count(uint8_t state);
+void journal_close(bool session_complete);
+
+#endif
@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+// Command-line front end of libflashrescue
+
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "flashrescue.h"
+
+static const struct option long_options[] = {
+	{"dry-run", no_argument, NULL, 'n'},
+	{NULL, 0, NULL, 0},
+};
+
+static struct flash_rescue_session *session;
+
+
+// Might wait infinitely. Be polite and clean up if the user escapes
+static void sig_handler(int sig_num)
+{
+	(void)sig_num;
+	flash_rescue_session_cancel(session);
+}
+
+static void print_usage(char *name)
+{
+	printf("Usage: %s [OPTIONS]", name);
+	printf("\n");
+	printf("  -f <BIOS image; '-' streams it from stdin>\n");
+	printf("  -d <serial port, tcp:<host>:<port>, unix:<path>, pipe:<path> or "
+	       "fd:<read>,<write>>\n");
+	printf("  -m [mode]\n");
+	printf("  -s [high speed; OPTIONAL]\n");
+	printf("  -j <journal file; resumes an interrupted session; OPTIONAL>\n");
+	printf("  -c [crc32|crc32c|crc64; block digest; OPTIONAL]\n");
+	printf("  -r <image the board holds; finds relocated blocks; OPTIONAL>\n");
+	printf("  -w [watch; reflash whenever the image is rebuilt; OPTIONAL]\n");
+	printf("  -o <start:end, or FV or file GUID; flash only these; OPTIONAL>\n");
+	printf("  -x <start:end, FV or file GUID, or a map of these; leave alone; OPTIONAL>\n");
+	printf("  -V [flash volatile regions, such as the variable store; OPTIONAL]\n");
+	printf("  -i [ignore the board's manifest; scan as if it had none; OPTIONAL]\n");
+	printf("  -l <board log file; otherwise printed; OPTIONAL>\n");
+	printf("  -t <trace file; records the session for replay; OPTIONAL>\n");
+	printf("  -a [autotune the link, remembering the result per port; OPTIONAL]\n");
+	printf("  -n, --dry-run [scan only; report what would be flashed, and how long; "
+	       "OPTIONAL]\n");
+	printf("\n");
+	printf("Implementation modes:\n");
+	printf("  1: Bus Pirate\n");
+	printf("  2: Bus Pirate, binary UART bridge\n");
+	printf("  254: (No initialisation or quirks required)\n");
+	printf("  255: (Reserved - MAX)\n");
+}
+
+static void session_complete(struct flash_rescue_session *completed_session,
+			     const struct flash_rescue_result *result, void *context)
+{
+	(void)completed_session;
+	*(enum flash_rescue_status *)context = result->status;
+}
+
+int main(int argc, char *argv[])
+{
+	struct flash_rescue_config config = {
+		.watch_control_fd = STDIN_FILENO,
+		.output = stdout,
+		.errors = stderr,
+	};
+	struct flash_rescue_callbacks callbacks = {.complete = session_complete};
+	enum flash_rescue_status status = FLASH_RESCUE_RUNNING;
+	const char **include_regions;
+	const char **exclude_regions;
+	int include_count = 0, exclude_count = 0;
+	struct pollfd session_poll;
+	int opt;
+
+	// Print hello text
+	printf("Early BIOS flash rescue v%.2f (Userspace side)\n",
+	       FLASH_RESCUE_PROTOCOL_VERSION);
+	printf("NB: Terminal must be closed as serial FIFO is racey\n\n");
+
+	// Each option names at most one region
+	include_regions = calloc(argc + 1, sizeof(*include_regions));
+	exclude_regions = calloc(argc + 1, sizeof(*exclude_regions));
+	if (include_regions == NULL || exclude_regions == NULL) {
+		free(include_regions);
+		free(exclude_regions);
+		return 1;
+	}
+	config.include_regions = include_regions;
+	config.exclude_regions = exclude_regions;
+
+	// Step 1
+	while ((opt = getopt_long(argc, argv, "f:d:m:sj:c:r:wo:x:Vil:t:an", long_options, NULL))
+	       != -1) {
+		// Required parameter is in global "optarg"
+		switch (opt) {
+		case 'f':
+			config.image_path = optarg;
+			break;
+		case 'd':
+			config.device = optarg;
+			break;
+		case 'm':
+			config.mode = atoi(optarg);
+			break;
+		case 's':
+			config.high_speed = true;
+			break;
+		case 'j':
+			config.journal_path = optarg;
+			break;
+		case 'r':
+			config.reference_path = optarg;
+			break;
+		case 'w':
+			config.watch = true;
+			break;
+		case 'o':
+			include_regions[include_count++] = optarg;
+			break;
+		case 'x':
+			exclude_regions[exclude_count++] = optarg;
+			break;
+		case 'V':
+			config.include_volatile = true;
+			break;
+		case 'i':
+			config.ignore_manifest = true;
+			break;
+		case 'l':
+			config.board_log_path = optarg;
+			break;
+		case 't':
+			config.trace_path = optarg;
+			break;
+		case 'a':
+			config.autotune = true;
+			break;
+		case 'n':
+			config.dry_run = true;
+			break;
+		case 'c':
+			config.digest = optarg;
+			break;
+		default:
+			config.mode = 0;
+			break;
+		}
+	}
+
+	// Steps 2 to 4 run in the session
+	session = flash_rescue_session_start(&config, &callbacks, &status);
+	if (session == NULL) {
+		print_usage(argv[0]);
+		free(include_regions);
+		free(exclude_regions);
+		return 1;
+	}
+	signal(SIGINT, sig_handler);
+
+	session_poll.fd = flash_rescue_session_fd(session);
+	session_poll.events = POLLIN;
+	while (flash_rescue_session_step(session))
+		poll(&session_poll, 1, -1);
+	signal(SIGINT, SIG_DFL);
+
+	// Step 5
+	flash_rescue_session_free(session);
+	free(include_regions);
+	free(exclude_regions);
+	return (status == FLASH_RESCUE_SUCCEEDED) ? 0 : 2;
+}
@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flash_rescue_userspace.h"
+#include "fv.h"
+#include "region.h"
+#include "session.h"
+
+// An address range, or the volumes and files named by a GUID
+struct region {
+	char *spec;
+	bool exclude;
+	bool named;
+	uint8_t guid[GUID_SIZE];
+	uint32_t start; // Inclusive addresses in BIOS region
+	uint32_t end;
+};
+
+static _Thread_local struct region *regions;
+static _Thread_local uint32_t region_count;
+
+
+// Restrict sessions to "<start>:<end>", or to the volumes and files named by a GUID
+// - Excluded regions are left alone, even within a region that is included
+bool region_add(char *spec, bool exclude)
+{
+	struct region region = { .exclude = exclude };
+	struct region *grown;
+	char *separator;
+	char *end;
+	unsigned long start, last;
+
+	if (guid_from_string(spec, region.guid)) {
+		region.named = true;
+	} else {
+		start = strtoul(spec, &separator, 0);
+		if (separator == spec || *separator != ':')
+			return false;
+		last = strtoul(separator + 1, &end, 0);
+		if (end == separator + 1 || *end != '\0' || last < start || last > UINT32_MAX)
+			return false;
+		region.start = start;
+		region.end = last;
+	}
+
+	// Regions keep their spec, for messages
+	region.spec = strdup(spec);
+	grown = realloc(regions, (region_count + 1) * sizeof(*regions));
+	if (region.spec == NULL || grown == NULL) {
+		free(region.spec);
+		return false;
+	}
+	regions = grown;
+	regions[region_count++] = region;
+	return true;
+}
+
+// Exclude each region listed in a map file, one per line. Text after the region, and lines
+// starting with '#', are ignored
+bool region_load_map(char *path)
+{
+	FILE *fp;
+	char line[256];
+	char spec[64];
+	bool valid = true;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return false;
+
+	while (valid && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%63s", spec) != 1 || spec[0] == '#')
+			continue;
+
+		valid = region_add(spec, true);
+		if (!valid)
+			fprintf(session_err, "Unknown region %s in %s\n", spec, path);
+	}
+
+	fclose(fp);
+	return valid;
+}
+
+// Mark the blocks overlapping bytes [start, end) of the image
+static void mark_bytes(bool *selected, uint32_t image_blocks, uint64_t start, uint64_t end,
+		       bool value)
+{
+	for (uint64_t block = start / SIZE_BLOCK; block < image_blocks && block * SIZE_BLOCK < end;
+	     block++)
+		selected[block] = value;
+}
+
+// Mark the region in `selected`, excluding or including its blocks
+static void mark_region(struct region *region, uint8_t *image, uint32_t image_blocks,
+			bool *selected)
+{
+	struct fv_area areas[MAX_REGION_AREAS];
+	size_t size = (size_t)image_blocks * SIZE_BLOCK;
+	uint32_t count;
+
+	if (!region->named) {
+		if (region->start >= size)
+			fprintf(session_err, "%s is beyond the image\n", region->spec);
+		mark_bytes(selected, image_blocks, region->start, (uint64_t)region->end + 1,
+			   !region->exclude);
+		return;
+	}
+
+	count = fv_find(image, size, region->guid, areas, MAX_REGION_AREAS);
+	if (count == 0)
+		fprintf(session_err, "%s is not a volume or file in the image\n", region->spec);
+	for (uint32_t i = 0; i < count; i++) {
+		fprintf(session_out, "%s %s is 0x%x bytes at 0x%x\n",
+			region->exclude ? "Excluding" : "Including", region->spec,
+			areas[i].length, areas[i].offset);
+		mark_bytes(selected, image_blocks, areas[i].offset,
+			   (uint64_t)areas[i].offset + areas[i].length, !region->exclude);
+	}
+}
+
+// Mark the blocks a session is restricted to. Returns how many there are
+// - Unless every block is in the session, `selected` marks them. Otherwise it is NULL
+// - Volatile regions are excluded, unless `include_volatile`
+uint32_t region_select(uint32_t image_blocks, bool **selected)
+{
+	struct fv_area areas[MAX_REGION_AREAS];
+	size_t size = (size_t)image_blocks * SIZE_BLOCK;
+	uint8_t *image;
+	bool restricted = false;
+	uint32_t count;
+	uint32_t selected_count = 0;
+
+	*selected = calloc(image_blocks, sizeof(**selected));
+	image = malloc(size);
+	if (*selected == NULL || image == NULL) {
+		fprintf(session_err, "Cannot read the image to locate its regions!\n");
+		free(image);
+		return 0;
+	}
+
+	// Volumes are located by parsing the image
+	for (uint32_t block = 0; block < image_blocks; block++)
+		read_image_block(block, image + (size_t)block * SIZE_BLOCK);
+
+	// Included regions, then excluded ones
+	for (uint32_t i = 0; i < region_count; i++)
+		restricted |= !regions[i].exclude;
+	if (!restricted)
+		memset(*selected, true, image_blocks * sizeof(**selected));
+	for (uint32_t i = 0; i < region_count; i++) {
+		if (!regions[i].exclude)
+			mark_region(&regions[i], image, image_blocks, *selected);
+	}
+	for (uint32_t i = 0; i < region_count; i++) {
+		if (regions[i].exclude)
+			mark_region(&regions[i], image, image_blocks, *selected);
+	}
+
+	// Board writes these at runtime, so they never match a build
+	count = include_volatile ? 0 : fv_find_volatile(image, size, areas, MAX_REGION_AREAS);
+	for (uint32_t i = 0; i < count; i++) {
+		fprintf(session_out, "Preserving volatile region, 0x%x bytes at 0x%x\n",
+			areas[i].length, areas[i].offset);
+		mark_bytes(*selected, image_blocks, areas[i].offset,
+			   (uint64_t)areas[i].offset + areas[i].length, false);
+	}
+	free(image);
+
+	for (uint32_t block = 0; block < image_blocks; block++) {
+		if ((*selected)[block])
+			selected_count++;
+	}
+	if (selected_count == image_blocks) {
+		free(*selected);
+		*selected = NULL;
+	} else {
+		fprintf(session_out, "Restricting session to %u of %u blocks\n", selected_count,
+			image_blocks);
+	}
+	return selected_count;
+}
+
+// Forget the session's regions
+void region_clear(void)
+{
+	for (uint32_t i = 0; i < region_count; i++)
+		free(regions[i].spec);
+	free(regions);
+	regions = NULL;
+	region_count = 0;
+}
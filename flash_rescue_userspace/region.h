@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Volumes and files that one GUID may name
+#define MAX_REGION_AREAS 64
+
+bool region_add(char *spec, bool exclude);
+bool region_load_map(char *path);
+uint32_t region_select(uint32_t image_blocks, bool **selected);
+void region_clear(void);
+
+#endif
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "flashrescue.h"
+#include "trace.h"
+#include "util.h"
+
+// Blocking reads wake this often, to notice that the session was cancelled
+#define SESSION_POLL_MS 100
+
+// Messages of the session running on this thread
+extern _Thread_local FILE *session_out;
+extern _Thread_local FILE *session_err;
+
+// Threads that a session starts share its messages, link and trace
+struct session_context {
+	struct flash_rescue_session *session;
+	FILE *out;
+	FILE *err;
+	FILE *board_log;
+	struct serial_context serial;
+	struct trace_context trace;
+};
+
+void session_fail(void);
+bool session_failed(void);
+bool session_cancelled(void);
+bool session_stopped(void);
+struct flash_rescue_result *session_result(void);
+void session_progress(const struct flash_rescue_progress *progress);
+void session_save_context(struct session_context *context);
+void session_adopt_context(const struct session_context *context);
+
+#endif
@@ -0,0 +1,416 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+// Emulates a Bus Pirate v3 over a PTY, bridging to a board's serial port, so the host's Bus
+// Pirate modes can be tested and timed without the device
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// A host that sends nothing for this long has stopped
+#define HOST_IDLE_TIMEOUT_MS 30000
+
+// Zero bytes that enter binary mode from the console
+#define BINARY_RESETS 20
+
+// Bytes that might begin F12 are held this long for the rest of it, then bridged
+#define ESCAPE_TIMEOUT_MS 10
+
+enum emulator_state {
+	STATE_CONSOLE,
+	STATE_AWAIT_SPACE, // Baud rate changed, until the user presses space
+	STATE_DEBUG_BRIDGE,
+	STATE_BINARY,
+	STATE_BINARY_UART,
+	STATE_UART_BRIDGE,
+};
+
+// Console menus that take the next line as their answer
+enum emulator_menu {
+	MENU_NONE,
+	MENU_MODE,
+	MENU_I2C_SPEED,
+	MENU_BAUD,
+	MENU_BRG,
+};
+
+static const uint8_t debug_port_exit[] = {0x1B, 0x5B, 0x32, 0x34, 0x7E};
+
+static enum emulator_state state = STATE_CONSOLE;
+static enum emulator_menu menu = MENU_NONE;
+static char *mode_name = "HiZ";
+static char line[64];
+static size_t line_length;
+static uint32_t zero_bytes;
+static size_t exit_matched;
+static int answer_latency_ms = 2;
+static uint32_t console_answers, bridged_to_board, bridged_to_host;
+
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void write_all(int fd, const void *data, size_t length)
+{
+	ssize_t status;
+
+	while (length != 0) {
+		status = write(fd, data, length);
+		if (status <= 0)
+			return;
+		data = (const uint8_t *)data + status;
+		length -= status;
+	}
+}
+
+// The device takes a moment to act on each command
+static void answer(int pty, const char *text, size_t length)
+{
+	usleep(answer_latency_ms * 1000);
+	write_all(pty, text, length);
+	console_answers++;
+}
+
+static void answer_text(int pty, const char *text)
+{
+	answer(pty, text, strlen(text));
+}
+
+static void prompt(int pty)
+{
+	char text[16];
+
+	if (menu == MENU_MODE || menu == MENU_I2C_SPEED)
+		snprintf(text, sizeof(text), "(1)>");
+	else if (menu == MENU_BAUD)
+		snprintf(text, sizeof(text), "(9)>");
+	else if (menu == MENU_BRG)
+		snprintf(text, sizeof(text), "(34)>");
+	else
+		snprintf(text, sizeof(text), "%s>", mode_name);
+	answer_text(pty, text);
+}
+
+// Act on a line typed at the console
+static void run_line(int pty)
+{
+	line[line_length] = 0;
+	line_length = 0;
+
+	switch (menu) {
+	case MENU_MODE:
+		menu = MENU_NONE;
+		if (strcmp(line, "4") == 0) {
+			answer_text(pty, "Set speed:\r\n 1. ~5KHz\r\n 2. ~50KHz\r\n"
+					 " 3. ~100KHz\r\n 4. ~400KHz\r\n");
+			menu = MENU_I2C_SPEED;
+		} else if (strcmp(line, "1") == 0) {
+			mode_name = "HiZ";
+		} else {
+			answer_text(pty, "Invalid choice, try again\r\n");
+			menu = MENU_MODE;
+		}
+		break;
+	case MENU_I2C_SPEED:
+		menu = MENU_NONE;
+		mode_name = "I2C";
+		answer_text(pty, "Ready\r\n");
+		break;
+	case MENU_BAUD:
+	case MENU_BRG:
+		if (menu == MENU_BAUD && strcmp(line, "10") == 0) {
+			answer_text(pty, "Enter raw value for BRG\r\n");
+			menu = MENU_BRG;
+			break;
+		}
+
+		// A PTY has no baud rate. Only the exchange is emulated
+		menu = MENU_NONE;
+		answer_text(pty, "Adjust your terminal\r\nSpace to continue\r\n");
+		state = STATE_AWAIT_SPACE;
+		return;
+	case MENU_NONE:
+		if (line[0] == 0) {
+			break;
+		} else if (strcmp(line, "#") == 0) {
+			mode_name = "HiZ";
+			answer_text(pty, "RESET\r\n\r\nBus Pirate v3b (emulated)\r\n"
+					 "Firmware v5.10 (r559)  Bootloader v4.4\r\n");
+		} else if (strcmp(line, "m") == 0) {
+			answer_text(pty, "1. HiZ\r\n2. 1-WIRE\r\n3. UART\r\n4. I2C\r\n");
+			menu = MENU_MODE;
+		} else if (strcmp(line, "b") == 0) {
+			answer_text(pty, "Set serial port speed: (bps)\r\n 9. 115200\r\n"
+					 "10. BRG raw value\r\n");
+			menu = MENU_BAUD;
+		} else if (strcmp(line, "(5)") == 0 && strcmp(mode_name, "I2C") == 0) {
+			answer_text(pty, "Debug port bridge, F12 to exit\r\n");
+			state = STATE_DEBUG_BRIDGE;
+			exit_matched = 0;
+			return;
+		} else {
+			answer_text(pty, "Syntax error\r\n");
+		}
+		break;
+	}
+	prompt(pty);
+}
+
+static void console_byte(int pty, uint8_t byte)
+{
+	// Binary mode is entered by zero bytes, which are not echoed
+	if (byte == 0) {
+		if (++zero_bytes == BINARY_RESETS) {
+			answer_text(pty, "BBIO1");
+			state = STATE_BINARY;
+			line_length = 0;
+		}
+		return;
+	}
+	zero_bytes = 0;
+
+	if (byte == '\r' || byte == '\n') {
+		write_all(pty, "\r\n", 2);
+		run_line(pty);
+		return;
+	}
+	write_all(pty, &byte, 1);
+	if (line_length < sizeof(line) - 1)
+		line[line_length++] = byte;
+}
+
+// Binary modes answer each command byte
+static void binary_byte(int pty, uint8_t byte)
+{
+	const char ok = 0x01;
+
+	if (state == STATE_BINARY) {
+		if (byte == 0x00) {
+			answer_text(pty, "BBIO1");
+		} else if (byte == 0x03) {
+			answer_text(pty, "ART1");
+			state = STATE_BINARY_UART;
+		} else if (byte == 0x0F) {
+			state = STATE_CONSOLE;
+			mode_name = "HiZ";
+			zero_bytes = 0;
+			answer(pty, &ok, 1);
+		}
+		return;
+	}
+
+	if (byte == 0x00) {
+		answer_text(pty, "BBIO1");
+		state = STATE_BINARY;
+	} else if (byte == 0x01) {
+		answer_text(pty, "ART1");
+	} else if (byte == 0x0F) {
+		// Bridge does not answer, and lasts until reset
+		state = STATE_UART_BRIDGE;
+	} else {
+		answer(pty, &ok, 1);
+	}
+}
+
+// Bytes that only began F12 were meant for the board
+static void release_escape(int board)
+{
+	write_all(board, debug_port_exit, exit_matched);
+	bridged_to_board += exit_matched;
+	exit_matched = 0;
+}
+
+// Host's bytes through the debug port, except F12, which leaves it
+static void debug_bridge_byte(int pty, int board, uint8_t byte)
+{
+	if (byte != debug_port_exit[exit_matched])
+		release_escape(board);
+	if (byte == debug_port_exit[exit_matched]) {
+		if (++exit_matched == sizeof(debug_port_exit)) {
+			state = STATE_CONSOLE;
+			exit_matched = 0;
+			write_all(pty, "\r\n", 2);
+		}
+		return;
+	}
+
+	write_all(board, &byte, 1);
+	bridged_to_board++;
+}
+
+static void host_byte(int pty, int board, uint8_t byte)
+{
+	switch (state) {
+	case STATE_CONSOLE:
+		console_byte(pty, byte);
+		break;
+	case STATE_AWAIT_SPACE:
+		if (byte == ' ') {
+			state = STATE_CONSOLE;
+			prompt(pty);
+		}
+		break;
+	case STATE_DEBUG_BRIDGE:
+		debug_bridge_byte(pty, board, byte);
+		break;
+	case STATE_BINARY:
+	case STATE_BINARY_UART:
+		binary_byte(pty, byte);
+		break;
+	case STATE_UART_BRIDGE:
+		write_all(board, &byte, 1);
+		bridged_to_board++;
+		break;
+	}
+}
+
+// A PTY for the host's `-d`. It must not echo, even before the host configures it
+static int open_pty(void)
+{
+	struct termios tty;
+	int pty, host_end;
+
+	pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty < 0 || grantpt(pty) != 0 || unlockpt(pty) != 0)
+		return -1;
+
+	host_end = open(ptsname(pty), O_RDWR | O_NOCTTY);
+	if (host_end < 0 || tcgetattr(host_end, &tty) != 0)
+		return -1;
+	cfmakeraw(&tty);
+	tcsetattr(host_end, TCSANOW, &tty);
+	close(host_end);
+	return pty;
+}
+
+// Board's UART, at the rate the bridges run at
+static int open_board(char *dev)
+{
+	struct termios tty;
+	int board;
+
+	board = open(dev, O_RDWR | O_NOCTTY);
+	if (board < 0 || tcgetattr(board, &tty) != 0)
+		return -1;
+	cfmakeraw(&tty);
+	cfsetspeed(&tty, B115200);
+	tcsetattr(board, TCSANOW, &tty);
+	return board;
+}
+
+static void print_session(uint64_t start_ns)
+{
+	printf("Answered %u console commands, bridged %u bytes to the board and %u to the "
+	       "host, in %.3fs\n",
+	       console_answers, bridged_to_board, bridged_to_host,
+	       (monotonic_ns() - start_ns) / 1e9);
+	fflush(stdout);
+	console_answers = 0;
+	bridged_to_board = 0;
+	bridged_to_host = 0;
+}
+
+// Until the host opens its end, the PTY hangs up
+static void await_host(int pty)
+{
+	struct pollfd pty_poll = {.fd = pty, .events = POLLIN};
+
+	while (poll(&pty_poll, 1, 10) >= 0 && (pty_poll.revents & POLLHUP))
+		usleep(10 * 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd fds[2];
+	uint8_t data[4096];
+	uint64_t start_ns;
+	char *board_dev = NULL;
+	ssize_t length;
+	int pty, board;
+	int ready;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			board_dev = optarg;
+			break;
+		case 'l':
+			answer_latency_ms = atoi(optarg);
+			break;
+		}
+	}
+
+	if (board_dev == NULL || answer_latency_ms < 0) {
+		printf("Usage: %s [OPTIONS]\n", argv[0]);
+		printf("\n");
+		printf("  -d <board's serial port>\n");
+		printf("  -l [milliseconds the device takes to answer a command; OPTIONAL]\n");
+		return 1;
+	}
+
+	board = open_board(board_dev);
+	pty = open_pty();
+	if (board < 0 || pty < 0) {
+		fprintf(stderr, "Cannot open %s, or a PTY\n", board < 0 ? board_dev : "");
+		return 1;
+	}
+	printf("Emulating a Bus Pirate on %s\n", ptsname(pty));
+	fflush(stdout);
+
+	await_host(pty);
+	start_ns = monotonic_ns();
+	fds[0] = (struct pollfd){.fd = pty, .events = POLLIN};
+	fds[1] = (struct pollfd){.fd = board, .events = POLLIN};
+	while ((ready = poll(fds, 2, exit_matched ? ESCAPE_TIMEOUT_MS : HOST_IDLE_TIMEOUT_MS))
+	       >= 0) {
+		if (ready == 0 && exit_matched == 0)
+			break;
+		if (ready == 0) {
+			release_escape(board);
+			continue;
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) {
+			// Like the device, the emulator outlives the host's session
+			length = read(pty, data, sizeof(data));
+			if (length <= 0) {
+				print_session(start_ns);
+				await_host(pty);
+				start_ns = monotonic_ns();
+				continue;
+			}
+			for (ssize_t i = 0; i < length; i++)
+				host_byte(pty, board, data[i]);
+		}
+
+		// Board's bytes reach the host only through a bridge
+		if (fds[1].revents & POLLIN) {
+			length = read(board, data, sizeof(data));
+			if (length <= 0)
+				break;
+			if (state == STATE_DEBUG_BRIDGE || state == STATE_UART_BRIDGE) {
+				write_all(pty, data, length);
+				bridged_to_host += length;
+			}
+		}
+	}
+
+	print_session(start_ns);
+	close(board);
+	close(pty);
+	return 0;
+}
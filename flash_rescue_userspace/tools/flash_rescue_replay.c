@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+// Plays the board side of a session trace over a PTY, so the host can be rerun against it
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+// A host that sends nothing for this long has stopped
+#define HOST_IDLE_TIMEOUT_MS 30000
+
+// Host flushes are not seen, so allow this long for one before sending more
+#define HOST_FLUSH_SETTLE_MS 10
+
+static uint8_t record_data[UINT16_MAX];
+static uint8_t host_data[UINT16_MAX];
+
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t target_ns)
+{
+	struct timespec delay;
+	uint64_t now_ns = monotonic_ns();
+
+	if (target_ns <= now_ns)
+		return;
+	delay.tv_sec = (target_ns - now_ns) / 1000000000ULL;
+	delay.tv_nsec = (target_ns - now_ns) % 1000000000ULL;
+	nanosleep(&delay, NULL);
+}
+
+// Host's next `length` bytes. Returns how many arrived before it stopped
+static size_t read_host(int pty, uint8_t *data, size_t length)
+{
+	struct pollfd pty_poll = {.fd = pty, .events = POLLIN};
+	size_t received = 0;
+	ssize_t status;
+
+	while (received < length) {
+		if (poll(&pty_poll, 1, HOST_IDLE_TIMEOUT_MS) <= 0)
+			break;
+		status = read(pty, data + received, length - received);
+		if (status <= 0)
+			break;
+		received += status;
+	}
+	return received;
+}
+
+static void write_host(int pty, const uint8_t *data, size_t length)
+{
+	ssize_t status;
+
+	while (length != 0) {
+		status = write(pty, data, length);
+		if (status <= 0)
+			return;
+		data += status;
+		length -= status;
+	}
+}
+
+// A PTY for the host's `-d`. It must not echo, even before the host configures it
+static int open_pty(void)
+{
+	struct termios tty;
+	int pty, host_end;
+
+	pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty < 0 || grantpt(pty) != 0 || unlockpt(pty) != 0)
+		return -1;
+
+	host_end = open(ptsname(pty), O_RDWR | O_NOCTTY);
+	if (host_end < 0 || tcgetattr(host_end, &tty) != 0)
+		return -1;
+	cfmakeraw(&tty);
+	tcsetattr(host_end, TCSANOW, &tty);
+	close(host_end);
+	return pty;
+}
+
+// Until the host opens its end, the PTY hangs up
+static void await_host(int pty)
+{
+	struct pollfd pty_poll = {.fd = pty, .events = POLLIN};
+
+	while (poll(&pty_poll, 1, 10) >= 0 && (pty_poll.revents & POLLHUP))
+		usleep(10 * 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *trace_fp = NULL;
+	TRACE_RECORD record;
+	double speed = 1.0;
+	uint64_t anchor_ns, anchor_trace_ns = 0;
+	uint64_t replay_start_ns;
+	uint32_t records = 0, bytes_to_host = 0, bytes_to_board = 0;
+	size_t received;
+	int pty;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			trace_fp = trace_open_replay(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		}
+	}
+
+	if (trace_fp == NULL || speed < 0) {
+		printf("Usage: %s [OPTIONS]\n", argv[0]);
+		printf("\n");
+		printf("  -f <trace file, recorded by flash_rescue_userspace -t>\n");
+		printf("  -s [speed; 1 reproduces the board's timing, 0 answers at once; OPTIONAL]\n");
+		return 1;
+	}
+
+	pty = open_pty();
+	if (pty < 0) {
+		fprintf(stderr, "Cannot open a PTY\n");
+		return 1;
+	}
+	printf("Replaying as the board on %s\n", ptsname(pty));
+	fflush(stdout);
+
+	// Board's delays are reproduced relative to what the host last did
+	await_host(pty);
+	replay_start_ns = monotonic_ns();
+	anchor_ns = replay_start_ns;
+	while (trace_next(trace_fp, &record, record_data)) {
+		records++;
+		if (record.Direction == TRACE_FLUSH) {
+			usleep(HOST_FLUSH_SETTLE_MS * 1000);
+			anchor_ns = monotonic_ns();
+			anchor_trace_ns = record.TimeNs;
+			continue;
+		}
+		if (record.Direction == TRACE_TO_HOST) {
+			if (speed > 0)
+				sleep_until_ns(anchor_ns
+					       + (record.TimeNs - anchor_trace_ns) / speed);
+			write_host(pty, record_data, record.Length);
+			bytes_to_host += record.Length;
+			continue;
+		}
+
+		// Host must send what it sent before, or the rest of the trace is meaningless
+		received = read_host(pty, host_data, record.Length);
+		if (received != record.Length
+		    || memcmp(host_data, record_data, record.Length) != 0) {
+			fprintf(stderr,
+				"Host diverged from the trace at record %u (%zu of %u bytes)\n",
+				records, received, record.Length);
+			fclose(trace_fp);
+			return 2;
+		}
+		bytes_to_board += record.Length;
+		anchor_ns = monotonic_ns();
+		anchor_trace_ns = record.TimeNs;
+	}
+
+	// Let the host read the last response before the PTY goes away
+	while (read_host(pty, host_data, sizeof(host_data)) != 0)
+		;
+
+	printf("Replayed %u records, %u bytes to the host and %u from it, in %.3fs\n",
+	       records, bytes_to_host, bytes_to_board,
+	       (monotonic_ns() - replay_start_ns) / 1e9);
+	fclose(trace_fp);
+	close(pty);
+	return 0;
+}
@@ -0,0 +1,745 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+// Synthesises realistic successors of a BIOS image, and the blocks each should dirty, so that
+// a flashing setup can be scored against representative updates rather than random bytes
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "flash_rescue_userspace.h"
+#include "fv.h"
+
+#define MAX_AREAS     4096
+#define MAX_VARIABLES 4096
+
+// A changed driver grows by a few hundred bytes, shifting the files after it
+#define DRIVER_GROWTH	0x328
+#define DRIVER_MIN_SIZE	0x400
+
+// Runtime variable updates. Each appends a new copy, then deletes the old one
+#define NVRAM_UPDATES 16
+
+// A rebuilt compressed section grows by up to this much
+#define REBUILD_MAX_GROWTH 0x200
+
+// Version strings are this long, terminated, and begin after a terminator
+#define VERSION_MIN_LENGTH 3
+#define VERSION_MAX_LENGTH 64
+
+// FFS file header fields rewritten beyond those fv.h walks
+#define FFS_CHECKSUM_OFFSET	 16
+#define FFS_FILE_CHECKSUM_OFFSET 17
+#define FFS_STATE_OFFSET	 23
+#define FFS_TYPE_PAD		 0xF0
+
+// Sections. Compressed and GUID-defined sections hold a build tool's output
+#define SECTION_TYPE_COMPRESSION  0x01
+#define SECTION_TYPE_GUID_DEFINED 0x02
+#define SECTION_TYPE_PE32	  0x10
+#define COMPRESSION_HEADER_SIZE	  5
+#define GUID_DEFINED_DATA_OFFSET  16
+
+// PE images carry their link time
+#define PE_NEW_HEADER_OFFSET 0x3C
+#define PE_SIGNATURE	     0x00004550
+#define PE_TIMESTAMP_OFFSET  8
+
+// Variable store, after its volume's header, then variables of either header
+#define STORE_SIZE_OFFSET	       16
+#define STORE_HEADER_SIZE	       28
+#define VARIABLE_START_ID	       0x55AA
+#define VARIABLE_STATE_OFFSET	       2
+#define VARIABLE_HEADER_SIZE	       32
+#define VARIABLE_NAME_SIZE_OFFSET      8
+#define AUTH_VARIABLE_HEADER_SIZE      60
+#define AUTH_VARIABLE_NAME_SIZE_OFFSET 36
+#define VARIABLE_ALIGNMENT	       4
+#define VAR_ADDED		       0x3F
+#define VAR_DELETED		       0xFD
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+struct scenario {
+	const char *name;
+	const char *description;
+	// What the image must have for the scenario to apply
+	const char *requires;
+	bool (*synthesise)(void);
+};
+
+// Starting contents of the flash, and the image to flash over it
+static uint8_t *base;
+static uint8_t *start;
+static uint8_t *successor;
+static size_t image_size;
+static uint64_t random_state;
+
+// What the scenario changed, for its report
+static char note[128];
+
+// Located in the base image. Successors shift only what follows their changes
+static struct fv_area volumes[MAX_AREAS];
+static uint32_t volume_count;
+static struct fv_area files[MAX_AREAS];
+static uint32_t file_count;
+static size_t variables[MAX_VARIABLES];
+
+static const char *const ffs_guids[] = {
+	"8C8CE578-8A3D-4F1C-9935-896185C32DD3",
+	"5473C07A-3DCB-4DCA-BD6F-1E9689E7349A",
+};
+static const char variable_guid[] = "DDCF3616-3275-4164-98B6-FE85707FFE7D";
+static const char auth_variable_guid[] = "AAF32C78-947B-439A-A180-2E144EC37792";
+
+
+static void put24(uint8_t *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+}
+
+static void put32(uint8_t *p, uint32_t value)
+{
+	memcpy(p, &value, sizeof(value));
+}
+
+// xorshift64*, so that a seed reproduces its workloads
+static uint64_t random_next(void)
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void random_fill(uint8_t *data, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		data[i] = random_next();
+}
+
+// Innermost volume holding the bytes at `offset`
+static struct fv_area *containing_volume(uint32_t offset)
+{
+	struct fv_area *volume = NULL;
+
+	for (uint32_t i = 0; i < volume_count; i++) {
+		if (offset >= volumes[i].offset
+		    && offset - volumes[i].offset < volumes[i].length
+		    && (volume == NULL || volumes[i].length < volume->length))
+			volume = &volumes[i];
+	}
+	return volume;
+}
+
+// End of the volume's files in the successor. Free space follows, erased
+static size_t volume_used_end(const struct fv_area *volume)
+{
+	size_t end = (size_t)volume->offset + volume->length;
+
+	while (end > volume->offset && successor[end - 1] == 0xFF)
+		end--;
+	return ALIGN_UP(end, FV_ALIGNMENT);
+}
+
+// Insert `growth` bytes of new content at `at`, shifting the rest of the volume's files into
+// its free space. Returns false if they do not fit
+static bool insert_bytes(const struct fv_area *volume, size_t at, size_t growth)
+{
+	size_t used_end = volume_used_end(volume);
+
+	if (used_end < at)
+		used_end = at;
+	if (used_end + growth > (size_t)volume->offset + volume->length)
+		return false;
+
+	memmove(successor + at + growth, successor + at, used_end - at);
+	random_fill(successor + at, growth);
+	return true;
+}
+
+static size_t file_header_size(const uint8_t *file)
+{
+	return (file[FFS_ATTRIBUTES_OFFSET] & FFS_ATTRIB_LARGE_FILE) ? FFS2_HEADER_SIZE
+								     : FFS_HEADER_SIZE;
+}
+
+// Files without an extended size are limited to 24 bits
+static bool file_fits(const uint8_t *file, size_t size)
+{
+	if (file_header_size(file) == FFS2_HEADER_SIZE)
+		return size <= UINT32_MAX;
+	return size < 0xFFFFFF;
+}
+
+// Resize a file that fits, and correct its header checksum. The file checksum and state are
+// excluded from it
+static void resize_file(uint8_t *file, size_t size)
+{
+	size_t header_size = file_header_size(file);
+	uint8_t sum = 0;
+
+	if (header_size == FFS2_HEADER_SIZE)
+		put32(file + FFS_HEADER_SIZE, size);
+	else
+		put24(file + FFS_SIZE_OFFSET, size);
+
+	file[FFS_CHECKSUM_OFFSET] = 0;
+	for (size_t i = 0; i < header_size; i++) {
+		if (i != FFS_FILE_CHECKSUM_OFFSET && i != FFS_STATE_OFFSET)
+			sum += file[i];
+	}
+	file[FFS_CHECKSUM_OFFSET] = -sum;
+}
+
+// Changed driver: its code is rebuilt from some point on, and it grows
+static bool synthesise_driver(void)
+{
+	uint32_t candidates[MAX_AREAS];
+	uint32_t candidate_count = 0;
+	struct fv_area *volume;
+	struct fv_area *driver;
+	uint8_t *file;
+	size_t header_size;
+	size_t body_size;
+	size_t changed;
+
+	for (uint32_t i = 0; i < file_count; i++) {
+		file = successor + files[i].offset;
+		volume = containing_volume(files[i].offset);
+		if (volume == NULL || files[i].length < DRIVER_MIN_SIZE
+		    || file[FFS_TYPE_OFFSET] == FFS_TYPE_PAD
+		    || file[FFS_TYPE_OFFSET] == FFS_TYPE_FV_IMAGE
+		    || !file_fits(file, files[i].length + DRIVER_GROWTH)
+		    || volume_used_end(volume) + DRIVER_GROWTH
+			       > (size_t)volume->offset + volume->length)
+			continue;
+		candidates[candidate_count++] = i;
+	}
+	if (candidate_count == 0)
+		return false;
+
+	driver = &files[candidates[random_next() % candidate_count]];
+	volume = containing_volume(driver->offset);
+	file = successor + driver->offset;
+	header_size = file_header_size(file);
+	body_size = driver->length - header_size;
+
+	// Code after the change moves, so about half of what follows differs
+	changed = header_size + random_next() % (body_size / 2);
+	for (; changed < driver->length; changed += 16) {
+		if (random_next() % 2)
+			random_fill(file + changed, MIN(16, driver->length - changed));
+	}
+
+	if (!insert_bytes(volume, (size_t)driver->offset + driver->length, DRIVER_GROWTH))
+		return false;
+	resize_file(file, driver->length + DRIVER_GROWTH);
+	snprintf(note, sizeof(note), "File of 0x%x bytes at 0x%x grows by 0x%x",
+		 driver->length, driver->offset, DRIVER_GROWTH);
+	return true;
+}
+
+// Variable churn: updated variables are appended to the store, and their old copies deleted
+static uint32_t churn_store(size_t store, size_t store_end)
+{
+	uint8_t guid[GUID_SIZE];
+	size_t header_size, name_size_offset;
+	size_t variable, length, data_size, changed;
+	uint32_t variable_count = 0;
+	uint32_t updated = 0;
+	uint32_t chosen;
+
+	guid_from_string(auth_variable_guid, guid);
+	if (memcmp(successor + store, guid, GUID_SIZE) == 0) {
+		header_size = AUTH_VARIABLE_HEADER_SIZE;
+		name_size_offset = AUTH_VARIABLE_NAME_SIZE_OFFSET;
+	} else {
+		guid_from_string(variable_guid, guid);
+		if (memcmp(successor + store, guid, GUID_SIZE) != 0)
+			return 0;
+		header_size = VARIABLE_HEADER_SIZE;
+		name_size_offset = VARIABLE_NAME_SIZE_OFFSET;
+	}
+	if (store + get32(successor + store + STORE_SIZE_OFFSET) < store_end)
+		store_end = store + get32(successor + store + STORE_SIZE_OFFSET);
+
+	// Variables are stored in turn, and free space follows them
+	variable = ALIGN_UP(store + STORE_HEADER_SIZE, VARIABLE_ALIGNMENT);
+	while (variable + header_size <= store_end
+	       && get16(successor + variable) == VARIABLE_START_ID) {
+		length = header_size + (size_t)get32(successor + variable + name_size_offset)
+			 + get32(successor + variable + name_size_offset + 4);
+		if (length > store_end - variable)
+			break;
+		if (successor[variable + VARIABLE_STATE_OFFSET] == VAR_ADDED
+		    && variable_count < MAX_VARIABLES)
+			variables[variable_count++] = variable;
+		variable = ALIGN_UP(variable + length, VARIABLE_ALIGNMENT);
+	}
+
+	while (variable_count != 0 && updated < NVRAM_UPDATES) {
+		chosen = random_next() % variable_count;
+		data_size = get32(successor + variables[chosen] + name_size_offset + 4);
+		length = header_size + get32(successor + variables[chosen] + name_size_offset)
+			 + data_size;
+		if (variable + length > store_end)
+			break;
+
+		// A counter or timestamp in the data changes
+		memcpy(successor + variable, successor + variables[chosen], length);
+		changed = MIN(data_size, 8);
+		random_fill(successor + variable + length - changed, changed);
+		successor[variables[chosen] + VARIABLE_STATE_OFFSET] &= VAR_DELETED;
+		variables[chosen] = variable;
+		variable = ALIGN_UP(variable + length, VARIABLE_ALIGNMENT);
+		updated++;
+	}
+	return updated;
+}
+
+static bool synthesise_nvram(void)
+{
+	struct fv_area areas[MAX_AREAS];
+	uint32_t count;
+	uint32_t updated = 0;
+	size_t store;
+
+	// FTW working blocks are volatile too, but hold no variables
+	count = fv_find_volatile(base, image_size, areas, MAX_AREAS);
+	for (uint32_t i = 0; i < count; i++) {
+		if (get32(base + areas[i].offset + FV_SIGNATURE_OFFSET) != FV_SIGNATURE)
+			continue;
+		store = areas[i].offset
+			+ get16(base + areas[i].offset + FV_HEADER_LENGTH_OFFSET);
+		if (store + STORE_HEADER_SIZE > (size_t)areas[i].offset + areas[i].length)
+			continue;
+		updated += churn_store(store, (size_t)areas[i].offset + areas[i].length);
+	}
+
+	snprintf(note, sizeof(note), "%u variable updates", updated);
+	return updated != 0;
+}
+
+// Characters of a version string, such as "1.0.2" or "Version F.70"
+static bool is_version_character(uint8_t character)
+{
+	return (character >= '0' && character <= '9') || (character >= 'A' && character <= 'Z')
+	       || (character >= 'a' && character <= 'z') || character == '.' || character == ' '
+	       || character == '-' || character == '_';
+}
+
+// Length in characters of a version string at `offset`, of one or two byte characters.
+// Returns 0 if there is none
+static size_t version_length(size_t offset, size_t width)
+{
+	size_t length = 0;
+	bool dotted = false;
+
+	if (offset >= width && base[offset - width] != 0)
+		return 0;
+
+	for (; offset + width <= image_size && length <= VERSION_MAX_LENGTH;
+	     offset += width, length++) {
+		if (width == 2 && base[offset + 1] != 0)
+			return 0;
+		if (base[offset] == 0)
+			return (dotted && length >= VERSION_MIN_LENGTH) ? length : 0;
+		if (!is_version_character(base[offset]))
+			return 0;
+
+		// Digits either side of a dot
+		dotted |= base[offset] == '.' && length != 0 && offset + width < image_size
+			  && base[offset - width] >= '0' && base[offset - width] <= '9'
+			  && base[offset + width] >= '0' && base[offset + width] <= '9';
+	}
+	return 0;
+}
+
+// Bump each copy of a version string, encoded with characters of `width` bytes. Returns how
+// many there were
+static uint32_t bump_version(const uint8_t *characters, size_t length, size_t last_digit,
+			     size_t width)
+{
+	uint8_t pattern[VERSION_MAX_LENGTH * 2] = { 0 };
+	uint8_t *match;
+	uint32_t bumped = 0;
+
+	for (size_t i = 0; i < length; i++)
+		pattern[i * width] = characters[i];
+
+	for (size_t offset = 0; offset + length * width <= image_size;
+	     offset = match - successor + 1) {
+		match = memmem(successor + offset, image_size - offset, pattern,
+			       length * width);
+		if (match == NULL)
+			break;
+		match += last_digit * width;
+		*match = (*match == '9') ? '0' : *match + 1;
+		bumped++;
+	}
+	return bumped;
+}
+
+// Version bump: the first version string's last digit changes, wherever the string appears.
+// Setup strings are UCS-2, and tables are ASCII, so both are bumped
+static bool synthesise_version(void)
+{
+	uint8_t characters[VERSION_MAX_LENGTH];
+	size_t length = 0;
+	size_t width = 1;
+	size_t offset;
+	size_t last_digit = 0;
+	uint32_t bumped;
+
+	for (offset = 0; offset < image_size && length == 0; offset++) {
+		for (width = 2; width != 0 && length == 0; width--)
+			length = version_length(offset, width);
+	}
+	if (length == 0)
+		return false;
+	width++;
+	offset--;
+
+	for (size_t i = 0; i < length; i++) {
+		characters[i] = base[offset + i * width];
+		if (characters[i] >= '0' && characters[i] <= '9')
+			last_digit = i;
+	}
+
+	bumped = bump_version(characters, length, last_digit, 1)
+		 + bump_version(characters, length, last_digit, 2);
+	snprintf(note, sizeof(note), "\"%.*s\", first at 0x%zx, bumped in %u places",
+		 (int)length, characters, offset, bumped);
+	return bumped != 0;
+}
+
+// A PE image's link time changes
+static bool restamp_pe(uint8_t *image, size_t size)
+{
+	size_t header;
+
+	if (size < PE_NEW_HEADER_OFFSET + 4 || image[0] != 'M' || image[1] != 'Z')
+		return false;
+	header = get32(image + PE_NEW_HEADER_OFFSET);
+	if (header > size - PE_TIMESTAMP_OFFSET - 4 || get32(image + header) != PE_SIGNATURE)
+		return false;
+
+	put32(image + header + PE_TIMESTAMP_OFFSET,
+	      get32(image + header + PE_TIMESTAMP_OFFSET) + 1 + random_next() % 86400);
+	return true;
+}
+
+// Rebuild a file's sections. Compressed output differs throughout, and its size changes
+static uint32_t rebuild_file(const struct fv_area *file_area, const struct fv_area *volume)
+{
+	uint8_t *file = successor + file_area->offset;
+	uint8_t *section;
+	size_t file_size = file_area->length;
+	size_t offset = file_header_size(file);
+	size_t section_size, header_size, data_offset, growth;
+	uint32_t rebuilt = 0;
+
+	while (offset + SECTION_HEADER_SIZE <= file_size) {
+		section = file + offset;
+		section_size = get24(section);
+		header_size = SECTION_HEADER_SIZE;
+		if (section_size == 0xFFFFFF) {
+			if (offset + SECTION2_HEADER_SIZE > file_size)
+				break;
+			section_size = get32(section + SECTION_HEADER_SIZE);
+			header_size = SECTION2_HEADER_SIZE;
+		}
+		if (section_size < header_size || section_size > file_size - offset)
+			break;
+
+		if (section[SECTION_TYPE_OFFSET] == SECTION_TYPE_PE32) {
+			rebuilt += restamp_pe(section + header_size,
+					      section_size - header_size);
+		} else if (section[SECTION_TYPE_OFFSET] == SECTION_TYPE_COMPRESSION
+			   || section[SECTION_TYPE_OFFSET] == SECTION_TYPE_GUID_DEFINED) {
+			if (section[SECTION_TYPE_OFFSET] == SECTION_TYPE_COMPRESSION)
+				data_offset = header_size + COMPRESSION_HEADER_SIZE;
+			else if (header_size + GUID_DEFINED_DATA_OFFSET + 2 <= section_size)
+				data_offset = get16(section + header_size
+						    + GUID_DEFINED_DATA_OFFSET);
+			else
+				data_offset = section_size;
+			if (data_offset < section_size) {
+				random_fill(section + data_offset, section_size - data_offset);
+				rebuilt++;
+			}
+
+			// Extended sizes are left alone
+			growth = (random_next() % (REBUILD_MAX_GROWTH / FV_ALIGNMENT + 1))
+				 * FV_ALIGNMENT;
+			if (header_size == SECTION_HEADER_SIZE && growth != 0 && volume != NULL
+			    && section_size + growth < 0xFFFFFF
+			    && file_fits(file, file_size + growth)
+			    && insert_bytes(volume, file_area->offset + offset + section_size,
+					    growth)) {
+				resize_file(file, file_size + growth);
+				put24(section, section_size + growth);
+				section_size += growth;
+				file_size += growth;
+			}
+		}
+		offset = ALIGN_UP(offset + section_size, SECTION_ALIGNMENT);
+	}
+	return rebuilt;
+}
+
+// Full rebuild. Files are visited last first, so that growth shifts none yet to be visited
+static bool synthesise_rebuild(void)
+{
+	uint32_t rebuilt = 0;
+	struct fv_area *volume;
+
+	for (uint32_t i = file_count; i-- > 0;) {
+		volume = containing_volume(files[i].offset);
+		rebuilt += rebuild_file(&files[i], volume);
+	}
+
+	snprintf(note, sizeof(note), "%u sections rebuilt", rebuilt);
+	return rebuilt != 0;
+}
+
+// Blank flash, programmed with the whole image
+static bool synthesise_blank(void)
+{
+	memset(start, 0xFF, image_size);
+	snprintf(note, sizeof(note), "Whole image");
+	return true;
+}
+
+static const struct scenario scenarios[] = {
+	{ "driver", "A driver is changed and grows, shifting the files after it",
+	  "volume with room for a driver to grow", synthesise_driver },
+	{ "nvram", "Variables are updated at runtime, and their old copies deleted",
+	  "variable store with variables", synthesise_nvram },
+	{ "version", "The version string is bumped wherever it appears", "version string",
+	  synthesise_version },
+	{ "rebuild",
+	  "A full rebuild: compressed output differs and grows, and PE images are restamped",
+	  "compressed sections or PE images", synthesise_rebuild },
+	{ "blank", "A blank flash is programmed with the whole image", NULL, synthesise_blank },
+};
+
+static bool write_file(const char *directory, const char *name, const char *suffix,
+		       const uint8_t *data, size_t size)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	bool written;
+
+	snprintf(path, sizeof(path), "%s/%s%s", directory, name, suffix);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		return false;
+	}
+	written = fwrite(data, 1, size, fp) == size;
+	return (fclose(fp) == 0) && written;
+}
+
+// Blocks a session must flash, as address ranges of one action: "write", "erase", "fill",
+// or "volatile" for those a session leaves alone unless volatile regions are included
+static bool write_dirty(const char *directory, const struct scenario *scenario,
+			const char **actions, uint32_t image_blocks, size_t changed)
+{
+	uint32_t dirty = 0, erased = 0, filled = 0, preserved = 0;
+	char path[PATH_MAX];
+	uint32_t end;
+	FILE *fp;
+
+	for (uint32_t block = 0; block < image_blocks; block++) {
+		dirty += actions[block] != NULL;
+		erased += actions[block] != NULL && strcmp(actions[block], "erase") == 0;
+		filled += actions[block] != NULL && strcmp(actions[block], "fill") == 0;
+		preserved += actions[block] != NULL && strcmp(actions[block], "volatile") == 0;
+	}
+	printf("%-8s %u dirty blocks (%u bytes), %zu bytes changed. %u erased, %u filled, "
+	       "%u volatile\n",
+	       scenario->name, dirty, dirty * SIZE_BLOCK, changed, erased, filled, preserved);
+	printf("%-8s %s\n", "", note);
+
+	snprintf(path, sizeof(path), "%s/%s.dirty", directory, scenario->name);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		return false;
+	}
+	fprintf(fp, "# %s: %s\n", scenario->name, scenario->description);
+	fprintf(fp, "# %s\n", note);
+	fprintf(fp,
+		"# %u dirty blocks (%u bytes), %zu bytes changed. %u erased, %u filled, "
+		"%u volatile\n",
+		dirty, dirty * SIZE_BLOCK, changed, erased, filled, preserved);
+	for (uint32_t i = 0; i < image_blocks; i = end) {
+		end = i + 1;
+		if (actions[i] == NULL)
+			continue;
+		while (end < image_blocks && actions[end] == actions[i])
+			end++;
+		fprintf(fp, "0x%08x:0x%08x %s\n", i * SIZE_BLOCK, end * SIZE_BLOCK - 1,
+			actions[i]);
+	}
+	return fclose(fp) == 0;
+}
+
+// Score a scenario by the blocks that differ from the flash's starting contents
+static bool emit_scenario(const char *directory, const struct scenario *scenario)
+{
+	struct fv_area areas[MAX_AREAS];
+	uint32_t image_blocks = image_size / SIZE_BLOCK;
+	const char **actions;
+	uint8_t *data;
+	uint8_t pattern;
+	uint32_t count;
+	size_t changed = 0;
+	bool written;
+
+	actions = calloc(image_blocks, sizeof(*actions));
+	if (actions == NULL)
+		return false;
+
+	for (size_t i = 0; i < image_size; i++)
+		changed += start[i] != successor[i];
+	for (uint32_t block = 0; block < image_blocks; block++) {
+		if (memcmp(start + (size_t)block * SIZE_BLOCK,
+			   successor + (size_t)block * SIZE_BLOCK, SIZE_BLOCK)
+		    == 0)
+			continue;
+		// As a session classifies them, so that fills are not scored as writes
+		data = successor + (size_t)block * SIZE_BLOCK;
+		if (is_erased(data, SIZE_BLOCK))
+			actions[block] = "erase";
+		else if (is_constant(data, SIZE_BLOCK, &pattern))
+			actions[block] = "fill";
+		else
+			actions[block] = "write";
+	}
+
+	// Sessions preserve these, as they locate them in the image being flashed
+	count = fv_find_volatile(successor, image_size, areas, MAX_AREAS);
+	for (uint32_t i = 0; i < count; i++) {
+		for (size_t block = areas[i].offset / SIZE_BLOCK;
+		     block < image_blocks
+		     && block * SIZE_BLOCK < (size_t)areas[i].offset + areas[i].length;
+		     block++) {
+			if (actions[block] != NULL)
+				actions[block] = "volatile";
+		}
+	}
+
+	written = write_dirty(directory, scenario, actions, image_blocks, changed)
+		  && write_file(directory, scenario->name, ".start.bin", start, image_size)
+		  && write_file(directory, scenario->name, ".bin", successor, image_size);
+	free(actions);
+	return written;
+}
+
+static uint8_t *read_image(const char *path)
+{
+	uint8_t *image;
+	FILE *fp;
+	long size;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return NULL;
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) <= 0 || size % SIZE_BLOCK != 0
+	    || size / SIZE_BLOCK > MAX_IMAGE_BLOCKS || fseek(fp, 0, SEEK_SET) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+
+	image = malloc(size);
+	if (image != NULL && fread(image, 1, size, fp) != (size_t)size) {
+		free(image);
+		image = NULL;
+	}
+	fclose(fp);
+	image_size = size;
+	return image;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *image_path = NULL;
+	const char *directory = NULL;
+	uint64_t seed = 1;
+	uint8_t guid[GUID_SIZE];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:o:s:")) != -1) {
+		switch (opt) {
+		case 'f':
+			image_path = optarg;
+			break;
+		case 'o':
+			directory = optarg;
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		}
+	}
+
+	if (image_path == NULL || directory == NULL) {
+		printf("Usage: %s [OPTIONS]\n", argv[0]);
+		printf("\n");
+		printf("  -f <base BIOS image>\n");
+		printf("  -o <directory, for each scenario's images and dirty blocks>\n");
+		printf("  -s [seed; each reproduces its workloads; OPTIONAL]\n");
+		return 1;
+	}
+
+	if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create %s\n", directory);
+		return 1;
+	}
+	base = read_image(image_path);
+	if (base == NULL) {
+		fprintf(stderr, "Cannot read %s, or it is not a whole number of blocks\n",
+			image_path);
+		return 1;
+	}
+	start = malloc(image_size);
+	successor = malloc(image_size);
+	if (start == NULL || successor == NULL) {
+		fprintf(stderr, "Cannot allocate the workloads\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(ffs_guids) / sizeof(ffs_guids[0]); i++) {
+		guid_from_string(ffs_guids[i], guid);
+		volume_count += fv_find(base, image_size, guid, volumes + volume_count,
+					MAX_AREAS - volume_count);
+	}
+	file_count = fv_find_files(base, image_size, files, MAX_AREAS);
+	printf("%u volumes and %u files in %s\n", volume_count, file_count, image_path);
+
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		// Scenarios draw from seeds of their own, so each is reproduced alone
+		random_state = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+		memcpy(start, base, image_size);
+		memcpy(successor, base, image_size);
+		if (!scenarios[i].synthesise()) {
+			printf("Skipping %s: the image has no %s\n", scenarios[i].name,
+			       scenarios[i].requires);
+			continue;
+		}
+		if (!emit_scenario(directory, &scenarios[i]))
+			return 2;
+	}
+	return 0;
+}
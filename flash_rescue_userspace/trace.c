@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+static _Thread_local FILE *trace_fp;
+static _Thread_local uint64_t trace_start_ns;
+
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Record every byte of this session, so it can be replayed
+int trace_open(char *path)
+{
+	TRACE_HEADER header = {
+		.Magic = TRACE_MAGIC,
+		.Version = TRACE_VERSION,
+		.Reserved = 0,
+	};
+
+	trace_fp = fopen(path, "wb");
+	if (trace_fp == NULL)
+		return -1;
+
+	fwrite(&header, sizeof(header), 1, trace_fp);
+	trace_start_ns = monotonic_ns();
+	return 0;
+}
+
+// Buffered by stdio, so the session is not slowed. Longer transfers span records
+// - A session's reader and writer threads record at once, so records are written whole
+void trace_record(uint8_t direction, const void *data, size_t length)
+{
+	TRACE_RECORD record;
+
+	if (trace_fp == NULL)
+		return;
+
+	flockfile(trace_fp);
+	record.TimeNs = monotonic_ns() - trace_start_ns;
+	record.Direction = direction;
+	do {
+		record.Length = (length > UINT16_MAX) ? UINT16_MAX : length;
+		fwrite(&record, sizeof(record), 1, trace_fp);
+		if (record.Length != 0)
+			fwrite(data, 1, record.Length, trace_fp);
+		data = (const uint8_t *)data + record.Length;
+		length -= record.Length;
+	} while (length != 0);
+	funlockfile(trace_fp);
+}
+
+void trace_close(void)
+{
+	if (trace_fp == NULL)
+		return;
+
+	fclose(trace_fp);
+	trace_fp = NULL;
+}
+
+void trace_save_context(struct trace_context *context)
+{
+	context->fp = trace_fp;
+	context->start_ns = trace_start_ns;
+}
+
+void trace_adopt_context(const struct trace_context *context)
+{
+	trace_fp = context->fp;
+	trace_start_ns = context->start_ns;
+}
+
+// Open a trace to replay, positioned at its first record
+FILE *trace_open_replay(char *path)
+{
+	TRACE_HEADER header;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1
+	    || memcmp(header.Magic, TRACE_MAGIC, sizeof(header.Magic)) != 0
+	    || header.Version != TRACE_VERSION) {
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+// Read the next record into `data`, which holds UINT16_MAX bytes. A torn record ends the trace
+bool trace_next(FILE *fp, TRACE_RECORD *record, uint8_t *data)
+{
+	if (fread(record, sizeof(*record), 1, fp) != 1)
+		return false;
+	return fread(data, 1, record->Length, fp) == record->Length;
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC   "FRTRACE"
+#define TRACE_VERSION 1
+
+// Direction of a record
+#define TRACE_TO_BOARD 0x00
+#define TRACE_TO_HOST  0x01
+#define TRACE_FLUSH    0x02 // Host discarded what it had not read. Carries no data
+
+#pragma pack(push, 1)
+typedef struct {
+	char Magic[8];
+	uint32_t Version;
+	uint32_t Reserved;
+} TRACE_HEADER;
+
+// Followed by `Length` bytes, as one read() or write() transferred them
+typedef struct {
+	uint64_t TimeNs; // Since the trace began
+	uint16_t Length;
+	uint8_t Direction;
+} TRACE_RECORD;
+#pragma pack(pop)
+
+// A session's threads record to one trace
+struct trace_context {
+	FILE *fp;
+	uint64_t start_ns;
+};
+
+int trace_open(char *path);
+void trace_record(uint8_t direction, const void *data, size_t length);
+void trace_close(void);
+void trace_save_context(struct trace_context *context);
+void trace_adopt_context(const struct trace_context *context);
+FILE *trace_open_replay(char *path);
+bool trace_next(FILE *fp, TRACE_RECORD *record, uint8_t *data);
+
+#endif
@@ -0,0 +1,402 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "flash_rescue_userspace.h"
+#include "buspirate.h"
+#include "session.h"
+#include "tune.h"
+#include "util.h"
+
+// Rates to climb through, from the one the port is opened at
+static const struct {
+	uint32_t baud;
+	speed_t speed;
+} baud_rates[] = {
+	{115200, B115200},   {230400, B230400},	  {460800, B460800},   {921600, B921600},
+	{1000000, B1000000}, {1500000, B1500000}, {2000000, B2000000}, {3000000, B3000000},
+};
+#define BAUD_RATES (sizeof(baud_rates) / sizeof(baud_rates[0]))
+
+// Board abandons a broken echo, and waits for the line to be quiet, well within this
+#define RESYNC_DELAY_MS 500
+
+// A setting must be this much faster to be worth its smaller margin
+#define TUNE_MIN_GAIN 1.05
+
+// Performance of the link, with the current settings
+struct link_measurement {
+	double round_trip_ms;
+	double bytes_per_second; // Echoed, so counted in both directions
+};
+
+static _Thread_local uint8_t baud_index;
+static _Thread_local uint32_t session_errors;
+static _Thread_local uint8_t test_pattern[SIZE_BLOCK];
+static _Thread_local uint8_t test_echo[SIZE_BLOCK];
+
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Pseudo-random, so each trial differs. The high bit is set, so no stray byte is a command
+static void fill_pattern(uint32_t seed)
+{
+	for (int i = 0; i < SIZE_BLOCK; i++) {
+		seed = seed * 1103515245 + 12345;
+		test_pattern[i] = (seed >> 16) | 0x80;
+	}
+}
+
+// Time echoes of nothing and of a block, keeping the best of each. False at the first error
+static bool measure_link(int trials, struct link_measurement *measurement)
+{
+	uint64_t round_trip_ns = UINT64_MAX;
+	uint64_t block_ns = UINT64_MAX;
+	uint64_t start_ns, elapsed_ns;
+
+	for (int i = 0; i < trials; i++) {
+		start_ns = monotonic_ns();
+		if (!echo_data(test_pattern, 0, test_echo))
+			return false;
+		elapsed_ns = monotonic_ns() - start_ns;
+		if (elapsed_ns < round_trip_ns)
+			round_trip_ns = elapsed_ns;
+
+		fill_pattern(i);
+		start_ns = monotonic_ns();
+		if (!echo_data(test_pattern, SIZE_BLOCK, test_echo))
+			return false;
+		elapsed_ns = monotonic_ns() - start_ns;
+		if (elapsed_ns < block_ns)
+			block_ns = elapsed_ns;
+	}
+
+	measurement->round_trip_ms = round_trip_ns / 1e6;
+	measurement->bytes_per_second = 2.0 * SIZE_BLOCK * 1e9 / block_ns;
+	return true;
+}
+
+// After an error, wait out the board's echo and discard what is left of it
+static bool resync(void)
+{
+	for (int i = 0; i < TUNE_TRIALS; i++) {
+		usleep(RESYNC_DELAY_MS * MS_IN_SECOND);
+		serial_flush();
+		if (echo_data(test_pattern, 0, test_echo))
+			return true;
+	}
+	return false;
+}
+
+// Bus Pirate's bridges to the board run at a fixed rate, and sockets have none
+static bool baud_rate_tunable(void)
+{
+	return !bp_in_use() && serial_has_baud_rate();
+}
+
+static void print_settings(FILE *fp, struct link_measurement *measurement)
+{
+	if (serial_has_baud_rate())
+		fprintf(fp, "%u baud, ", baud_rates[baud_index].baud);
+	fprintf(fp, "%u-byte packets, %u in flight", xfer_block_size, xfer_window);
+	if (measurement != NULL)
+		fprintf(fp, ": %.2fms round trip, %.1f KiB/s", measurement->round_trip_ms,
+			measurement->bytes_per_second / 1024);
+	fprintf(fp, "\n");
+}
+
+// Switch both ends to another rate, keeping it only if the link carries it cleanly
+// - Unconfirmed, the board reverts on its own. Then so do we
+static bool switch_baud(uint8_t index, struct link_measurement *measurement)
+{
+	uint64_t switched_ns;
+	uint64_t revert_ns;
+	bool stable;
+
+	if (!request_baud_rate(baud_rates[index].baud))
+		return false;
+
+	// Board switches shortly after answering
+	switched_ns = monotonic_ns();
+	stable = serial_set_speed(baud_rates[index].speed);
+	usleep(2 * BAUD_SWITCH_DELAY_MS * MS_IN_SECOND);
+	if (stable && measure_link(TUNE_TRIALS, measurement)
+	    && monotonic_ns() - switched_ns < BAUD_CONFIRM_TIMEOUT_MS / 2 * 1000000ULL
+	    && request_baud_rate(baud_rates[index].baud)) {
+		baud_index = index;
+		return true;
+	}
+
+	revert_ns = switched_ns + (BAUD_CONFIRM_TIMEOUT_MS + RESYNC_DELAY_MS) * 1000000ULL;
+	if (monotonic_ns() < revert_ns)
+		usleep((revert_ns - monotonic_ns()) / 1000);
+	serial_set_speed(baud_rates[baud_index].speed);
+	if (resync())
+		return false;
+
+	// Board may have taken a lost answer's confirmation
+	serial_set_speed(baud_rates[index].speed);
+	if (resync()) {
+		baud_index = index;
+		return measure_link(1, measurement);
+	}
+	fprintf(session_err, "Lost the board while changing baud rate!\n");
+	return false;
+}
+
+// Fastest rate the link carries cleanly
+static void tune_baud(struct link_measurement *best)
+{
+	struct link_measurement measurement;
+	uint8_t best_index = baud_index;
+
+	for (uint8_t i = baud_index + 1; i < BAUD_RATES; i++) {
+		if (!switch_baud(i, &measurement))
+			break;
+		if (measurement.bytes_per_second < best->bytes_per_second * TUNE_MIN_GAIN)
+			break;
+		best_index = i;
+		*best = measurement;
+	}
+
+	if (baud_index != best_index)
+		switch_baud(best_index, &measurement);
+}
+
+// Largest packets the board receives cleanly, as each is acknowledged
+static void tune_packet_size(struct link_measurement *best)
+{
+	uint16_t original_size = xfer_block_size;
+
+	xfer_window = 1;
+	for (uint16_t size = SIZE_BLOCK; size >= TUNE_MIN_PACKET_SIZE; size /= 2) {
+		if (!set_xfer_size(size))
+			break;
+		if (measure_link(TUNE_TRIALS, best))
+			return;
+		resync();
+	}
+
+	if (xfer_block_size != original_size)
+		set_xfer_size(original_size);
+}
+
+// Packets in flight, overlapping each acknowledgement with the next packet
+static void tune_window(struct link_measurement *best)
+{
+	struct link_measurement measurement;
+
+	for (uint16_t window = 2; window * xfer_block_size <= SIZE_BLOCK; window *= 2) {
+		xfer_window = window;
+		if (!measure_link(TUNE_TRIALS, &measurement)) {
+			resync();
+			xfer_window = window / 2;
+			return;
+		}
+		if (measurement.bytes_per_second < best->bytes_per_second * TUNE_MIN_GAIN) {
+			xfer_window = window / 2;
+			return;
+		}
+		*best = measurement;
+	}
+}
+
+// Settings are cached per serial port, as it was named
+// Entry of the cache: "<baud> <packet size> <window> <serial port>". Returns its port
+static char *parse_cached(char *line, unsigned int *baud, unsigned int *size,
+			  unsigned int *window)
+{
+	int dev_offset;
+
+	line[strcspn(line, "\n")] = 0;
+	if (sscanf(line, "%u %u %u %n", baud, size, window, &dev_offset) != 3)
+		return NULL;
+	return line + dev_offset;
+}
+
+static bool load_cached(uint32_t *baud, uint16_t *size, uint16_t *window)
+{
+	char path[PATH_MAX];
+	char line[PATH_MAX + 64];
+	unsigned int cached_baud, cached_size, cached_window;
+	char *dev;
+	FILE *cache_fp;
+	bool found = false;
+
+	if (!cache_path(path, sizeof(path), TUNE_CACHE_NAME)
+	    || (cache_fp = fopen(path, "r")) == NULL)
+		return false;
+
+	// Later entries supersede earlier ones
+	while (fgets(line, sizeof(line), cache_fp) != NULL) {
+		dev = parse_cached(line, &cached_baud, &cached_size, &cached_window);
+		if (dev == NULL || strcmp(dev, p_dev) != 0)
+			continue;
+		if (cached_size == 0 || cached_size > SIZE_BLOCK || cached_window == 0
+		    || cached_window * cached_size > SIZE_BLOCK)
+			continue;
+
+		*baud = cached_baud;
+		*size = cached_size;
+		*window = cached_window;
+		found = true;
+	}
+
+	fclose(cache_fp);
+	return found;
+}
+
+// Replace this port's entry, keeping the others
+static void save_cached(void)
+{
+	char path[PATH_MAX];
+	char new_path[PATH_MAX + 4];
+	char line[PATH_MAX + 64];
+	unsigned int cached_baud, cached_size, cached_window;
+	char *dev;
+	FILE *cache_fp;
+	FILE *new_fp;
+
+	if (!cache_path(path, sizeof(path), TUNE_CACHE_NAME))
+		return;
+	snprintf(new_path, sizeof(new_path), "%s.new", path);
+	new_fp = fopen(new_path, "w");
+	if (new_fp == NULL)
+		return;
+
+	cache_fp = fopen(path, "r");
+	while (cache_fp != NULL && fgets(line, sizeof(line), cache_fp) != NULL) {
+		dev = parse_cached(line, &cached_baud, &cached_size, &cached_window);
+		if (dev == NULL || strcmp(dev, p_dev) == 0)
+			continue;
+		fprintf(new_fp, "%s\n", line);
+	}
+	if (cache_fp != NULL)
+		fclose(cache_fp);
+
+	fprintf(new_fp, "%u %u %u %s\n", baud_rates[baud_index].baud, xfer_block_size,
+		xfer_window, p_dev);
+	if (fclose(new_fp) != 0 || rename(new_path, path) != 0)
+		unlink(new_path);
+}
+
+// Settings cached by an earlier session, if the link still carries them cleanly
+static bool apply_cached(struct link_measurement *measurement)
+{
+	uint32_t baud;
+	uint16_t size, window;
+	uint8_t index;
+
+	if (!load_cached(&baud, &size, &window))
+		return false;
+	for (index = 0; index < BAUD_RATES && baud_rates[index].baud != baud; index++)
+		;
+	if (index == BAUD_RATES)
+		return false;
+
+	if (index != baud_index && !switch_baud(index, measurement))
+		return false;
+	if (size != xfer_block_size && !set_xfer_size(size))
+		return false;
+	xfer_window = window;
+	if (measure_link(TUNE_TRIALS, measurement))
+		return true;
+
+	resync();
+	xfer_window = 1;
+	return false;
+}
+
+// Calibrate the link after HELLO: host latency, then packet size, baud rate and window in turn
+// - Links without a tunable baud rate only have their packets tuned
+void tune_link(void)
+{
+	struct link_measurement measurement;
+
+	serial_set_low_latency(p_dev);
+
+	fill_pattern(0);
+	if (!echo_data(test_pattern, 0, test_echo)) {
+		fprintf(session_out, "Board cannot calibrate the link\n");
+		return;
+	}
+
+	// Any setting that works beats one that does not
+	if (measure_link(1, &measurement)) {
+		fprintf(session_out, "Link is ");
+		print_settings(session_out, &measurement);
+	} else {
+		fprintf(session_out, "Link is unstable at ");
+		print_settings(session_out, NULL);
+		memset(&measurement, 0, sizeof(measurement));
+		resync();
+	}
+
+	if (apply_cached(&measurement)) {
+		fprintf(session_out, "Using the link settings tuned for %s: ", p_dev);
+		print_settings(session_out, &measurement);
+		return;
+	}
+
+	fprintf(session_out, "Tuning the link...\n");
+	tune_packet_size(&measurement);
+	if (baud_rate_tunable())
+		tune_baud(&measurement);
+	tune_window(&measurement);
+	if (!measure_link(TUNE_TRIALS, &measurement)) {
+		fprintf(session_err, "Link is unstable, even as tuned\n");
+		resync();
+		return;
+	}
+
+	fprintf(session_out, "Tuned the link to ");
+	print_settings(session_out, &measurement);
+	save_cached();
+}
+
+// Errors that suggest the link is too fast: NACKed packets, and blocks that fail verification
+void tune_note_error(void)
+{
+	session_errors++;
+}
+
+// Slow the link a step as errors mount: fewer packets in flight, smaller ones, a lower rate
+// - Called between commands, so that settings do not change under one
+void tune_adapt(void)
+{
+	struct link_measurement measurement;
+	bool slowed;
+
+	if (!autotune || session_errors < TUNE_ERROR_LIMIT)
+		return;
+	session_errors = 0;
+
+	slowed = false;
+	if (xfer_window > 1) {
+		xfer_window /= 2;
+		slowed = true;
+	}
+	if (!slowed && xfer_block_size > TUNE_MIN_PACKET_SIZE)
+		slowed = set_xfer_size(xfer_block_size / 2);
+	if (!slowed && baud_rate_tunable() && baud_index != 0)
+		slowed = switch_baud(baud_index - 1, &measurement);
+	if (!slowed)
+		return;
+
+	fprintf(session_err, "\nLink errors. Slowed it to ");
+	print_settings(session_err, NULL);
+	save_cached();
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+// Test transfers per setting. Any error rejects it
+#define TUNE_TRIALS 3
+
+// Errors within a session, before the link is slowed a step
+#define TUNE_ERROR_LIMIT 3
+
+// Smallest packet worth trying. Smaller still only adds acknowledgements
+#define TUNE_MIN_PACKET_SIZE 16
+
+// File in the user's cache directory
+#define TUNE_CACHE_NAME "flash_rescue_tuning"
+
+void tune_link(void);
+void tune_note_error(void);
+void tune_adapt(void);
+
+#endif
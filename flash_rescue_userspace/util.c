@@ -5,45 +5,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <termios.h>
 #include <unistd.h>
 #include "flash_rescue_userspace.h"
+#include "session.h"
+#include "tune.h"
 #include "util.h"
 
-// Bus Pirate toggle baudrate generator
-void bp_switch_baudrate_generator(bool to_high_speed)
+// Board log, from a frame of `size` bytes
+static void read_log_frame(uint16_t size)
 {
-	char *bp_normal_speed = "b\n9\n";
-	char *bp_high_speed = "b\n10\n3\n";
-	char *bp_speed_ack = " \n";
+	static _Thread_local bool line_start = true;
+	char log_data[256];
+	size_t count;
 
-	char *bp_this_speed = (to_high_speed == 1) ? bp_high_speed : bp_normal_speed;
-	speed_t sys_this_speed = (to_high_speed == 1) ? B1000000 : B115200;
+	while (size != 0) {
+		count = (size < sizeof(log_data)) ? size : sizeof(log_data);
+		serial_fifo_read(log_data, count);
+		size -= count;
 
-	serial_fifo_write(bp_this_speed, strlen(bp_this_speed));
-	usleep(100 * MS_IN_SECOND);
+		if (board_log_fp != NULL) {
+			fwrite(log_data, 1, count, board_log_fp);
+			fflush(board_log_fp);
+			continue;
+		}
 
-	close(serial_dev);
-	serial_open(p_dev, sys_this_speed);
+		// Interleaved with our own output, so mark each line
+		for (size_t i = 0; i < count; i++) {
+			if (line_start)
+				fputs("Board: ", session_err);
+			fputc(log_data[i], session_err);
+			line_start = (log_data[i] == '\n');
+		}
+	}
+}
 
-	serial_fifo_write(bp_speed_ack, strlen(bp_speed_ack));
-	usleep(100 * MS_IN_SECOND);
+// Read a response. Log frames the board sends ahead of it are demultiplexed
+void read_response(EARLY_FLASH_RESCUE_RESPONSE *response_packet)
+{
+	serial_fifo_read(response_packet, sizeof(*response_packet));
+	while (response_packet->Acknowledge == EARLY_FLASH_RESCUE_LOG_FRAME) {
+		read_log_frame(response_packet->Size);
+		serial_fifo_read(response_packet, sizeof(*response_packet));
+	}
 }
 
-// Bus Pirate exit helper
-void bp_exit(void)
+// Read a response, unless the link is quiet for `timeout_ms`. Log frames restart the wait
+bool read_response_timeout(EARLY_FLASH_RESCUE_RESPONSE *response_packet, int timeout_ms)
 {
-	uint8_t bp_debug_port_exit[] = {0x1B, 0x5B, 0x32, 0x34, 0x7E};
-	char *bp_not_exits = "\n";
+	if (!serial_fifo_read_timeout(response_packet, sizeof(*response_packet), timeout_ms))
+		return false;
+	while (response_packet->Acknowledge == EARLY_FLASH_RESCUE_LOG_FRAME) {
+		read_log_frame(response_packet->Size);
+		if (!serial_fifo_read_timeout(response_packet, sizeof(*response_packet),
+					      timeout_ms))
+			return false;
+	}
+	return true;
+}
 
-	serial_fifo_write(bp_debug_port_exit, sizeof(bp_debug_port_exit));
-	usleep(100 * MS_IN_SECOND);
-	serial_fifo_write(bp_not_exits, strlen(bp_not_exits));
-	usleep(100 * MS_IN_SECOND);
+// Discard whatever the board still sends, until the link is quiet for `quiet_ms`
+void serial_drain(int quiet_ms)
+{
+	uint8_t discarded;
 
-	if (implementation_high_speed)
-		bp_switch_baudrate_generator(false);
-	tcflush(serial_dev, TCIOFLUSH);
+	while (serial_fifo_read_timeout(&discarded, sizeof(discarded), quiet_ms))
+		;
 }
 
 // Wait for `ACK` response helper
@@ -51,17 +77,18 @@ void wait_for_ack_on(char *progress_string, uint32_t address)
 {
 	EARLY_FLASH_RESCUE_RESPONSE response_packet;
 
-	serial_fifo_read(&response_packet, sizeof(response_packet));
-	while (response_packet.Acknowledge != 1) {
-		fprintf(stderr, "%s (address 0x%x) NACK'd. Serial port busy...\n",
+	read_response(&response_packet);
+	while (response_packet.Acknowledge != 1 && !session_stopped()) {
+		fprintf(session_err, "%s (address 0x%x) NACK'd. Serial port busy...\n",
 			progress_string, address);
-		serial_fifo_read(&response_packet, sizeof(response_packet));
+		tune_note_error();
+		read_response(&response_packet);
 	}
 }
 
 /* Written with help from
    https://gist.github.com/amullins83/24b5ef48657c08c4005a8fab837b7499/ */
-void draw_progress_bar(uint8_t percent)
+void draw_progress_bar(uint8_t percent, char *status)
 {
 #define BAR_LENGTH	25
 #define PERCENT_TO_CHAR (100 / BAR_LENGTH)
@@ -79,6 +106,6 @@ void draw_progress_bar(uint8_t percent)
 		percent = 100;
 	memset(progress_string + 1, '#', percent / PERCENT_TO_CHAR);
 
-	printf("\b\r%c[2K\r%s", 0x1B, progress_string);
-	fflush(stdout);
+	fprintf(session_out, "\b\r%c[2K\r%s %s", 0x1B, progress_string, status);
+	fflush(session_out);
 }
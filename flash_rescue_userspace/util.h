@@ -6,16 +6,35 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <termios.h>
+#include "flash_rescue_userspace.h"
 
 #define TO_PERCENTAGE(val, total) (100 - (((total - val) * 100) / total))
 
-int serial_open(char *dev, speed_t baud);
+struct transport;
+
+// A session's threads share its link
+struct serial_context {
+	const struct transport *transport;
+	int read_fd;
+	int write_fd;
+};
+
+bool serial_open(char *dev, speed_t baud);
+void serial_close(void);
+bool serial_has_baud_rate(void);
+bool serial_set_speed(speed_t baud);
+void serial_set_low_latency(char *dev);
+void serial_save_context(struct serial_context *context);
+void serial_adopt_context(const struct serial_context *context);
+bool cache_path(char *path, size_t size, char *name);
 void serial_fifo_write(void *data, size_t number_of_bytes);
+void serial_flush(void);
 void serial_fifo_read(void *data, size_t number_of_bytes);
-void bp_switch_baudrate_generator(bool to_high_speed);
-void bp_exit(void);
-void sig_handler(int sig_num);
+bool serial_fifo_read_timeout(void *data, size_t number_of_bytes, int timeout_ms);
+void read_response(EARLY_FLASH_RESCUE_RESPONSE *response_packet);
+bool read_response_timeout(EARLY_FLASH_RESCUE_RESPONSE *response_packet, int timeout_ms);
+void serial_drain(int quiet_ms);
 void wait_for_ack_on(char *progress_string, uint32_t address);
-void draw_progress_bar(uint8_t percent);
+void draw_progress_bar(uint8_t percent, char *status);
 
 #endif
@@ -1,18 +1,48 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
-#include <assert.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <unistd.h>
 #include "flash_rescue_userspace.h"
+#include "session.h"
+#include "trace.h"
 #include "util.h"
 
+// A link to the board. Devices are serial ports, unless prefixed with another transport's name
+// - Only serial ports have a baud rate. The rest carry bytes as fast as both ends can
+struct transport {
+	char *prefix;
+	int (*open)(char *address, speed_t baud, int *write_fd);
+	bool (*set_speed)(int fd, speed_t baud);	// NULL without a baud rate
+	void (*set_low_latency)(char *address, int fd); // NULL when it cannot be lowered
+	void (*drain)(int fd);				// NULL when writes are not held back
+	void (*flush)(int fd);
+};
+
+static _Thread_local const struct transport *transport;
+static _Thread_local int serial_write_dev = -1;
+
+
 /* Written with help from
    https://blog.mbedded.ninja/programming/operating-systems/linux/linux-serial-ports-using-c-cpp/
  */
-int serial_open(char *dev, speed_t baud)
+static int tty_open(char *dev, speed_t baud, int *write_fd)
 {
 	int serial_port;
 	struct termios tty;
@@ -42,6 +72,7 @@ int serial_open(char *dev, speed_t baud)
 	if (tcsetattr(serial_port, TCSANOW, &tty) != 0)
 		goto fail;
 
+	*write_fd = serial_port;
 	return serial_port;
 fail:
 	if (serial_port)
@@ -49,29 +80,348 @@ fail:
 	return -1;
 }
 
-// Cleanup open handles
-void sig_handler(int sig_num)
+static bool tty_set_speed(int fd, speed_t baud)
+{
+	struct termios tty;
+
+	if (tcgetattr(fd, &tty) != 0 || cfsetspeed(&tty, baud) != 0)
+		return false;
+	return tcsetattr(fd, TCSADRAIN, &tty) == 0;
+}
+
+// USB-serial adapters hold received bytes back, delaying every response
+// - FTDI's latency timer defaults to 16ms. Other drivers may honour low-latency mode
+static void tty_set_low_latency(char *dev, int fd)
+{
+	struct serial_struct serial_info;
+	char latency_path[PATH_MAX];
+	char *dev_path;
+	FILE *latency_fp;
+	int latency_ms;
+
+	dev_path = realpath(dev, NULL);
+	if (dev_path != NULL) {
+		snprintf(latency_path, sizeof(latency_path),
+			 "/sys/class/tty/%s/device/latency_timer", basename(dev_path));
+		free(dev_path);
+
+		latency_fp = fopen(latency_path, "r+");
+		if (latency_fp != NULL && fscanf(latency_fp, "%d", &latency_ms) == 1
+		    && latency_ms > 1) {
+			rewind(latency_fp);
+			if (fprintf(latency_fp, "1\n") > 0 && fflush(latency_fp) == 0)
+				fprintf(session_out,
+					"Lowered the adapter's latency timer from %dms to 1ms\n",
+					latency_ms);
+			else
+				fprintf(session_err,
+					"Cannot lower the adapter's %dms latency timer\n",
+					latency_ms);
+		}
+		if (latency_fp != NULL)
+			fclose(latency_fp);
+	}
+
+	if (ioctl(fd, TIOCGSERIAL, &serial_info) == 0
+	    && (serial_info.flags & ASYNC_LOW_LATENCY) == 0) {
+		serial_info.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd, TIOCSSERIAL, &serial_info);
+	}
+}
+
+static void tty_drain(int fd)
+{
+	tcdrain(fd);
+}
+
+static void tty_flush(int fd)
+{
+	tcflush(fd, TCIOFLUSH);
+}
+
+// QEMU's `-serial tcp:`, or a bridge such as ser2net. Small packets must not be delayed
+static int tcp_open(char *address, speed_t baud, int *write_fd)
+{
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *addresses;
+	char host[256];
+	char *port;
+	int no_delay = 1;
+	int fd = -1;
+
+	(void)baud;
+	port = strrchr(address, ':');
+	if (port == NULL || (size_t)(port - address) >= sizeof(host))
+		return -1;
+	snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+
+	// IPv6 addresses are bracketed, as "[::1]:4555"
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+	if (getaddrinfo(host, port + 1, &hints, &addresses) != 0)
+		return -1;
+
+	for (struct addrinfo *ai = addresses; ai != NULL && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+	*write_fd = fd;
+	return fd;
+}
+
+// QEMU's `-serial unix:`, or a simulator listening on a socket
+static int unix_open(char *path, speed_t baud, int *write_fd)
 {
-	if (bios_fp)
-		fclose(bios_fp);
-	if (implementation == 1)
-		bp_exit();
-	if (serial_dev)
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	int fd;
+
+	(void)baud;
+	if (strlen(path) >= sizeof(address.sun_path))
+		return -1;
+	strcpy(address.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	*write_fd = fd;
+	return fd;
+}
+
+// QEMU's `-serial pipe:`. The board reads "<path>.in", and writes "<path>.out"
+// - Opening does not wait for the board's end. Without a reader, the write end fails to open
+static int pipe_open(char *path, speed_t baud, int *write_fd)
+{
+	char fifo_path[PATH_MAX];
+	int read_fd;
+
+	(void)baud;
+	snprintf(fifo_path, sizeof(fifo_path), "%s.out", path);
+	read_fd = open(fifo_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (read_fd < 0)
+		return -1;
+	snprintf(fifo_path, sizeof(fifo_path), "%s.in", path);
+	*write_fd = open(fifo_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (*write_fd < 0) {
+		close(read_fd);
+		return -1;
+	}
+
+	fcntl(read_fd, F_SETFL, fcntl(read_fd, F_GETFL) & ~O_NONBLOCK);
+	fcntl(*write_fd, F_SETFL, fcntl(*write_fd, F_GETFL) & ~O_NONBLOCK);
+	return read_fd;
+}
+
+// Descriptors of an in-process simulator, such as a socketpair. The caller keeps its own
+static int fd_open(char *fds, speed_t baud, int *write_fd)
+{
+	char *separator;
+	char *end;
+	long read_fd, out_fd;
+
+	(void)baud;
+	read_fd = strtol(fds, &separator, 10);
+	if (separator == fds || *separator != ',')
+		return -1;
+	out_fd = strtol(separator + 1, &end, 10);
+	if (end == separator + 1 || *end != '\0' || read_fd < 0 || out_fd < 0)
+		return -1;
+
+	read_fd = fcntl(read_fd, F_DUPFD_CLOEXEC, 0);
+	if (read_fd < 0)
+		return -1;
+	*write_fd = fcntl(out_fd, F_DUPFD_CLOEXEC, 0);
+	if (*write_fd < 0) {
+		close(read_fd);
+		return -1;
+	}
+	return read_fd;
+}
+
+// Links without a driver's buffers hold nothing that was written. Received bytes are read
+static void discard_input(int fd)
+{
+	struct pollfd input_poll = {.fd = fd, .events = POLLIN};
+	uint8_t discarded[256];
+
+	while (poll(&input_poll, 1, 0) > 0 && read(fd, discarded, sizeof(discarded)) > 0)
+		;
+}
+
+// Matched in order. Serial ports have no prefix, so come last
+static const struct transport transports[] = {
+	{"tcp:", tcp_open, NULL, NULL, NULL, discard_input},
+	{"unix:", unix_open, NULL, NULL, NULL, discard_input},
+	{"pipe:", pipe_open, NULL, NULL, NULL, discard_input},
+	{"fd:", fd_open, NULL, NULL, NULL, discard_input},
+	{"", tty_open, tty_set_speed, tty_set_low_latency, tty_drain, tty_flush},
+};
+
+// Open the link to the board as `serial_dev`: "<serial port>", "tcp:<host>:<port>",
+// "unix:<path>", "pipe:<path>" or "fd:<read>,<write>"
+bool serial_open(char *dev, speed_t baud)
+{
+	const struct transport *opened = transports;
+
+	while (strncmp(dev, opened->prefix, strlen(opened->prefix)) != 0)
+		opened++;
+
+	serial_dev = opened->open(dev + strlen(opened->prefix), baud, &serial_write_dev);
+	if (serial_dev < 0)
+		return false;
+	transport = opened;
+	return true;
+}
+
+void serial_close(void)
+{
+	if (serial_write_dev >= 0 && serial_write_dev != serial_dev)
+		close(serial_write_dev);
+	if (serial_dev >= 0)
 		close(serial_dev);
-	_exit(sig_num);
+	serial_dev = -1;
+	serial_write_dev = -1;
+}
+
+// Whether the link has a baud rate to change
+bool serial_has_baud_rate(void)
+{
+	return transport != NULL && transport->set_speed != NULL;
+}
+
+// Change baud rate, once what was written has been sent
+bool serial_set_speed(speed_t baud)
+{
+	if (!serial_has_baud_rate())
+		return false;
+	return transport->set_speed(serial_dev, baud);
+}
+
+void serial_set_low_latency(char *dev)
+{
+	if (transport->set_low_latency != NULL)
+		transport->set_low_latency(dev, serial_dev);
+}
+
+void serial_save_context(struct serial_context *context)
+{
+	context->transport = transport;
+	context->read_fd = serial_dev;
+	context->write_fd = serial_write_dev;
+}
+
+// Another thread of the session uses the link as it is, and must not close it
+void serial_adopt_context(const struct serial_context *context)
+{
+	transport = context->transport;
+	serial_dev = context->read_fd;
+	serial_write_dev = context->write_fd;
+}
+
+// File `name` in the user's cache directory, which is created if need be
+bool cache_path(char *path, size_t size, char *name)
+{
+	char *cache_home = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+
+	if (cache_home != NULL) {
+		snprintf(path, size, "%s/%s", cache_home, name);
+		return true;
+	}
+	if (home == NULL)
+		return false;
+
+	snprintf(path, size, "%s/.cache", home);
+	mkdir(path, 0700);
+	snprintf(path, size, "%s/.cache/%s", home, name);
+	return true;
 }
 
 // Can push into buffer while board handles its pulled data
+// - A cancelled session may still write, so a bridge can be left usable
 void serial_fifo_write(void *data, size_t number_of_bytes)
 {
-	size_t status = write(serial_dev, data, number_of_bytes);
-	assert(status > 0);
-	tcdrain(serial_dev);
+	ssize_t status;
+
+	while (number_of_bytes != 0 && !session_failed()) {
+		status = write(serial_write_dev, data, number_of_bytes);
+		if (status <= 0) {
+			fprintf(session_err, "\nCannot write to the serial port!\n");
+			session_fail();
+			return;
+		}
+		trace_record(TRACE_TO_BOARD, data, status);
+		data = (uint8_t *)data + status;
+		number_of_bytes -= status;
+	}
+	if (transport->drain != NULL)
+		transport->drain(serial_write_dev);
 }
-// Can block while awaiting a busy board
+
+// Discard what the board sent, but was not read
+void serial_flush(void)
+{
+	transport->flush(serial_dev);
+	trace_record(TRACE_FLUSH, NULL, 0);
+}
+
+// Can block while awaiting a busy board. Bulk responses arrive over several reads
+// - Once the session stops, reads return zeroes, which no response acknowledges
 void serial_fifo_read(void *data, size_t number_of_bytes)
 {
+	struct pollfd serial_poll = {.fd = serial_dev, .events = POLLIN};
+	ssize_t status;
+
 	// Do not flush, maintain following FIFO bytes
-	size_t status = read(serial_dev, data, number_of_bytes);
-	assert(status > 0);
+	while (number_of_bytes != 0) {
+		if (session_stopped()) {
+			memset(data, 0, number_of_bytes);
+			return;
+		}
+		if (poll(&serial_poll, 1, SESSION_POLL_MS) <= 0)
+			continue;
+		status = read(serial_dev, data, number_of_bytes);
+		if (status <= 0) {
+			fprintf(session_err, "\nCannot read from the serial port!\n");
+			session_fail();
+			continue;
+		}
+		trace_record(TRACE_TO_HOST, data, status);
+		data = (uint8_t *)data + status;
+		number_of_bytes -= status;
+	}
+}
+
+// Older boards drop unknown commands silently, so probes must not block
+// - Nor must calibration, which may lose bytes. Each read waits at most `timeout_ms`
+bool serial_fifo_read_timeout(void *data, size_t number_of_bytes, int timeout_ms)
+{
+	struct pollfd serial_poll = {.fd = serial_dev, .events = POLLIN};
+	ssize_t status;
+
+	while (number_of_bytes != 0) {
+		if (session_stopped() || poll(&serial_poll, 1, timeout_ms) <= 0)
+			return false;
+		status = read(serial_dev, data, number_of_bytes);
+		if (status <= 0)
+			return false;
+		trace_record(TRACE_TO_HOST, data, status);
+		data = (uint8_t *)data + status;
+		number_of_bytes -= status;
+	}
+	return true;
 }
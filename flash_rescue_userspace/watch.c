@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <libgen.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "flash_rescue_userspace.h"
+#include "session.h"
+#include "watch.h"
+
+static uint64_t monotonic_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * MS_IN_SECOND + now.tv_nsec / (1000 * 1000);
+}
+
+// Snapshot the image, so that a build rewriting it cannot tear this flash
+static uint8_t *snapshot_image(size_t *size)
+{
+	FILE *image_fp;
+	FILE *snapshot_fp;
+	struct stat image_stats;
+	uint8_t *image;
+
+	image_fp = fopen(bios_path, "r");
+	if (image_fp == NULL)
+		return NULL;
+
+	fstat(fileno(image_fp), &image_stats);
+	*size = image_stats.st_size;
+	image = malloc(*size);
+	if (image == NULL || fread(image, 1, *size, image_fp) != *size) {
+		fclose(image_fp);
+		free(image);
+		return NULL;
+	}
+	fclose(image_fp);
+
+	// Flash from the snapshot. It is the board's image once flashed
+	snapshot_fp = tmpfile();
+	if (snapshot_fp == NULL || fwrite(image, 1, *size, snapshot_fp) != *size
+	    || fflush(snapshot_fp) != 0) {
+		if (snapshot_fp != NULL)
+			fclose(snapshot_fp);
+		free(image);
+		return NULL;
+	}
+
+	fclose(bios_fp);
+	bios_fp = snapshot_fp;
+	return image;
+}
+
+// Whether an inotify event replaced or rewrote the image
+static bool image_changed(int inotify_fd, char *image_name)
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	ssize_t length;
+	bool changed = false;
+
+	length = read(inotify_fd, events, sizeof(events));
+	for (char *ptr = events; length > 0 && ptr < events + length;
+	     ptr += sizeof(*event) + event->len) {
+		event = (struct inotify_event *)ptr;
+		if (event->len != 0 && strcmp(event->name, image_name) == 0)
+			changed = true;
+	}
+
+	return changed;
+}
+
+// Keep the board in its polling loop, reflashing changed blocks whenever the image is rebuilt
+// - Keys are read from `control_fd`, unless it is -1. Returns whether the last flash succeeded
+bool watch_image(int control_fd)
+{
+	uint8_t *board_image;
+	uint8_t *image;
+	size_t board_image_size;
+	size_t image_size;
+	char *path_copy;
+	char *image_name;
+	int inotify_fd;
+	struct pollfd fds[2];
+	struct termios saved_tty, tty;
+	bool tty_raw;
+	bool change_pending;
+	bool reset;
+	bool flashed;
+	uint64_t last_keepalive_ms;
+	char key;
+
+	board_image = snapshot_image(&board_image_size);
+	if (board_image == NULL) {
+		fprintf(session_err, "Cannot read %s!\n", bios_path);
+		end_session(board_modified);
+		return false;
+	}
+	if (!perform_flash(NULL)) {
+		free(board_image);
+		end_session(board_modified);
+		return false;
+	}
+	if (!send_keepalive(KEEPALIVE_IDLE_TIMEOUT_S)) {
+		fprintf(session_err, "Board cannot hold the session open. Not watching\n");
+		free(board_image);
+		end_session(board_modified);
+		return true;
+	}
+
+	// Builds usually replace the image, so watch its directory
+	path_copy = strdup(bios_path);
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (path_copy == NULL || inotify_fd < 0
+	    || inotify_add_watch(inotify_fd, dirname(path_copy), IN_CLOSE_WRITE | IN_MOVED_TO)
+		       < 0) {
+		fprintf(session_err, "Cannot watch %s!\n", bios_path);
+		if (inotify_fd >= 0)
+			close(inotify_fd);
+		free(path_copy);
+		free(board_image);
+		end_session(board_modified);
+		return true;
+	}
+	image_name = strrchr(bios_path, '/');
+	image_name = (image_name != NULL) ? image_name + 1 : bios_path;
+
+	// Single keypresses, without echo
+	tty_raw = (control_fd >= 0 && tcgetattr(control_fd, &saved_tty) == 0);
+	if (tty_raw) {
+		tty = saved_tty;
+		tty.c_lflag &= ~(ICANON | ECHO);
+		tcsetattr(control_fd, TCSANOW, &tty);
+	}
+
+	if (control_fd >= 0)
+		fprintf(session_out,
+			"Watching %s. Press 'r' to reset the board, 'q' to leave it running\n",
+			bios_path);
+	else
+		fprintf(session_out, "Watching %s\n", bios_path);
+	fds[0] = (struct pollfd){.fd = inotify_fd, .events = POLLIN};
+	fds[1] = (struct pollfd){.fd = control_fd, .events = POLLIN};
+	change_pending = false;
+	reset = true;
+	flashed = true;
+	last_keepalive_ms = monotonic_ms();
+	while (!session_stopped()) {
+		// Wakes often enough to notice that the session was cancelled
+		if (poll(fds, 2, change_pending ? WATCH_SETTLE_MS : SESSION_POLL_MS) > 0) {
+			if ((fds[0].revents & POLLIN) && image_changed(inotify_fd, image_name))
+				change_pending = true;
+			if (fds[1].revents & POLLIN) {
+				// Without a terminal, only cancelling ends watching
+				if (read(control_fd, &key, 1) != 1)
+					fds[1].fd = -1;
+				else if (key == 'r')
+					break;
+				else if (key == 'q') {
+					reset = false;
+					break;
+				}
+			}
+		} else if (change_pending) {
+			// Quiet for a while, the build has finished writing
+			change_pending = false;
+			image = snapshot_image(&image_size);
+			if (image == NULL) {
+				fprintf(session_err, "Cannot read %s!\n", bios_path);
+				continue;
+			}
+
+			// A resized image must be scanned
+			fprintf(session_out, "\n%s changed\n", bios_path);
+			if (board_image != NULL && image_size != board_image_size) {
+				free(board_image);
+				board_image = NULL;
+			}
+
+			// After a failed flash, the board's contents are unknown
+			flashed = perform_flash(board_image);
+			if (flashed) {
+				free(board_image);
+				board_image = image;
+				board_image_size = image_size;
+			} else {
+				free(board_image);
+				free(image);
+				board_image = NULL;
+			}
+			last_keepalive_ms = monotonic_ms();
+			fprintf(session_out, "Watching %s\n", bios_path);
+		}
+
+		// Other commands keep the board waiting as well
+		if (monotonic_ms() - last_keepalive_ms >= KEEPALIVE_INTERVAL_MS) {
+			send_keepalive(KEEPALIVE_IDLE_TIMEOUT_S);
+			last_keepalive_ms = monotonic_ms();
+		}
+	}
+
+	if (tty_raw)
+		tcsetattr(control_fd, TCSANOW, &saved_tty);
+	close(inotify_fd);
+	free(path_copy);
+	free(board_image);
+
+	if (!reset && board_modified)
+		fprintf(session_out,
+			"Leaving the board running. It still executes the image it booted\n");
+	end_session(reset);
+	return flashed;
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+// Builds write an image in several steps. Flash once it is quiet
+#define WATCH_SETTLE_MS 500
+
+bool watch_image(int control_fd);
+
+#endif